@@ -0,0 +1,229 @@
+/*
+ * kmer_bench: micro benchmarks for kmer_guts.
+ *
+ * It is built from kmer_guts.c itself, so it times the very code the
+ * scanner runs: loading the memory image, kmer lookups and six-frame
+ * translation.  run_bench.pl builds the data and calls it; it can also be
+ * run by hand against any data directory holding a memory image:
+ *
+ *     kmer_bench -D Data [-n lookups] [-b bases] [-r rounds] [-x seed]
+ *
+ *     -D Data     the data directory (function.index, otu.index and
+ *                 kmer.table.mem_map, as for kmer_guts -D)
+ *     -n lookups  lookups per run of each lookup benchmark (default 10000000)
+ *     -b bases    length of the random DNA translated (default 10000000)
+ *     -r rounds   runs of each benchmark; the best is reported (default 3)
+ *     -x seed     seed for the random kmers and DNA (default 1)
+ *
+ * Results are written to stdout one to a line,
+ *
+ *     BENCH <tab> name <tab> value <tab> unit
+ *
+ * and are:
+ *
+ *     load_cold         seconds to load the image after asking the kernel to
+ *                       drop it from the page cache (best effort: pages that
+ *                       are mapped elsewhere stay resident)
+ *     load_warm         seconds to load the image again
+ *     lookup_hit        lookups per second of kmers that are in the table
+ *     lookup_miss       lookups per second of random kmers
+ *     lookup_miss_hits  the fraction of the random kmers that were found
+ *     probes_hit        average probes per lookup, hit-heavy run
+ *     probes_miss       average probes per lookup, miss-heavy run
+ *     filter_hit        lookups per second of kmers in the table, through
+ *                       the prefilter (only if the image has one, see -E)
+ *     filter_miss       lookups per second of random kmers, through the prefilter
+ *     translate         DNA bases per second translated in all six frames
+ */
+
+#define main kmer_guts_main
+#include "../kmer_guts.c"
+#undef main
+
+static unsigned long long bench_seed = 1;
+
+/* xorshift64*; the same seed gives the same kmers and DNA everywhere */
+static unsigned long long bench_random() {
+  bench_seed ^= bench_seed >> 12;
+  bench_seed ^= bench_seed << 25;
+  bench_seed ^= bench_seed >> 27;
+  return bench_seed * 2685821657736338717ULL;
+}
+
+static void report(char *name, double value, char *unit) {
+  printf("BENCH\t%s\t%.6g\t%s\n", name, value, unit);
+  fflush(stdout);
+}
+
+static double time_load(char *dataD, char *fileM, int cold, kmer_handle_t **handle) {
+  if (cold) {
+    int fd = open(fileM, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "open %s failed: %s\n", fileM, strerror(errno));
+      exit(1);
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+  double t0 = now_seconds();
+  *handle = init_kmers(dataD);
+  wait_for_table(*handle);
+  return now_seconds() - t0;
+}
+
+/* the best of rounds runs of n lookups of keys, through the prefilter if
+   filtered; returns lookups per second */
+static double time_lookups(kmer_scan_ctx_t *ctx, unsigned long long *keys, long n, int rounds,
+			   int filtered, long *found, double *probes) {
+  double best = 0;
+  int round;
+  for (round = 0; (round < rounds); round++) {
+    sig_kmer_t entry;
+    long i, hits = 0;
+    unsigned long long lookups0 = ctx->stats.lookups, retries0 = ctx->stats.retries;
+    double t0 = now_seconds();
+    if (filtered) {
+      for (i = 0; (i < n); i++)
+	hits += filter_may_contain(ctx->kmersH, keys[i]) && find_sig_kmer(ctx, ctx->kmersH, keys[i], &entry);
+    }
+    else {
+      for (i = 0; (i < n); i++)
+	hits += find_sig_kmer(ctx, ctx->kmersH, keys[i], &entry);
+    }
+    double t = now_seconds() - t0;
+    if ((best == 0) || (t < best))
+      best = t;
+    *found  = hits;
+    if (ctx->stats.lookups > lookups0)
+      *probes = 1.0 + (double) (ctx->stats.retries - retries0) / (ctx->stats.lookups - lookups0);
+  }
+  return n / best;
+}
+
+/* the best of rounds six-frame translations of seq; returns bases per second */
+static double time_translation(kmer_scan_ctx_t *ctx, char *seq, long ln, int rounds) {
+  double best = 0;
+  int round;
+  alloc_window(ctx);
+  for (round = 0; (round < rounds); round++) {
+    double t0 = now_seconds();
+    int frame;
+    ctx->codon_lo = ctx->codon_hi = 0;
+    for (frame = 0; (frame < 6); frame++) {
+      char strand = (frame < 3) ? '+' : '-';
+      int off = frame % 3;
+      long n_res = (ln - off) / 3;
+      long from, n;
+      for (from = 0; (from < n_res); from += n) {
+	n = (n_res - from < ctx->scan_window) ? (n_res - from) : ctx->scan_window;
+	fill_window(ctx, seq, ln, strand, off, from, n, 0);
+      }
+    }
+    double t = now_seconds() - t0;
+    if ((best == 0) || (t < best))
+      best = t;
+  }
+  return ln / best;
+}
+
+int main(int argc, char *argv[]) {
+  char dataD[300];
+  long n_lookups = 10000000;
+  long n_bases = 10000000;
+  int rounds = 3;
+  char *past;
+  int c;
+
+  dataD[0] = 0;
+  while ((c = getopt(argc, argv, "D:n:b:r:x:")) != -1) {
+    switch (c) {
+    case 'D':
+      snprintf(dataD, sizeof(dataD), "%s", optarg);
+      break;
+    case 'n':
+      n_lookups = strtol(optarg, &past, 0);
+      break;
+    case 'b':
+      n_bases = strtol(optarg, &past, 0);
+      break;
+    case 'r':
+      rounds = strtol(optarg, &past, 0);
+      break;
+    case 'x':
+      bench_seed = strtoull(optarg, &past, 0);
+      break;
+    default:
+      fprintf(stderr, "arguments: -D DataDir [-n lookups] [-b bases] [-r rounds] [-x seed]\n");
+      exit(1);
+    }
+  }
+  if (!dataD[0] || (n_lookups < 1) || (n_bases < 3 * MAX_K) || (rounds < 1)) {
+    fprintf(stderr, "arguments: -D DataDir [-n lookups] [-b bases] [-r rounds] [-x seed]\n");
+    exit(1);
+  }
+  if (bench_seed == 0)
+    bench_seed = 1;
+
+  char fileM[400];
+  snprintf(fileM, sizeof(fileM), "%s/kmer.table.mem_map", dataD);
+
+  kmer_handle_t *kmersH;
+  report("load_cold", time_load(dataD, fileM, 1, &kmersH), "s");
+  report("load_warm", time_load(dataD, fileM, 0, &kmersH), "s");
+
+  kmer_scan_ctx_t ctx;
+  init_scan_ctx(&ctx, kmersH);
+
+  /* hit-heavy: the kmers of occupied slots, in random order */
+  unsigned long long *keys = malloc(n_lookups * sizeof(unsigned long long));
+  long long slot, occupied = 0;
+  for (slot = 0; (slot < kmersH->num_sigs); slot++)
+    occupied += (slot_kmer(kmersH, slot) <= kmersH->max_encoded);
+  if ((keys == 0) || (occupied == 0)) {
+    fprintf(stderr, "no kmers in %s, or no memory for %ld lookups\n", fileM, n_lookups);
+    exit(1);
+  }
+  unsigned long long *present = malloc(occupied * sizeof(unsigned long long));
+  long long np = 0;
+  for (slot = 0; (slot < kmersH->num_sigs); slot++) {
+    unsigned long long which = slot_kmer(kmersH, slot);
+    if (which <= kmersH->max_encoded)
+      present[np++] = which;
+  }
+  long i;
+  for (i = 0; (i < n_lookups); i++)
+    keys[i] = present[bench_random() % np];
+  free(present);
+
+  long found;
+  double probes;
+  double rate = time_lookups(&ctx, keys, n_lookups, rounds, 0, &found, &probes);
+  report("lookup_hit", rate, "lookups/s");
+  report("probes_hit", probes, "probes");
+  if (kmersH->filter)
+    report("filter_hit", time_lookups(&ctx, keys, n_lookups, rounds, 1, &found, &probes), "lookups/s");
+
+  /* miss-heavy: random kmers, nearly all of them absent from a sparse table */
+  for (i = 0; (i < n_lookups); i++)
+    keys[i] = bench_random() % kmersH->max_encoded;
+  rate = time_lookups(&ctx, keys, n_lookups, rounds, 0, &found, &probes);
+  report("lookup_miss", rate, "lookups/s");
+  report("lookup_miss_hits", (double) found / n_lookups, "fraction");
+  report("probes_miss", probes, "probes");
+  if (kmersH->filter)
+    report("filter_miss", time_lookups(&ctx, keys, n_lookups, rounds, 1, &found, &probes), "lookups/s");
+  free(keys);
+
+  char *seq = malloc(n_bases + 1);
+  if (seq == 0) {
+    fprintf(stderr, "could not allocate %ld bases\n", n_bases);
+    exit(1);
+  }
+  for (i = 0; (i < n_bases); i++)
+    seq[i] = "ACGT"[bench_random() >> 62];
+  seq[n_bases] = 0;
+  report("translate", time_translation(&ctx, seq, n_bases, rounds), "bases/s");
+  free(seq);
+  return 0;
+}
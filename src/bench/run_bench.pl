@@ -0,0 +1,358 @@
+#
+# Benchmark kmer_guts on a synthetic data set.
+#
+# The data set is generated from a fixed seed, so that a given set of
+# parameters always produces the same kmers, genome and proteins and runs
+# from different builds can be compared line for line.
+#
+
+use strict;
+use Getopt::Long;
+use Time::HiRes qw(time);
+use File::Path qw(make_path);
+
+=head1 NAME
+
+run_bench
+
+=head1 SYNOPSIS
+
+run_bench [options] > results
+
+=head1 DESCRIPTION
+
+Generates a synthetic C<final.kmers>, C<function.index> and C<otu.index>,
+builds the memory image with C<kmer_guts -w>, runs the C<kmer_bench> micro
+benchmarks against it, and times whole DNA and protein scans of a synthetic
+genome and proteome.  Every result is written as one line
+
+    BENCH <tab> name <tab> value <tab> unit
+
+to stdout (and to the --out file), beginning with the parameters of the
+run.  Besides the C<kmer_bench> results (see kmer_bench.c) these are
+
+    build            seconds for kmer_guts -w
+    image_bytes      the size of the memory image
+    scan_dna         seconds to scan the genome (all six frames)
+    scan_dna_rate    bases per second
+    scan_prot        seconds to scan the proteins (kmer_guts -a)
+    scan_prot_rate   residues per second
+
+and the counters kmer_guts -S reports for each scan, named
+C<scan_dna.lookups>, C<scan_prot.parse_time> and so on.
+
+=head1 COMMAND-LINE OPTIONS
+
+    --dir DIR            where the data set is built (default /tmp/kmer_bench)
+    --guts PATH          the kmer_guts binary (default src/kmer_guts)
+    --bench PATH         the kmer_bench binary (default src/bench/kmer_bench)
+    --kmers N            signature kmers in the data set (default 1000000)
+    --k K                kmer size (default 8)
+    --functions N        functions in function.index (default 5000)
+    --otus N             OTUs in otu.index (default 1000)
+    --genome-bases N     length of the synthetic genome (default 5000000)
+    --proteins N         proteins in the synthetic proteome (default 5000)
+    --hash-size N        kmer_guts -s (default three times --kmers)
+    --scheme S           kmer_guts -I, modulo, robinhood or mph (default modulo)
+    --filter RATE        kmer_guts -E, the prefilter false-positive rate
+                         (default 0, no prefilter)
+    --threads N          kmer_guts -T for the build (default 1)
+    --lookups N          kmer_bench -n (default 10000000)
+    --rounds N           kmer_bench -r (default 3)
+    --seed N             random seed (default 1)
+    --regenerate         rebuild the data set even if it is already there
+    --data-only          only make the data set (final.kmers, function.index,
+                         otu.index, genome.fa and proteins.fa), for tests;
+                         nothing is built or run
+    --out FILE           also write the results to FILE
+
+=cut
+
+my $dir          = "/tmp/kmer_bench";
+my $guts         = "src/kmer_guts";
+my $bench        = "src/bench/kmer_bench";
+my $n_kmers      = 1000000;
+my $k            = 8;
+my $n_functions  = 5000;
+my $n_otus       = 1000;
+my $genome_bases = 5000000;
+my $n_proteins   = 5000;
+my $hash_size;
+my $scheme       = "modulo";
+my $filter       = 0;
+my $threads      = 1;
+my $lookups      = 10000000;
+my $rounds       = 3;
+my $seed         = 1;
+my $regenerate;
+my $data_only;
+my $out_file;
+
+my @aa;                 # for generate()
+my %codons;
+my $rand_state;
+
+GetOptions("dir=s"          => \$dir,
+	   "guts=s"         => \$guts,
+	   "bench=s"        => \$bench,
+	   "kmers=i"        => \$n_kmers,
+	   "k=i"            => \$k,
+	   "functions=i"    => \$n_functions,
+	   "otus=i"         => \$n_otus,
+	   "genome-bases=i" => \$genome_bases,
+	   "proteins=i"     => \$n_proteins,
+	   "hash-size=i"    => \$hash_size,
+	   "scheme=s"       => \$scheme,
+	   "filter=f"       => \$filter,
+	   "threads=i"      => \$threads,
+	   "lookups=i"      => \$lookups,
+	   "rounds=i"       => \$rounds,
+	   "seed=i"         => \$seed,
+	   "regenerate"     => \$regenerate,
+	   "data-only"      => \$data_only,
+	   "out=s"          => \$out_file)
+    or die "Usage: $0 [options] (see the POD in $0)\n";
+
+$hash_size //= 3 * $n_kmers;
+make_path($dir);
+
+my $stamp = "$dir/params";
+my $params = join(" ", $n_kmers, $k, $n_functions, $n_otus, $genome_bases, $n_proteins, $seed);
+if ($regenerate || !-s $stamp || slurp($stamp) ne $params)
+{
+    generate();
+    write_file($stamp, $params);
+}
+exit(0) if $data_only;
+
+-x $guts or die "$guts is not an executable; build it first\n";
+-x $bench or die "$bench is not an executable; build it first\n";
+
+my $out_fh;
+if ($out_file)
+{
+    open($out_fh, ">", $out_file) or die "Cannot write $out_file: $!\n";
+}
+
+sub result
+{
+    my($name, $value, $unit) = @_;
+    my $line = join("\t", "BENCH", $name, $value, $unit) . "\n";
+    print $line;
+    print $out_fh $line if $out_fh;
+}
+
+result("kmers", $n_kmers, "count");
+result("k", $k, "residues");
+result("functions", $n_functions, "count");
+result("otus", $n_otus, "count");
+result("genome_bases", $genome_bases, "bases");
+result("proteins", $n_proteins, "count");
+result("hash_size", $hash_size, "slots");
+result("scheme", $scheme, "name");
+result("filter", $filter, "rate");
+result("seed", $seed, "count");
+
+#
+# Hash build.
+#
+unlink("$dir/kmer.table.mem_map");
+my $t = run_timed("$guts -w -K $k -s $hash_size -I $scheme -E $filter -T $threads -D $dir < /dev/null > /dev/null 2> $dir/build.err");
+result("build", sprintf("%.6f", $t), "s");
+result("image_bytes", -s "$dir/kmer.table.mem_map", "bytes");
+
+#
+# Micro benchmarks.
+#
+open(my $bfh, "-|", "$bench -D $dir -n $lookups -b $genome_bases -r $rounds -x $seed 2> $dir/bench.err")
+    or die "Cannot run $bench: $!\n";
+while (<$bfh>)
+{
+    chomp;
+    my(undef, $name, $value, $unit) = split(/\t/);
+    result($name, $value, $unit);
+}
+close($bfh) or die "$bench failed; see $dir/bench.err\n";
+
+#
+# End-to-end scans.
+#
+scan("scan_dna", "", "$dir/genome.fa", "bases/s");
+scan("scan_prot", "-a", "$dir/proteins.fa", "residues/s");
+
+close($out_fh) if $out_fh;
+
+sub scan
+{
+    my($name, $opts, $input, $unit) = @_;
+    my $size = residues($input);
+    run_timed("$guts -D $dir $opts < $input > /dev/null 2>&1");      # warm the page cache
+    my $t = run_timed("$guts -D $dir $opts -S < $input > $dir/$name.out 2> $dir/$name.err");
+    result($name, sprintf("%.6f", $t), "s");
+    result("${name}_rate", sprintf("%.6g", $size / $t), $unit);
+    open(my $fh, "<", "$dir/$name.err") or die "Cannot read $dir/$name.err: $!\n";
+    while (<$fh>)
+    {
+	chomp;
+	my($tag, $stat, $value) = split(/\t/);
+	next unless $tag eq 'STAT';
+	result("$name.$stat", $value, ($stat =~ /_time$/) ? "s" : ($stat =~ /^bytes/) ? "bytes" : "count");
+    }
+    close($fh);
+}
+
+sub residues
+{
+    my($file) = @_;
+    my $n = 0;
+    open(my $fh, "<", $file) or die "Cannot read $file: $!\n";
+    while (<$fh>)
+    {
+	next if /^>/;
+	chomp;
+	$n += length($_);
+    }
+    close($fh);
+    return $n;
+}
+
+sub run_timed
+{
+    my($cmd) = @_;
+    my $t0 = time;
+    my $rc = system($cmd);
+    $rc == 0 or die "Command failed with rc=$rc: $cmd\n";
+    return time - $t0;
+}
+
+#
+# The data set.  Signature kmers are taken from random "source" proteins;
+# the genome embeds back-translations of some of them (mutated a little)
+# among random DNA, and the proteome is mutated copies of them, so that
+# the scans find hits and CALLs as well as misses.
+#
+
+sub protein_length_mean { 300 }
+
+sub rnd
+{
+    my($n) = @_;
+    # a 31-bit LCG, so the data set does not depend on perl's rand()
+    $rand_state = ($rand_state * 1103515245 + 12345) % 2147483648;
+    return int(($rand_state / 2147483648) * $n);
+}
+
+sub random_protein
+{
+    my $len = protein_length_mean() / 2 + rnd(protein_length_mean());
+    return join("", map { $aa[rnd(20)] } 1 .. $len);
+}
+
+sub mutate
+{
+    my($seq, $rate, $alphabet) = @_;
+    my @s = split(//, $seq);
+    for my $i (0 .. $#s)
+    {
+	$s[$i] = $alphabet->[rnd(scalar @$alphabet)] if rnd(1000) < $rate * 1000;
+    }
+    return join("", @s);
+}
+
+sub back_translate
+{
+    my($prot) = @_;
+    return join("", map { my $c = $codons{$_}; $c->[rnd(scalar @$c)] } split(//, $prot));
+}
+
+sub generate
+{
+    $rand_state = $seed;
+    @aa = split(//, "ACDEFGHIKLMNPQRSTVWY");
+    my @bases = qw(A C G T);
+    my $code = "KNKNTTTTRSRSIIMIQHQHPPPPRRRRLLLLEDEDAAAAGGGGVVVV*Y*YSSSSSCWCLFLF";
+    for my $i (0 .. 63)
+    {
+	my $codon = $bases[$i >> 4] . $bases[($i >> 2) & 3] . $bases[$i & 3];
+	push(@{$codons{substr($code, $i, 1)}}, $codon);
+    }
+
+    open(my $ffh, ">", "$dir/function.index") or die "Cannot write $dir/function.index: $!\n";
+    print $ffh "$_\tsynthetic function $_ (EC 1.1.1.$_)\n" for 0 .. $n_functions - 1;
+    close($ffh);
+
+    open(my $ofh, ">", "$dir/otu.index") or die "Cannot write $dir/otu.index: $!\n";
+    print $ofh "$_\tSynthetic organism $_\n" for 0 .. $n_otus - 1;
+    close($ofh);
+
+    my @sources;
+    my %seen;
+    my $n = 0;
+    open(my $kfh, ">", "$dir/final.kmers") or die "Cannot write $dir/final.kmers: $!\n";
+    while ($n < $n_kmers)
+    {
+	my $prot = random_protein();
+	my $len = length($prot);
+	my $function = rnd($n_functions);
+	push(@sources, $prot);
+	for (my $i = 0; $i + $k <= $len && $n < $n_kmers; $i += 1 + rnd(3))
+	{
+	    my $kmer = substr($prot, $i, $k);
+	    next if $seen{$kmer}++;
+	    printf $kfh "%s\t%d\t%d\t%.3f\t%d\n", $kmer, $len - $i, $function, rnd(2000) / 1000, rnd($n_otus);
+	    $n++;
+	}
+    }
+    close($kfh);
+    undef %seen;
+
+    open(my $pfh, ">", "$dir/proteins.fa") or die "Cannot write $dir/proteins.fa: $!\n";
+    for my $i (0 .. $n_proteins - 1)
+    {
+	print $pfh ">prot$i\n", mutate($sources[rnd(scalar @sources)], 0.02, \@aa), "\n";
+    }
+    print $pfh ">FLUSH\n";
+    close($pfh);
+
+    open(my $gfh, ">", "$dir/genome.fa") or die "Cannot write $dir/genome.fa: $!\n";
+    my $contig = 0;
+    my $left = $genome_bases;
+    while ($left > 0)
+    {
+	my $want = 100000 + rnd(400000);
+	my $seq = "";
+	while (length($seq) < $want)
+	{
+	    $seq .= join("", map { $bases[rnd(4)] } 1 .. rnd(1000));
+	    $seq .= mutate(back_translate($sources[rnd(scalar @sources)]), 0.01, \@bases);
+	}
+	$seq = substr($seq, 0, $left) if length($seq) > $left;
+	$left -= length($seq);
+	print $gfh ">contig$contig\n";
+	for (my $i = 0; $i < length($seq); $i += 80)
+	{
+	    print $gfh substr($seq, $i, 80), "\n";
+	}
+	$contig++;
+    }
+    print $gfh ">FLUSH\n";
+    close($gfh);
+}
+
+sub slurp
+{
+    my($file) = @_;
+    open(my $fh, "<", $file) or return "";
+    local $/;
+    my $txt = <$fh>;
+    close($fh);
+    return $txt;
+}
+
+sub write_file
+{
+    my($file, $txt) = @_;
+    open(my $fh, ">", $file) or die "Cannot write $file: $!\n";
+    print $fh $txt;
+    close($fh);
+}
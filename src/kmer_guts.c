@@ -1,9 +1,8 @@
 /*
 
-kmer_guts.c can be compiled into either a 5-mer or an 8-mer version.  I have 
-labeled the critical changes with 
-
-     ### CHANGE THIS FOR DIFFERING Ks ###
+One kmer_guts binary handles every kmer size from 5 to 8.  K is given
+with -K when the memory map is built and is read back from the map after
+that (see -K below); nothing needs to change in the code.
 
 Note: to run use
 
@@ -11,9 +10,10 @@ Note: to run use
 
 Then use
 
-   kmer_guts -w -D KmerData < input.contigs
+   kmer_guts -w -K 8 -D KmerData < input.contigs
 
-to build an memory map -- it can take 10-15 minutes.
+to build an memory map -- it can take 10-15 minutes.  (-K 8 is the
+default; give -K 5 for a directory of 5-mers.)
 
 Then use
 
@@ -31,6 +31,10 @@ where KmersData is a directory that must contain
        final.kmers     [a file of [kmer,avg-offset-from-end,function-index,otu-index]]
        function.index  [a file of [index,function] pairs]
        otu.index       [a file of [index,otu] pairs]
+
+when the memory map is built.  A version 3 map (see -V) keeps the
+function and OTU names itself, so only kmer.table.mem_map is read after that
+(and kmer.delta.mem_map, a small set of changes to it, if -u made one).
 ----------------
 
 Conceptually, the data associated with each signature Kmer is
@@ -84,18 +88,65 @@ you get a line of the form
 
          OTU-COUNTS cnt1-otu1 cnt2-otu2 ...
 
-This code uses a table indicating which K-mers are signatures. I call this the 
-"kmer_bits" table.  You can run this code for K ranging from 5 to 8.
+listing the OTUs with the most votes (hits) in the whole sequence, most
+first and ties by OTU index.  The counts are exact; -o sets how many OTUs
+are listed.
 
-#################
-The line
+With -R (read classification) none of these lines are written.  -R 1
+writes one line per read,
 
-    #define K 8
+         READ id function-index number-hits weighted-hits otu-index otu-votes
 
-defines the kmer size.  
-The code is intended to work with only 5-mers or 8-mers.  That is:
+(function-index and otu-index are -1 for a read that is not assigned), and
+-R 2 writes, at each >FLUSH and at the end of the input,
+
+         READ-COUNTS reads assigned
+         FUNCTION-READS reads function-index function
+         OTU-READS reads otu-index otu
+
+with a FUNCTION-READS line for each function some read was assigned to
+and an OTU-READS line for each OTU, most reads first and ties by index.
+
+This code uses a table indicating which K-mers are signatures. I call this the 
+"kmer_bits" table.  You can run this code for K ranging from 5 to 8.
 
-YOU MUST SET K TO EITHER 5 OR 8 (sorry).
+K is no longer fixed when the code is compiled.  It is given to -w (see -K),
+recorded in the memory image, and picked up from the image when it is
+loaded, so one binary serves 5-mer and 8-mer datasets alike.  The scan loop
+is compiled once for each K, so the choice costs nothing per kmer.
+
+BINARY OUTPUT (-B 1 or -B 2)
+
+Instead of the lines above, the output can be a stream of records, each a
+one-byte type, a four-byte payload length and the payload.  All integers
+are unsigned and little-endian; weights are IEEE floats.
+
+         'S'  sequence      u32 length, u8 is-protein, then the id
+         'T'  translation   u8 strand ('+' or '-'), u8 offset
+         'C'  call          u32 start, u32 end, u32 number-hits, u32 function-index,
+                            f32 weighted-hits
+         'O'  OTU counts    u32 n, then n pairs of u32 count, u32 otu-index
+         'F'  flush         (empty; written where the text output has //)
+         'D'  dictionary    u32 n, then n pairs of u32 length, function
+                            (-B 2 only: sent once, before anything else)
+         'R'  read          u32 function-index, u32 number-hits, f32 weighted-hits,
+                            u32 otu-index, u32 otu-votes, then the id (-R 1)
+         'A'  abundances    u32 reads, u32 assigned, u32 n, n pairs of u32 reads,
+                            u32 function-index, u32 m, m pairs of u32 reads,
+                            u32 otu-index (-R 2)
+
+Calls carry the function index only; -B 2 supplies the strings.  Debugging
+output (-d) is text and is not written in binary mode.
+
+In either mode output is held in a large buffer and written when the buffer
+fills or at a >FLUSH, rather than after every sequence.
+
+LIBRARY
+
+The same code builds libkmerguts (with -DKMER_GUTS_LIBRARY; see the
+Makefile), which scans sequences held in memory and hands back the calls
+and OTU counts through callbacks instead of printing them.  kmer_guts.h
+declares its interface.
 ############################################
 
 COMMAND LINE ARGUMENTS:
@@ -118,14 +169,158 @@ COMMAND LINE ARGUMENTS:
                 and when you use it to search
 
     -w          write the memory map (means Data must contain final.kmers and the indexes
+                (a delta left from the old map is removed)
+
+    -u          write a delta, kmer.delta.mem_map, from Data/delta.kmers: the
+                changes to final.kmers since the map was built, as final.kmers
+                lines for kmers added or changed and "kmer<tab>-" lines for
+                kmers deleted.  Names appended to function.index and
+                otu.index since then go into the delta too (the names the
+                map has may not change).  The delta is small, is sized by
+                itself (-s and -E do not apply) and is read alongside the
+                map whenever Data is opened; its kmers take the place of the
+                map's.  -u again replaces it, so delta.kmers should hold
+                every change since the map was built.
+
+    -c          compact: fold the delta into a new memory map (same size,
+                version, organization and prefilter rate, unless the kmers
+                no longer fit or -E or -V is given) and remove the delta.
+
+    -V version  the memory map version written by -w (default 3) or -c
+                (default the version of the old map).  Version 2 packs each
+                slot into 16 bytes, half the size of version 1.  Version 3
+                is version 2 with the function and OTU names of
+                function.index and otu.index stored after the table, so that
+                loading it reads nothing but the image.  All three versions
+                can be loaded; versions 1 and 2 still need the index files in
+                the Data directory.
+
+    -B mode	output format: 0 text (the default), 1 binary records,
+		2 binary records preceded by the function dictionary.
+
+    -K k	the kmer size (5 to 8) of final.kmers, used by -w and recorded in
+		the image (default 8).  Version 1 images do not record K; they
+		are loaded with this K.
+
+    -o N        list the N OTUs with the most votes on each OTU-COUNTS line
+                (default 5; 0 lists every OTU that got a vote).
+
+    -E rate     with -w, also build a prefilter (a blocked Bloom filter of the
+                stored kmers) with the given false-positive rate, e.g. 0.01,
+                about 10 bits per kmer.  Kmers it rules out are never looked
+                up in the table.  Version 3 only; the default, 0, builds none.
+
+    -I scheme   the hash table organization written by -w: modulo (the default;
+                encodedK % HashSize with linear probing) or robinhood (a
+                power-of-two table, multiplicative hashing and Robin Hood
+                probing; version 2 only, HashSize is rounded up to a power of
+                two) or mph (a minimal perfect hash: the table has exactly
+                one slot per kmer, so -s is not needed, and a lookup reads
+                one slot; version 2 only, and each kmer may be listed only
+                once).  The scheme is recorded in the image.
 
     -l port	Run in server mode, listening on the given port. If port = 0, pick a port
+		A connection may start with an option line (-a -d -m -M -O -g -F
+		-W -B -o -R -S) that applies to it.  With -p on that line the connection
+		is persistent: it carries any number of requests, each an
+		optional option line, its sequences and a line "//", and the
+		output of each request ends with a //.  Requests may be sent
+		back to back; results are written by a separate thread while
+		the next request is scanned.
+
+    -S		Print the scan counters to stderr at the end of the run, one
+		"STAT name value" line each: sequences, kmer lookups, hits,
+		probe retries and a histogram of probes per lookup, kmers
+		skipped for stops or ambiguity codes, CALLs, bytes read and
+		written, and seconds spent parsing, translating, scanning and
+		writing output.  On a server option line, -S writes the
+		counters of all workers added up (plus the number of workers
+		and the uptime) after the OK line; the request then proceeds
+		as usual.
+
+    -G pages	how the table is held in memory: mapped (the default; the image
+		file is mapped and paged in), thp (copied into anonymous memory
+		backed by transparent huge pages) or hugetlb (copied into
+		explicit huge pages, which must be reserved beforehand, e.g.
+		with vm.nr_hugepages; falls back to thp).  Huge pages cut the
+		TLB misses of random probes into a large table.
+
+    -Y		lock the table in memory (mlock) once it is loaded.
+
+    -N policy	NUMA placement of the table: interleave (across all nodes)
+		or local (to the thread that loads each part of it).
+
+    -A		start scanning stdin while the table is still being paged in
+		(mapped tables only).  The table is paged in by -T threads,
+		which report progress every few seconds; without -A scanning
+		waits for them.  A server always waits: it binds its port at
+		once but publishes it (the "Listening on" line and the -L
+		file) only when the table is in memory.
 
     -L pfile	When running in server mode, write the port number into the given file
+
+    -b list	Batch mode: scan many FASTA files, each into its own output
+		file, on -T threads against the one table.  list is a
+		manifest, one input to a line ("input", or "input<tab>output"),
+		or a directory whose files are the inputs.  Each output is
+		written as output.tmp and renamed when it is complete.  The
+		list is refused, before the table is loaded, if an output
+		(or its .tmp) would overwrite an input or two inputs would
+		share an output.  A line per input (seconds, sequences,
+		bytes, calls and OK or the error) and a TOTAL line go to
+		stdout at the end; the exit status is 1 if any input failed.
+
+    -r OutDir	with -b, where the outputs go (named after their inputs)
+		unless the manifest names them.  It is created if need be.
+
+    -j MB	Sort-merge scanning, for jobs that would make too many random
+		lookups into a table that is not in memory.  Sequences are
+		scanned in batches of about MB megabytes (1 to 256): the
+		kmers of a batch are sorted and merged against
+		Data/kmer.sorted, a copy of the table's kmers in kmer order
+		that is read from start to finish once per batch.  The
+		output is that of an ordinary scan.  kmer.sorted is made
+		from the table (and delta) the first time -j is used and
+		again whenever they change (-w, -u and -c remove it);
+		otherwise the table is not paged in.  Making it reads the
+		table twice and sorts it in pieces of at most 64 MB.  A
+		batch needs about 40 bytes of memory per base of DNA, 20
+		per residue of protein.  For stdin and -b scans, not -l or
+		-G thp/hugetlb; -F does not apply.
+
+    -R mode	Read classification, for short reads (0, the default, makes
+		CALLs as usual).  Each read is assigned the function with
+		the most hits over all its frames (ties to the greater
+		weight, then the lower index), if it has at least -m hits
+		of summed weight -M, and the OTU with the most votes among
+		those hits.  Mode 1 writes a READ line per read; mode 2
+		writes only the READ-COUNTS, FUNCTION-READS and OTU-READS
+		tables (see above).  -S counts assigned reads as CALLs,
+		and the time spent parsing, scanning and writing reads,
+		clocked every 1024 reads rather than for each, as
+		scan_time.
+		Not with -j; -g, -O and -F do not apply.
+
+    -T threads	When running in server mode, the number of worker threads.  Each
+		worker accepts connections on the shared port and scans them with
+		its own scan context; all workers share one memory map.  With
+		-b, the number of files scanned at once.  With -w,
+		the number of threads used to build the memory map.  Also the
+		number of threads that page in (or copy, see -G) the table.
+
+    -F MinLen	Scan the six frames of contigs of at least MinLen bases on
+		separate threads (0, the default, scans them serially).  The
+		output is identical to a serial scan.
+
+    -W Window	Translate and scan each frame Window residues at a time
+		(default 1048576).  Memory use is set by the window and the
+		length of the longest sequence read; there is no fixed
+		limit on contig length.
 */
 
 
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -141,6 +336,16 @@ COMMAND LINE ARGUMENTS:
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdarg.h>
+
+#include "kmer_guts.h"
 
 /* parameters to main -- accessed globally */
 int debug = 0;
@@ -150,22 +355,20 @@ long long size_hash =  1400303159; /* 1400303159  tot_lookups=13474100 retry=298
                                    /* 2147483648  tot_lookups=13474100 retry=1736650  */
 			           /* 1073741824  tot_lookups=13474100 retry=4728020  */
 int write_mem_map = 0;
+int write_delta = 0;               /* -u */
+int compact_table = 0;             /* -c */
 char *data_dir;
 
-#define K 8
-#define MAX_SEQ_LEN 500000000
-
-#if K == 5 
-const CORE = 20L*20L*20L*20L;
-#endif
-#if K == 8
-const unsigned long long CORE = 20L*20L*20L*20L*20L*20L*20L;
-#endif
+#define MIN_K 5
+#define MAX_K 8
+int kmer_size = 8;
 
-#define MAX_ENCODED CORE*20L 
+/* pow20[i] = 20^i; with a constant K, pow20[K-1] folds to a constant */
+static const unsigned long long pow20[MAX_K+1] = {
+  1ULL, 20ULL, 400ULL, 8000ULL, 160000ULL, 3200000ULL, 64000000ULL,
+  1280000000ULL, 25600000000ULL
+};
 
-static int tot_lookups = 0;
-static int retry  = 0;
 
 
 const  char genetic_code[64] = {
@@ -188,23 +391,167 @@ typedef struct sig_kmer {
   float function_wt;
 } sig_kmer_t;
 
-#define VERSION 1
+/*
+ * Version 2 images store each slot as a packed 16-byte record rather than
+ * the padded 32-byte sig_kmer_t of version 1:
+ *
+ *    lo  bits  0-34   which_kmer     (20^8 + 1 fits in 35 bits)
+ *        bits 35-58   function_index (24 bits)
+ *        bits 59-63   otu_index, low 5 bits
+ *    hi  bits  0-31   function_wt    (the float, bit for bit)
+ *        bits 32-47   avg_from_end
+ *        bits 48-63   otu_index, high 16 bits
+ */
+typedef struct sig_kmer_v2 {
+  unsigned long long lo;
+  unsigned long long hi;
+} sig_kmer_v2_t;
+
+#define V2_KMER_BITS 35
+#define V2_FI_BITS   24
+#define V2_OI_BITS   21
+#define V2_KMER_MASK ((1ULL << V2_KMER_BITS) - 1)
+#define V2_MAX_FI    ((1ULL << V2_FI_BITS) - 1)
+#define V2_MAX_OI    ((1ULL << V2_OI_BITS) - 1)
+
+/* the function index of a kmer a delta deletes (see -u) */
+#define DELTA_DELETED V2_MAX_FI
+
+#define VERSION 3          /* the version written by -w (see -V) */
+#define OLDEST_VERSION 1   /* the oldest version we can still load */
+
+int write_version = VERSION;
+int version_given = 0;             /* -V was given; otherwise -c keeps the old version */
+
 typedef struct kmer_memory_image {
   unsigned long long num_sigs;
   unsigned long long entry_size;
   long long  version;
 } kmer_memory_image_t;
 
+/* version 2 headers carry their own size; the table starts that many bytes
+   into the file, which keeps it aligned to a cache line */
+typedef struct kmer_memory_image_v2 {
+  kmer_memory_image_t base;
+  unsigned long long header_size;
+  unsigned long long num_loaded;     /* signature kmers stored in the table */
+  unsigned long long hash_scheme;    /* HASH_MODULO, HASH_ROBIN_HOOD or HASH_MPH */
+  unsigned long long max_probe;      /* longest probe sequence of any stored kmer */
+  unsigned long long total_probe;    /* sum of the probe lengths of all stored kmers */
+  unsigned long long kmer_size;      /* K (headers without it hold 8-mers) */
+  unsigned long long strings_offset; /* version 3: where the string tables start, */
+  unsigned long long strings_size;   /* just past the hash table, and their size */
+  unsigned long long filter_offset;  /* version 3: the prefilter (see -E), after the */
+  unsigned long long filter_size;    /* strings on a cache line boundary; 0 if none */
+  unsigned long long base_id;        /* a delta (see -u): the fingerprint of its base; */
+  unsigned long long first_function; /* the indexes of its first function and OTU */
+  unsigned long long first_otu;      /* names.  All three are 0 in a base image. */
+  unsigned long long mph_offset;     /* HASH_MPH: the perfect hash, after the strings */
+  unsigned long long mph_size;       /* on a cache line boundary (the prefilter follows) */
+  unsigned long long build_id;       /* drawn at random by each build (see image_fingerprint) */
+  unsigned long long reserved[5];    /* keeps the header a multiple of a cache line */
+} kmer_memory_image_v2_t;
+
+/*
+ * The function and OTU names.  A table is count offsets into a blob of
+ * NUL-terminated strings; name i starts at strings + offsets[i].  Version 3
+ * images carry both tables, functions then OTUs, each stored as
+ *
+ *     u64 count, u64 blob size, u64 offsets[count], the blob (padded to 8 bytes)
+ *
+ * and use them where they lie in the image.  For older images they are
+ * read from function.index and otu.index at startup.  The names a delta
+ * adds are its own tables, hung off the base's as appended.
+ */
+typedef struct string_table {
+  unsigned long long count;
+  const unsigned long long *offsets;
+  const char *strings;
+  unsigned long long size;           /* bytes of strings */
+  const struct string_table *appended; /* names count and on, or 0 */
+} string_table_t;
+
+static inline unsigned long long table_count(const string_table_t *t) {
+  return t->count + (t->appended ? t->appended->count : 0);
+}
+
+static inline const char *table_string(const string_table_t *t, unsigned long long i) {
+  if (i >= t->count) {
+    i -= t->count;
+    t  = t->appended;
+  }
+  return t->strings + t->offsets[i];
+}
+
+/*
+ * Table organizations.  HASH_MODULO is the original encodedK % size_hash
+ * with linear probing (the only choice for version 1 images).
+ * HASH_ROBIN_HOOD uses a power-of-two table, takes the home slot from the
+ * high bits of a multiplicative hash (no division), and keeps probe
+ * sequences short with Robin Hood displacement: a lookup can stop as soon
+ * as it reaches an entry nearer its own home than the kmer sought would be.
+ * With 16-byte slots and a cache-line aligned table, four slots share a
+ * line, so nearly every probe sequence stays within one or two lines.
+ * HASH_MPH has no empty slots at all: a minimal perfect hash of the
+ * stored kmers (see build_mph) gives each its own slot of a table exactly
+ * as long as the kmer count, and a lookup reads that one slot.  The kmer
+ * kept in the slot is the fingerprint that turns away every other kmer.
+ */
+#define HASH_MODULO     0
+#define HASH_ROBIN_HOOD 1
+#define HASH_MPH        2
+
+#define FIB_HASH_MULT 0x9E3779B97F4A7C15ULL
+
+int write_hash_scheme = HASH_MODULO;
+
 typedef struct kmer_handle {
-  sig_kmer_t *kmer_table;
+  int version;
+  int k;                           /* the kmer size, MIN_K..MAX_K */
+  unsigned long long max_encoded;  /* 20^k: no kmer encodes above it, so
+				      larger values mark empty slots */
+  sig_kmer_t *kmer_table;          /* version 1 */
+  sig_kmer_v2_t *packed_table;     /* version 2 */
   unsigned long long num_sigs;
-  char **function_array;   /* indexed by fI */
-  char **otu_array;        /* OTU indexes point at a representation of multiple OTUs */
+  int hash_scheme;
+  int hash_shift;                  /* HASH_ROBIN_HOOD: 64 - log2(num_sigs) */
+  unsigned long long hash_mask;    /* HASH_ROBIN_HOOD: num_sigs - 1 */
+  unsigned long long mph_seed;     /* HASH_MPH: see build_mph */
+  unsigned long long mph_buckets;
+  unsigned long long mph_positions;
+  const void *mph_pilots;          /* one per bucket, mph_pilot_bytes each */
+  int mph_pilot_bytes;
+  const unsigned long long *mph_remap; /* positions num_sigs and up, to slots */
+  unsigned long long max_probe;
+  const unsigned long long *filter; /* the prefilter's blocks, or 0 */
+  unsigned long long filter_blocks;
+  int filter_hashes;
+  string_table_t functions;        /* indexed by fI */
+  string_table_t otus;             /* OTU indexes point at a representation of multiple OTUs */
+  unsigned long long fingerprint;  /* identifies the image (see image_fingerprint) */
+  unsigned long long base_id;      /* a delta: its base's fingerprint, and the */
+  unsigned long long first_function; /* indexes of its first names; 0 otherwise */
+  unsigned long long first_otu;
+  struct kmer_handle *delta;       /* the delta applied to this table, or 0 */
+
+  char *image;                     /* the image, mapped or copied (see -G) */
+  unsigned long long image_size;
+  char *image_map;                 /* what was mapped for it, for munmap */
+  unsigned long long image_map_size;
+  int image_fd;
+  int image_copied;
+  unsigned long long warm_next;    /* the next chunk for a warm-up thread */
+  unsigned long long warm_done;    /* bytes paged in or copied */
+  int ready;                       /* the whole table is in memory */
+  pthread_mutex_t ready_lock;
+  pthread_cond_t  ready_cond;
+  pthread_t warm_thread;
 } kmer_handle_t;
 
 /* the following stuff was added to condense sets of hits to specific calls.
-   The basic strategy is to use a set of global variables to retain state and flush
-   calls (bad, bad, bad...).
+   It used to be kept in global variables; it now lives in a kmer_scan_ctx_t
+   so that several requests can be scanned at once against a single memory
+   map (one context per server worker thread).
 */
 
 typedef struct hit {
@@ -215,29 +562,193 @@ typedef struct hit {
   float function_wt;
 } hit_t;
 
-#define MAX_HITS_PER_SEQ 40000
-static hit_t hits[MAX_HITS_PER_SEQ]; 
-static int   num_hits = 0;
-
-#define OI_BUFSZ 5
-struct otu_count {
-    int oI;
-    int count;
-} oI_counts[OI_BUFSZ];
-static int num_oI = 0;
-
-static int   current_fI;
-static char  current_id[300];
-static int   current_length_contig;
-static char  current_strand;
-static short current_prot_off;
+#define HITS_BUFSZ 4096            /* initial size of the hits buffer, which grows */
+
+#define OTU_REPORT 5               /* default number of OTUs in OTU-COUNTS (see -o) */
+
+/*
+ * Counters kept by every scan context, always on.  Each thread only
+ * updates its own; the server adds them up on request (-S), reading them
+ * without locks, so figures taken while requests are running are
+ * approximate.  Times are seconds of the scanning thread (frame threads
+ * included), with output formatting taken out of the scan time.
+ */
+#define PROBE_HIST 16              /* probe lengths 0 .. PROBE_HIST-2, and longer */
+
+typedef struct scan_stats {
+  unsigned long long sequences;
+  unsigned long long lookups;
+  unsigned long long hits;
+  unsigned long long filtered;     /* kmers the prefilter kept out of the table */
+  unsigned long long retries;      /* probes past the first, over all lookups */
+  unsigned long long probe_hist[PROBE_HIST];
+  unsigned long long ambig_skips;  /* kmer offsets passed over for stops or ambiguity */
+  unsigned long long calls;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  double parse_time;
+  double translate_time;
+  double scan_time;
+  double output_time;
+} scan_stats_t;
+
+/* counts by function or OTU index, for -R; seen lists the indexes counted,
+   so that a tally is read and cleared in time proportional to them */
+typedef struct read_tally {
+  int   *counts;
+  float *weights;                  /* summed kmer weights, for a read's functions */
+  int   *seen;
+  int    num_seen;
+  int    size;
+} read_tally_t;
+
+struct kmer_scan_ctx {
+  kmer_handle_t *kmersH;
+
+  /* tunables -- initialized from the command line, and may be overridden
+     per request by the option line in server mode */
+  int   aa;
+  int   hits_only;
+  int   debug;
+  int   order_constraint;
+  int   min_hits;
+  int   min_weighted_hits;
+  int   max_gap;
+  int   binary_output;             /* 0 = text, 1 = records, 2 = records + dictionary */
+  int   persistent;                /* server: the connection carries many requests */
+  int   dictionary_sent;           /* -B 2: the dictionary has gone out on this output */
+  const kmer_callbacks_t *callbacks; /* library scans: results go here, not to the output */
+  int   alloc_failed;              /* library scans: memory ran out (see scan_alloc_failed) */
+  int   otu_report;                /* OTUs in the OTU-COUNTS line, 0 = all of them */
+  int   classify;                  /* -R: 0 = calls, 1 = a line per read, 2 = abundance tables */
+
+  /* reduction state for the sequence being scanned */
+  hit_t *hits;
+  int   num_hits;
+  int   hits_size;
+  /* exact OTU tally for the sequence being scanned: otu_counts[oI] is the
+     number of votes for oI, and otu_seen lists the OTUs with any, so that a
+     vote costs one increment and the tally is reported and cleared in time
+     proportional to the OTUs seen.  The arrays are kept from sequence to
+     sequence and only grow. */
+  int  *otu_counts;
+  int  *otu_seen;
+  int   num_otu_seen;
+  int   otu_counts_size;
+  kmer_otu_count_t *otu_top;       /* the report, most votes first */
+  int   current_fI;
+  /* running totals of the hits for current_fI in the set, kept as the
+     hits arrive so that deciding on a CALL needs no pass over the set */
+  int   fI_hits;
+  float fI_weight;
+  int   fI_last;                   /* index in hits of the last of them */
+  char  current_id[300];
+  int   current_length_contig;
+  char  current_strand;
+  short current_prot_off;
+
+  /* scan window: residues are translated and scanned scan_window at a time */
+  long  scan_window;
+  long  window_size;
+  char *pseq;
+  unsigned char *pIseq;
+  int  *ambig;                     /* offsets of the residues with index 20 */
+
+  /* codon codes (see codon_codes) for bases [codon_lo,codon_hi) of the
+     contig being scanned, shared by its six frames */
+  unsigned char *codons;
+  long  codons_size;
+  long  codon_lo;
+  long  codon_hi;
+
+  scan_stats_t stats;
+
+  /* library scans: the sequence, compacted (see compact_residues) */
+  char  *input;
+  size_t input_size;
+
+  /* contigs of at least this many bases get one thread per frame (0 = never) */
+  int   parallel_frames_min;
+  struct kmer_scan_ctx *frame_ctx[6];
+
+  /* -j: sequences are gathered into batches of about join_residues
+     residues and scanned by sort-merge (0 = looked up one by one) */
+  long  join_residues;
+  struct join_batch *join;
+
+  /* -R: the hits of the read being classified, by function, and the OTU
+     votes of its best function's hits; with -R 2, the reads assigned to
+     each function and OTU since the last tables were written */
+  read_tally_t read_functions;
+  read_tally_t read_otus;
+  read_tally_t batch_functions;
+  read_tally_t batch_otus;
+  unsigned long long batch_reads;
+  unsigned long long batch_assigned;
+
+  /* used only in a frame context: the frame's output and its OTU votes,
+     which are merged into the parent in frame order */
+  char  *out_buf;
+  size_t out_len;
+  FILE  *out;
+  int    log_otu_votes;
+  int   *otu_votes;
+  int    num_otu_votes;
+  int    otu_votes_size;
+};
+
+/* defaults for the tunables in kmer_scan_ctx_t, set from the command line */
 static int   order_constraint = 0;
 static int   min_hits = 5;
 static int   min_weighted_hits = 0;
 static int   max_gap  = 200;
+static int   num_threads = 1;
+static int   parallel_frames_min = 0;
+static long  scan_window = 1048576;
+static int   binary_output = 0;
+static int   otu_report = OTU_REPORT;
+static long  join_residues = 0;
+static int   classify = 0;
+#define OUTPUT_BUFSZ (1 << 20)
+#define MAX_SCAN_WINDOW (1 << 28)
 
+/*
+ * Block-buffered input.  Input is read with read(2) in large blocks into a
+ * buffer that grows to hold the largest record; a sequence is located
+ * with memchr, uppercased and stripped of whitespace in place, and handed
+ * to process_seq/process_aa_seq as a pointer into the buffer.  The same
+ * reader serves stdin and server sockets.
+ */
+typedef struct fasta_reader {
+  int    fd;
+  char  *buf;
+  size_t size;       /* bytes allocated */
+  size_t start;      /* first unconsumed byte */
+  size_t end;        /* one past the last byte read */
+  int    eof;
+  int    got_gt;     /* the '>' of the next header has been consumed */
+  int    requests;   /* a "//" line ends a request (persistent connections) */
+  int    error;      /* errno of a failed read, or 0 */
+  unsigned long long bytes_read;  /* since the scan context last took the count */
+  char   id[2000];
+} fasta_reader_t;
+
+#define READER_BLOCK (4 * 1024 * 1024)
+
+#define FASTA_EOF   0
+#define FASTA_SEQ   1
+#define FASTA_FLUSH 2
+#define FASTA_END   3   /* the "//" that ends a request */
+
+void init_scan_ctx(kmer_scan_ctx_t *ctx, kmer_handle_t *kmersH);
+void reset_scan_options(kmer_scan_ctx_t *ctx);
 void run_accept_loop(kmer_handle_t *kmersH, in_port_t port, char *port_file, pid_t parent);
-void run_from_filehandle(kmer_handle_t *kmersH, FILE *fh_in, FILE *fh_out);
+void init_reader(fasta_reader_t *r, int fd);
+void reader_attach(fasta_reader_t *r, int fd);
+void free_reader(fasta_reader_t *r);
+int  run_from_reader(kmer_scan_ctx_t *ctx, fasta_reader_t *r, FILE *fh_out);
+struct batch *load_batch(char *list, char *out_dir);
+int  run_batch(kmer_handle_t *kmersH, struct batch *b, int show_stats);
 
 /* =========================== end of reduction global variables ================= */
 
@@ -397,27 +908,16 @@ char c;
 }
 
 
-void rev_comp(char *data,char *cdata) {
-
-  int n = strlen(data);
-  char *p  = data + (n-1);
-  char *pc = cdata;
-  while (n--) {
-    *(pc++) = compl(*(p--));
-  }
-  *pc = 0;
-}
-
-unsigned long long encoded_kmer(unsigned char *p) {
+static inline unsigned long long encoded_kmer(unsigned char *p, const int k) {
   unsigned long long encodedK = *p;
   int i;
-  for (i=1; (i <= K-1); i++) {
+  for (i=1; (i <= k-1); i++) {
     encodedK = (encodedK * 20) + *(p+i);
   }
 
-  if (encodedK > MAX_ENCODED) {
+  if (encodedK >= pow20[k]) {
     fprintf(stderr,"bad encoding - input must have included invalid characters\n");
-    for (i=0; (i < K); i++) {
+    for (i=0; (i < k); i++) {
       fprintf(stderr,"%d ",*(p+i));
     }
     fprintf(stderr,"\n");
@@ -426,24 +926,24 @@ unsigned long long encoded_kmer(unsigned char *p) {
   return encodedK;
 }
 
-unsigned long long encoded_aa_kmer(char *p)
+unsigned long long encoded_aa_kmer(char *p, int k)
 {
-  unsigned char aa_off[K];
+  unsigned char aa_off[MAX_K] = { 0 };   /* k is MIN_K..MAX_K; zeroed so -O2 need not prove it */
   int j;
-  for (j=0; (j < K); j++) {
+  for (j=0; (j < k); j++) {
     int prot_c = *(p+j);
     aa_off[j] = to_amino_acid_off(prot_c);
   }
-  return encoded_kmer(aa_off);
+  return encoded_kmer(aa_off,k);
 }
 
-void decoded_kmer(unsigned long long encodedK,char *decoded) {
+void decoded_kmer(unsigned long long encodedK,int k,char *decoded) {
   
   int i;
-  *(decoded+K) = '\0';
+  *(decoded+k) = '\0';
   unsigned long long x = encodedK;
 
-  for (i=K-1; (i >= 0); i--) {
+  for (i=k-1; (i >= 0); i--) {
     *(decoded+i) = prot_alpha[x % 20];
     x = x / 20;
   }
@@ -478,99 +978,496 @@ char c;
     }
 }
 
-void translate(char *seq,int off,char *pseq, unsigned char *pIseq) {
-
-  int i;
-  int max = strlen(seq) - 3;
-  char *p = pseq;
-  unsigned char *pI = pIseq;
-  for (i=off; (i <= max); ) {
-    int c1 = dna_char(seq[i++]);
-    int c2 = dna_char(seq[i++]);
-    int c3 = dna_char(seq[i++]);
-    if ((c1 < 4) && (c2 < 4) && (c3 < 4)) {
-      int I = (c1 * 16) + (c2 * 4) + c3;
-      char prot_c = genetic_code[I];
-      *(p++) = prot_c;
-      *(pI++) = to_amino_acid_off(prot_c);
+/*
+ * Translation tables.  A codon is coded as the 6-bit index into
+ * genetic_code of its three bases, with CODON_AMBIG set if any of them
+ * is not one of acgtu.  codon_res maps such a code straight to a residue
+ * index (20 for stops and ambiguous codons), and rc_codon_res maps the
+ * code of the three bases at seq[q..q+2] to the residue of their reverse
+ * complement, so that all six frames can be read off one array of codes.
+ */
+#define CODON_AMBIG 0x40
+
+static unsigned char base_code[256];     /* 0-3, or CODON_AMBIG */
+static unsigned char aa_code[256];       /* to_amino_acid_off() of every byte */
+static unsigned char codon_res[128];
+static unsigned char rc_codon_res[128];
+static char codon_aa[128];
+static char rc_codon_aa[128];
+static pthread_once_t dna_tables_once = PTHREAD_ONCE_INIT;
+
+void init_dna_tables() {
+  int c;
+  for (c=0; (c < 256); c++) {
+    int b = dna_char(c);
+    base_code[c] = (b < 4) ? b : CODON_AMBIG;
+    aa_code[c]   = to_amino_acid_off(c);
+  }
+  for (c=0; (c < 128); c++) {
+    if (c & CODON_AMBIG) {
+      codon_aa[c] = rc_codon_aa[c] = 'x';
     }
     else {
-      *(p++)  = 'x';
-      *(pI++) = 20;
+      int rc = ((3 - (c & 3)) << 4) | ((3 - ((c >> 2) & 3)) << 2) | (3 - (c >> 4));
+      codon_aa[c]    = genetic_code[c];
+      rc_codon_aa[c] = genetic_code[rc];
     }
+    codon_res[c]    = to_amino_acid_off(codon_aa[c]);
+    rc_codon_res[c] = to_amino_acid_off(rc_codon_aa[c]);
+  }
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * codes[q-lo] = the code of the codon seq[q..q+2], for q in [lo,hi).
+ * seq must extend to hi+2.  This is the one pass over the DNA; it is done
+ * 32 (AVX2) or 16 (SSE2) positions at a time where the compiler allows.
+ */
+void codon_codes(char *seq, long lo, long hi, unsigned char *codes) {
+  long q = lo;
+
+#if defined(__AVX2__)
+#define BASE_CODES(v) ({						\
+    __m256i c_  = _mm256_and_si256(v, _mm256_set1_epi8((char) 0xdf));	\
+    __m256i a_  = _mm256_cmpeq_epi8(c_, _mm256_set1_epi8('A'));		\
+    __m256i cc_ = _mm256_cmpeq_epi8(c_, _mm256_set1_epi8('C'));		\
+    __m256i g_  = _mm256_cmpeq_epi8(c_, _mm256_set1_epi8('G'));		\
+    __m256i t_  = _mm256_or_si256(_mm256_cmpeq_epi8(c_, _mm256_set1_epi8('T')), \
+				  _mm256_cmpeq_epi8(c_, _mm256_set1_epi8('U'))); \
+    __m256i ok_ = _mm256_or_si256(_mm256_or_si256(a_, cc_), _mm256_or_si256(g_, t_)); \
+    _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(cc_, _mm256_set1_epi8(1)), \
+				    _mm256_and_si256(g_, _mm256_set1_epi8(2))), \
+		    _mm256_or_si256(_mm256_and_si256(t_, _mm256_set1_epi8(3)), \
+				    _mm256_andnot_si256(ok_, _mm256_set1_epi8(CODON_AMBIG)))); })
+
+  __m256i three = _mm256_set1_epi8(3);
+  for ( ; (q + 32 <= hi); q += 32) {
+    __m256i b0 = BASE_CODES(_mm256_loadu_si256((__m256i *) (seq + q)));
+    __m256i b1 = BASE_CODES(_mm256_loadu_si256((__m256i *) (seq + q + 1)));
+    __m256i b2 = BASE_CODES(_mm256_loadu_si256((__m256i *) (seq + q + 2)));
+    __m256i amb = _mm256_and_si256(_mm256_or_si256(_mm256_or_si256(b0, b1), b2),
+				   _mm256_set1_epi8(CODON_AMBIG));
+    __m256i code = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(b0, three), 4),
+				   _mm256_slli_epi16(_mm256_and_si256(b1, three), 2));
+    code = _mm256_or_si256(code, _mm256_or_si256(_mm256_and_si256(b2, three), amb));
+    _mm256_storeu_si256((__m256i *) (codes + q - lo), code);
   }
-  *p = 0;
-  *pI = 21;
-  if (debug >= 3) {
-    fprintf(stderr,"len-seq=%d max=%d p=%ld\n",(int) strlen(seq),max,p-pseq);
+#undef BASE_CODES
+#elif defined(__SSE2__)
+#define BASE_CODES(v) ({						\
+    __m128i c_  = _mm_and_si128(v, _mm_set1_epi8((char) 0xdf));		\
+    __m128i a_  = _mm_cmpeq_epi8(c_, _mm_set1_epi8('A'));			\
+    __m128i cc_ = _mm_cmpeq_epi8(c_, _mm_set1_epi8('C'));			\
+    __m128i g_  = _mm_cmpeq_epi8(c_, _mm_set1_epi8('G'));			\
+    __m128i t_  = _mm_or_si128(_mm_cmpeq_epi8(c_, _mm_set1_epi8('T')),	\
+			       _mm_cmpeq_epi8(c_, _mm_set1_epi8('U')));	\
+    __m128i ok_ = _mm_or_si128(_mm_or_si128(a_, cc_), _mm_or_si128(g_, t_)); \
+    _mm_or_si128(_mm_or_si128(_mm_and_si128(cc_, _mm_set1_epi8(1)),	\
+			      _mm_and_si128(g_, _mm_set1_epi8(2))),	\
+		 _mm_or_si128(_mm_and_si128(t_, _mm_set1_epi8(3)),	\
+			      _mm_andnot_si128(ok_, _mm_set1_epi8(CODON_AMBIG)))); })
+
+  __m128i three = _mm_set1_epi8(3);
+  for ( ; (q + 16 <= hi); q += 16) {
+    __m128i b0 = BASE_CODES(_mm_loadu_si128((__m128i *) (seq + q)));
+    __m128i b1 = BASE_CODES(_mm_loadu_si128((__m128i *) (seq + q + 1)));
+    __m128i b2 = BASE_CODES(_mm_loadu_si128((__m128i *) (seq + q + 2)));
+    __m128i amb = _mm_and_si128(_mm_or_si128(_mm_or_si128(b0, b1), b2),
+				_mm_set1_epi8(CODON_AMBIG));
+    __m128i code = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b0, three), 4),
+				_mm_slli_epi16(_mm_and_si128(b1, three), 2));
+    code = _mm_or_si128(code, _mm_or_si128(_mm_and_si128(b2, three), amb));
+    _mm_storeu_si128((__m128i *) (codes + q - lo), code);
+  }
+#undef BASE_CODES
+#endif
+
+  for ( ; (q < hi); q++) {
+    int b0 = base_code[(unsigned char) seq[q]];
+    int b1 = base_code[(unsigned char) seq[q+1]];
+    int b2 = base_code[(unsigned char) seq[q+2]];
+    codes[q - lo] = (((b0 & 3) << 4) | ((b1 & 3) << 2) | (b2 & 3)) | ((b0 | b1 | b2) & CODON_AMBIG);
   }
 }
 
-#define MAX_FUNC_OI_INDEX 1000000
-#define MAX_FUNC_OI_VALS  100000000
+/*
+ * Translate n codons of one frame of seq (ln bases), starting with codon
+ * number first, into residue indexes in ctx->pIseq (and, if letters is
+ * set, residue letters in ctx->pseq).  The frames on the '-' strand are
+ * those of the reverse complement, read through rc_codon_res.  The codon
+ * codes are computed once for as much of the contig as ctx->codons holds
+ * and shared by all six frames; ctx->codon_hi = 0 marks them stale.
+ * The offsets of residues with index 20 are listed in ctx->ambig.
+ */
+void translate_window(kmer_scan_ctx_t *ctx,char *seq,long ln,char strand,int off,
+		      long first,long n,int letters) {
+  long last_q = ln - 3;
+  long qlo, qhi, i;
+
+  pthread_once(&dna_tables_once, init_dna_tables);
+  if (strand == '+') {
+    qlo = off + 3 * first;
+    qhi = off + 3 * (first + n - 1);
+  }
+  else {
+    qlo = last_q - off - 3 * (first + n - 1);
+    qhi = last_q - off - 3 * first;
+  }
+  if ((qlo < ctx->codon_lo) || (qhi >= ctx->codon_hi)) {
+    long cap = ctx->codons_size;
+    if (last_q + 1 <= cap) {
+      ctx->codon_lo = 0;
+      ctx->codon_hi = last_q + 1;
+    }
+    else if (strand == '+') {
+      ctx->codon_lo = qlo;
+      ctx->codon_hi = (qlo + cap < last_q + 1) ? qlo + cap : last_q + 1;
+    }
+    else {
+      ctx->codon_lo = (qhi + 1 - cap > 0) ? qhi + 1 - cap : 0;
+      ctx->codon_hi = qhi + 1;
+    }
+    codon_codes(seq,ctx->codon_lo,ctx->codon_hi,ctx->codons);
+  }
 
-char **load_indexed_ar(char *filename,int *sz) {
-  char **index_ar = malloc(MAX_FUNC_OI_INDEX * sizeof(char *));
-  char *vals      = malloc(MAX_FUNC_OI_VALS);
-  char *p         = vals;
-  FILE *ifp      = fopen(filename,"r");
-  if (ifp == NULL) { 
-    fprintf(stderr,"could not open %s\n",filename);
-    exit(1);
+  unsigned char *pI  = ctx->pIseq;
+  int *amb = ctx->ambig;
+  int na = 0;
+  if (strand == '+') {
+    unsigned char *code = ctx->codons + (qlo - ctx->codon_lo);
+    for (i=0; (i < n); i++) {
+      unsigned char r = codon_res[code[3*i]];
+      pI[i] = r;
+      amb[na] = i;
+      na += (r == 20);
+    }
+    if (letters)
+      for (i=0; (i < n); i++)
+	ctx->pseq[i] = codon_aa[code[3*i]];
+  }
+  else {
+    unsigned char *code = ctx->codons + (qhi - ctx->codon_lo);
+    for (i=0; (i < n); i++) {
+      unsigned char r = rc_codon_res[code[-3*i]];
+      pI[i] = r;
+      amb[na] = i;
+      na += (r == 20);
+    }
+    if (letters)
+      for (i=0; (i < n); i++)
+	ctx->pseq[i] = rc_codon_aa[code[-3*i]];
   }
+  amb[na] = INT_MAX;
+}
 
-  *sz = 0;
-  int j;
-  while ((fscanf(ifp,"%d\t",&j) == 1) && fgets(p,1000,ifp)) {
-    if (*sz != j) {
-      fprintf(stderr,"Your index must be dense and in order (see line %ld, should be %d)\n",p-vals,*sz);
-      exit(1);
+/* read an index file (lines "N<tab>name" with N = 0, 1, 2, ...) into t;
+   returns 0, or -1 with the reason in err */
+int load_string_table(char *filename, string_table_t *t, char *err, size_t err_len) {
+  FILE *ifp = fopen(filename,"r");
+  if (ifp == NULL) { 
+    snprintf(err,err_len,"could not open %s",filename);
+    return -1;
+  }
+  struct stat sbuf;
+  if (fstat(fileno(ifp), &sbuf) == -1) {
+    snprintf(err,err_len,"stat %s failed: %s", filename, strerror(errno));
+    fclose(ifp);
+    return -1;
+  }
+  unsigned long long size = sbuf.st_size;
+  char *buf = malloc(size + 1);
+  if ((buf == 0) || (fread(buf, 1, size, ifp) != size)) {
+    snprintf(err,err_len,"could not read %s",filename);
+    free(buf);
+    fclose(ifp);
+    return -1;
+  }
+  fclose(ifp);
+  buf[size] = '\0';
+
+  /* the names are left where they are in buf, each with its newline made a NUL */
+  unsigned long long n = 0, cap = 1024;
+  unsigned long long *offsets = malloc(cap * sizeof(unsigned long long));
+  char *p = buf, *end = buf + size;
+  while (p < end) {
+    char *q;
+    long long j = strtoll(p, &q, 10);
+    if (q == p)
+      break;
+    if (j != (long long) n) {
+      snprintf(err,err_len,"Your index %s must be dense and in order (see index %lld, should be %lld)",
+	       filename, j, n);
+      free(offsets);
+      free(buf);
+      return -1;
+    }
+    while ((q < end) && ((*q == '\t') || (*q == ' ')))
+      q++;
+    char *eol = memchr(q, '\n', end - q);
+    if (eol == 0)
+      eol = end;
+    *eol = '\0';
+    if (n == cap) {
+      cap *= 2;
+      offsets = realloc(offsets, cap * sizeof(unsigned long long));
     }
-    /* fprintf(stderr,"%d is %s\n",*sz,p); */
-    index_ar[*sz] = p;               /* the fgets leaves the \n at the end of each line */
-    p += strlen(index_ar[*sz]) -1;
-    *(p++) = '\0';
-    if ((*sz >= MAX_FUNC_OI_INDEX) || ((p-vals) > (MAX_FUNC_OI_VALS - 1000))) {
-      fprintf(stderr,"Your function or oI index arrays are too small; bump MAX_FUNC_OI_INDEX and MAX_FUNC_OI_VALS\n");
+    if (offsets == 0) {
+      fprintf(stderr,"could not allocate the index of %s\n",filename);
       exit(1);
     }
+    offsets[n++] = q - buf;
+    p = eol + 1;
+  }
+  t->count   = n;
+  t->offsets = realloc(offsets, (n ? n : 1) * sizeof(unsigned long long));
+  t->strings = buf;
+  t->size    = size + 1;
+  t->appended = 0;
+  return 0;
+}
+
+void free_string_table(string_table_t *t) {
+  free((void *) t->offsets);
+  free((void *) t->strings);
+  memset(t, 0, sizeof(*t));
+}
+
+/* the bytes a table takes in an image */
+unsigned long long string_table_bytes(const string_table_t *t) {
+  unsigned long long i, blob = 0, n = table_count(t);
+  for (i=0; (i < n); i++)
+    blob += strlen(table_string(t,i)) + 1;
+  return 16 + 8 * n + ((blob + 7) & ~7ULL);
+}
 
-    *sz += 1;
+/* write t into an image at dst, packing the names; returns the bytes written */
+unsigned long long write_string_table(char *dst, const string_table_t *t) {
+  unsigned long long n = table_count(t);
+  unsigned long long *hdr = (unsigned long long *) dst;
+  char *blob = dst + 16 + 8 * n;
+  unsigned long long i, off = 0;
+  for (i=0; (i < n); i++) {
+    const char *name = table_string(t,i);
+    unsigned long long l = strlen(name) + 1;
+    hdr[2 + i] = off;
+    memcpy(blob + off, name, l);
+    off += l;
   }
-  return index_ar;
+  hdr[0] = n;
+  hdr[1] = off;
+  memset(blob + off, 0, ((off + 7) & ~7ULL) - off);
+  return 16 + 8 * n + ((off + 7) & ~7ULL);
+}
+
+/* point t at a table in an image, checking that it lies within [p, end);
+   returns the end of the table, or 0 if it is damaged */
+char *attach_string_table(char *p, char *end, string_table_t *t) {
+  unsigned long long *hdr = (unsigned long long *) p;
+  unsigned long long i;
+  if ((end - p < 16) || (hdr[0] > (unsigned long long) (end - p - 16) / 8) ||
+      (hdr[1] > (unsigned long long) (end - p) - 16 - 8 * hdr[0]) ||
+      ((hdr[1] > 0) && p[16 + 8 * hdr[0] + hdr[1] - 1]))
+    return 0;
+  t->count   = hdr[0];
+  t->size    = hdr[1];
+  t->offsets = hdr + 2;
+  t->strings = p + 16 + 8 * hdr[0];
+  for (i=0; (i < t->count); i++)
+    if (t->offsets[i] >= t->size)
+      return 0;
+  return p + 16 + 8 * hdr[0] + ((hdr[1] + 7) & ~7ULL);
+}
+
+/* the packed version 2 records are converted to and from a sig_kmer_t */
+void unpack_sig_kmer(const sig_kmer_v2_t *e, sig_kmer_t *out) {
+  union { unsigned int u; float f; } wt;
+
+  out->which_kmer     = e->lo & V2_KMER_MASK;
+  out->function_index = (int) ((e->lo >> V2_KMER_BITS) & V2_MAX_FI);
+  out->otu_index      = (int) ((e->lo >> 59) | ((e->hi >> 48) << 5));
+  out->avg_from_end   = (unsigned short) (e->hi >> 32);
+  wt.u = (unsigned int) e->hi;
+  out->function_wt    = wt.f;
+}
+
+void pack_sig_kmer(const sig_kmer_t *in, sig_kmer_v2_t *e) {
+  union { unsigned int u; float f; } wt;
+  unsigned long long oI = (unsigned long long) in->otu_index;
+
+  wt.f  = in->function_wt;
+  e->lo = (in->which_kmer & V2_KMER_MASK) |
+          (((unsigned long long) in->function_index & V2_MAX_FI) << V2_KMER_BITS) |
+          ((oI & 0x1f) << 59);
+  e->hi = (unsigned long long) wt.u |
+          ((unsigned long long) in->avg_from_end << 32) |
+          ((oI >> 5) << 48);
+}
+
+/* a 64-bit mixer (murmur3's finalizer), for the prefilter and the perfect hash */
+static inline unsigned long long filter_hash(unsigned long long x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/* x scaled into [0, n) by its high bits, without a division */
+static inline unsigned long long fast_range(unsigned long long x, unsigned long long n) {
+  return ((unsigned __int128) x * n) >> 64;
+}
+
+/* HASH_MPH: the bucket of kmer hash h, and where pilot sends h */
+static inline unsigned long long mph_bucket(kmer_handle_t *kmersH, unsigned long long h) {
+  return fast_range(h, kmersH->mph_buckets);
+}
+
+static inline unsigned long long mph_position(unsigned long long h, unsigned long long pilot, unsigned long long positions) {
+  return fast_range(filter_hash(h ^ (pilot * FIB_HASH_MULT)), positions);
+}
+
+static inline unsigned long long mph_pilot(kmer_handle_t *kmersH, unsigned long long bucket) {
+  if (kmersH->mph_pilot_bytes == 2)
+    return ((const unsigned short *) kmersH->mph_pilots)[bucket];
+  else
+    return ((const unsigned int *) kmersH->mph_pilots)[bucket];
+}
+
+/* the one slot encodedK can be in */
+static inline unsigned long long mph_slot(kmer_handle_t *kmersH, unsigned long long encodedK) {
+  unsigned long long h = filter_hash(encodedK ^ kmersH->mph_seed);
+  unsigned long long p = mph_position(h, mph_pilot(kmersH, mph_bucket(kmersH, h)), kmersH->mph_positions);
+  return (p < kmersH->num_sigs) ? p : kmersH->mph_remap[p - kmersH->num_sigs];
+}
+
+/* the kmer held in slot i, for either version of the table */
+static inline unsigned long long slot_kmer(kmer_handle_t *kmersH, long long i) {
+  if (kmersH->version == 1)
+    return kmersH->kmer_table[i].which_kmer;
+  else
+    return kmersH->packed_table[i].lo & V2_KMER_MASK;
 }
 
-char **load_functions(char *file) {
-  int sz;
-  return load_indexed_ar(file,&sz);
+/* the slot at which a probe for encodedK starts */
+static inline unsigned long long home_slot(kmer_handle_t *kmersH, unsigned long long encodedK) {
+  if (kmersH->hash_scheme == HASH_ROBIN_HOOD)
+    return (encodedK * FIB_HASH_MULT) >> kmersH->hash_shift;
+  else if (kmersH->hash_scheme == HASH_MPH)
+    return mph_slot(kmersH,encodedK);
+  else
+    return encodedK % kmersH->num_sigs;
 }
 
-char **load_otus(char *file) {
-  int sz;
-  return load_indexed_ar(file,&sz);
+/* how far slot i is from the home slot of the kmer it holds */
+static inline unsigned long long probe_distance(kmer_handle_t *kmersH, unsigned long long i, unsigned long long encodedK) {
+  unsigned long long home = home_slot(kmersH,encodedK);
+  if (kmersH->hash_scheme == HASH_ROBIN_HOOD)
+    return (i - home) & kmersH->hash_mask;
+  else
+    return (i >= home) ? (i - home) : (i + kmersH->num_sigs - home);
 }
 
-long long find_empty_hash_entry(sig_kmer_t sig_kmers[],unsigned long long encodedK) {
-    long long hash_entry = encodedK % size_hash;
-    while (sig_kmers[hash_entry].which_kmer <= MAX_ENCODED)
-      hash_entry = (hash_entry+1)%size_hash;
+long long find_empty_hash_entry(kmer_handle_t *kmersH,unsigned long long encodedK) {
+    long long hash_entry = encodedK % kmersH->num_sigs;
+    while (slot_kmer(kmersH,hash_entry) <= kmersH->max_encoded)
+      hash_entry = (hash_entry+1)%kmersH->num_sigs;
     return hash_entry;
 }
 
-long long lookup_hash_entry(sig_kmer_t sig_kmers[],unsigned long long encodedK) {
-    long long  hash_entry = encodedK % size_hash;
-    // printf("%lld\n", size_hash);
-    if (debug >= 2)
-      tot_lookups++;
+/*
+ * Robin Hood insertion of a packed entry: walk forward from the home slot,
+ * and whenever the resident of a slot is closer to its home than the entry
+ * we are carrying, leave the carried entry there and carry on with the
+ * resident instead.  If end is not NO_SLOT_LIMIT the walk may not reach
+ * slot end (the builder's partitions); the entry being carried when it
+ * would is returned in *spill, with a 0 return.
+ */
+#define NO_SLOT_LIMIT (~0ULL)
+
+int insert_robin_hood(kmer_handle_t *kmersH, sig_kmer_v2_t *entry, unsigned long long end, sig_kmer_v2_t *spill) {
+  sig_kmer_v2_t carry = *entry;
+  unsigned long long carry_kmer = carry.lo & V2_KMER_MASK;
+  unsigned long long i = home_slot(kmersH,carry_kmer);
+  unsigned long long dist = 0;
+
+  while (1) {
+    unsigned long long which = slot_kmer(kmersH,i);
+    if (which > kmersH->max_encoded) {
+      kmersH->packed_table[i] = carry;
+      return 1;
+    }
+    unsigned long long resident_dist = probe_distance(kmersH,i,which);
+    if (resident_dist < dist) {
+      sig_kmer_v2_t tmp = kmersH->packed_table[i];
+      kmersH->packed_table[i] = carry;
+      carry = tmp;
+      carry_kmer = which;
+      dist = resident_dist;
+    }
+    i = (i + 1) & kmersH->hash_mask;
+    dist++;
+    if ((end != NO_SLOT_LIMIT) && ((i == end) || (i == 0))) {
+      *spill = carry;
+      return 0;
+    }
+  }
+}
+
+static inline void count_probes(kmer_scan_ctx_t *ctx, unsigned long long dist) {
+  ctx->stats.lookups++;
+  ctx->stats.retries += dist;
+  ctx->stats.probe_hist[(dist < PROBE_HIST - 1) ? dist : PROBE_HIST - 1]++;
+}
+
+long long lookup_robin_hood(kmer_scan_ctx_t *ctx,kmer_handle_t *kmersH,unsigned long long encodedK) {
+    unsigned long long hash_entry = home_slot(kmersH,encodedK);
+    unsigned long long dist;
+    long long found = -1;
+
+    for (dist = 0; (dist <= kmersH->max_probe); dist++) {
+      unsigned long long which = slot_kmer(kmersH,hash_entry);
+      if (which == encodedK) {
+	found = hash_entry;
+	break;
+      }
+      if ((which > kmersH->max_encoded) || (probe_distance(kmersH,hash_entry,which) < dist))
+	break;
+      hash_entry = (hash_entry + 1) & kmersH->hash_mask;
+    }
+    if (ctx)
+      count_probes(ctx, dist);
+    return found;
+}
+
+/* the slot holding encodedK, or -1; the probes are counted in ctx's
+   stats unless ctx is 0 (lookups in a delta) */
+long long lookup_hash_entry(kmer_scan_ctx_t *ctx,kmer_handle_t *kmersH,unsigned long long encodedK) {
+    if (kmersH->hash_scheme == HASH_ROBIN_HOOD)
+      return lookup_robin_hood(ctx,kmersH,encodedK);
+    if (kmersH->hash_scheme == HASH_MPH) {
+      unsigned long long i = mph_slot(kmersH,encodedK);
+      if (ctx)
+	count_probes(ctx, 0);
+      return (slot_kmer(kmersH,i) == encodedK) ? (long long) i : -1;
+    }
+
+    long long  hash_entry = encodedK % kmersH->num_sigs;
+    unsigned long long dist = 0;
 
-    while ((sig_kmers[hash_entry].which_kmer <= MAX_ENCODED) && (sig_kmers[hash_entry].which_kmer != encodedK)) {
-      if (debug >= 2)
-	retry++;
+    unsigned long long which;
+    while (((which = slot_kmer(kmersH,hash_entry)) <= kmersH->max_encoded) && (which != encodedK)) {
+      dist++;
       hash_entry++;
-      if (hash_entry == size_hash)
+      if (hash_entry == kmersH->num_sigs)
 	hash_entry = 0;
     }
-    if (sig_kmers[hash_entry].which_kmer > MAX_ENCODED) {
+    if (ctx)
+      count_probes(ctx, dist);
+    if (which > kmersH->max_encoded) {
       return -1;
     }
     else {
@@ -578,496 +1475,3544 @@ long long lookup_hash_entry(sig_kmer_t sig_kmers[],unsigned long long encodedK)
     }
 }
 
-kmer_memory_image_t *load_raw_kmers(char *file,unsigned long long num_entries, unsigned long long *alloc_sz) {
-  /*
-   * Allocate enough memory to hold the kmer_memory_image_t header plus the hash table itself.
-   */
-  *alloc_sz = sizeof(kmer_memory_image_t) + (sizeof(sig_kmer_t) * num_entries);
-
-  kmer_memory_image_t *image = malloc(*alloc_sz);
+/* start pulling encodedK's home slot into the cache ahead of its lookup.
+   A perfect hash must read the bucket's pilot to find the slot, so that
+   is what is fetched; prefetch_mph_slot then fetches the slot. */
+static inline void prefetch_hash_entry(kmer_handle_t *kmersH,unsigned long long encodedK) {
+  if (kmersH->hash_scheme == HASH_MPH) {
+    unsigned long long b = mph_bucket(kmersH, filter_hash(encodedK ^ kmersH->mph_seed));
+    __builtin_prefetch((const char *) kmersH->mph_pilots + b * kmersH->mph_pilot_bytes);
+    return;
+  }
+  unsigned long long hash_entry = home_slot(kmersH,encodedK);
+  if (kmersH->version == 1)
+    __builtin_prefetch(&kmersH->kmer_table[hash_entry]);
+  else
+    __builtin_prefetch(&kmersH->packed_table[hash_entry]);
+}
 
-  /*
-   * Initialize our table pointer to the first byte after the header.
-   */
-  image->num_sigs = num_entries;
-  image->entry_size = sizeof(sig_kmer_t);
-  image->version = (long long) VERSION;
+static inline void prefetch_mph_slot(kmer_handle_t *kmersH,unsigned long long encodedK) {
+  __builtin_prefetch(&kmersH->packed_table[mph_slot(kmersH,encodedK)]);
+}
 
-  sig_kmer_t *sig_kmers = (sig_kmer_t *) (image + 1);
+/*
+ * The prefilter.  Most kmers scanned, above all in the non-coding frames
+ * of a genome, are not in the table, and each of those lookups is still a
+ * trip to DRAM.  -w -E builds a blocked Bloom filter of the stored kmers
+ * and keeps it in the image: each kmer sets filter_hashes bits in a single
+ * 64-byte block, so testing it costs one cache line, and a filter of ~10
+ * bits per kmer is small enough to stay largely in the last-level cache.
+ * A kmer the filter rules out never touches the table.
+ */
+#define FILTER_BLOCK_BITS 512
+#define FILTER_BLOCK_WORDS (FILTER_BLOCK_BITS / 64)
+#define FILTER_HEADER 64           /* num_blocks, num_hashes, padding */
+#define FILTER_MAX_HASHES 16
+
+double filter_rate = 0;            /* -E: 0 builds no filter */
+
+/* the block of kmer h = filter_hash(encodedK); the bits within it come from its low bits */
+static inline const unsigned long long *filter_block(kmer_handle_t *kmersH, unsigned long long h) {
+  return kmersH->filter + FILTER_BLOCK_WORDS * fast_range(h, kmersH->filter_blocks);
+}
 
-  FILE *ifp      = fopen(file,"r");
-  if (ifp == NULL) { 
-    fprintf(stderr,"could not open %s",file);
-    exit(1);
+static inline int filter_test(const unsigned long long *block, unsigned long long h, int nh) {
+  unsigned int a = h & (FILTER_BLOCK_BITS - 1);
+  unsigned int b = ((h >> 9) & (FILTER_BLOCK_BITS - 1)) | 1;
+  int i;
+  for (i=0; (i < nh); i++) {
+    unsigned int pos = (a + i * b) & (FILTER_BLOCK_BITS - 1);
+    if (!(block[pos >> 6] & (1ULL << (pos & 63))))
+      return 0;
   }
+  return 1;
+}
 
-  long long i;
-  for (i=0; (i < size_hash); i++)
-    sig_kmers[i].which_kmer = MAX_ENCODED + 1;
-
-  char kmer_string[K+1];
-  int end_off;
-  int fI;
-  float f_wt;
-  int oI;
-  long long loaded = 0;
-  while (fscanf(ifp,"%s\t%d\t%d\t%f\t%d",
-		kmer_string,&end_off,&fI,&f_wt,&oI) >= 4) {
-    unsigned long long encodedK = encoded_aa_kmer(kmer_string);
-    long long hash_entry = find_empty_hash_entry(sig_kmers,encodedK);
-    loaded++;
-    if (loaded >= (size_hash / 2)) {
-      fprintf(stderr,"Your Kmer hash is half-full; use -s (and -w) to bump it\n");
-      exit(1);
-    }
-    sig_kmers[hash_entry].which_kmer     = encodedK;
-    sig_kmers[hash_entry].avg_from_end   = end_off;
-    sig_kmers[hash_entry].function_index = fI;
-    sig_kmers[hash_entry].otu_index      = oI;
-    sig_kmers[hash_entry].function_wt    = f_wt;
+static inline void filter_add(kmer_handle_t *kmersH, unsigned long long encodedK) {
+  unsigned long long h = filter_hash(encodedK);
+  unsigned long long *block = (unsigned long long *) filter_block(kmersH, h);
+  unsigned int a = h & (FILTER_BLOCK_BITS - 1);
+  unsigned int b = ((h >> 9) & (FILTER_BLOCK_BITS - 1)) | 1;
+  int i;
+  for (i=0; (i < kmersH->filter_hashes); i++) {
+    unsigned int pos = (a + i * b) & (FILTER_BLOCK_BITS - 1);
+    if (!(block[pos >> 6] & (1ULL << (pos & 63))))
+      __sync_fetch_and_or(&block[pos >> 6], 1ULL << (pos & 63));
   }
-  if (debug >= 2)
-    fprintf(stderr,"loaded %lld kmers\n",loaded);
-
-  return image;
 }
 
-kmer_handle_t *init_kmers(char *dataD) {
-  kmer_handle_t *handle = malloc(sizeof(kmer_handle_t));
+/* 0 if encodedK is certainly not in the table.  The prefilter only knows
+   the base table, so kmers a delta adds are let through as well. */
+static inline int filter_may_contain(kmer_handle_t *kmersH, unsigned long long encodedK) {
+  unsigned long long h;
+  if (kmersH->filter == 0)
+    return 1;
+  h = filter_hash(encodedK);
+  return filter_test(filter_block(kmersH, h), h, kmersH->filter_hashes) ||
+         (kmersH->delta && (lookup_hash_entry(0,kmersH->delta,encodedK) >= 0));
+}
 
-  kmer_memory_image_t *image;
+char *hash_scheme_name(int scheme) {
+  return (scheme == HASH_ROBIN_HOOD) ? "robinhood" : (scheme == HASH_MPH) ? "mph" : "modulo";
+}
 
-  char file[300];
-  strcpy(file,dataD);
-  strcat(file,"/function.index");
-  handle->function_array = load_functions(file);
+/* set up the hash parameters for a table of num_sigs slots */
+void set_hash_scheme(kmer_handle_t *kmersH, int scheme) {
+  kmersH->hash_scheme = scheme;
+  if (scheme == HASH_ROBIN_HOOD) {
+    int bits = 0;
+    while ((1ULL << bits) < kmersH->num_sigs)
+      bits++;
+    kmersH->hash_shift = 64 - bits;
+    kmersH->hash_mask  = kmersH->num_sigs - 1;
+  }
+}
 
-  strcpy(file,dataD);
-  strcat(file,"/otu.index");
-  handle->otu_array      = load_otus(file);
+/* probe lengths (slots examined by a successful lookup) over the whole table */
+void probe_length_stats(kmer_handle_t *kmersH, unsigned long long *max_probe, unsigned long long *total_probe) {
+  unsigned long long i;
+  *max_probe = *total_probe = 0;
+  for (i=0; (i < kmersH->num_sigs); i++) {
+    unsigned long long which = slot_kmer(kmersH,i);
+    if (which <= kmersH->max_encoded) {
+      unsigned long long len = probe_distance(kmersH,i,which) + 1;
+      *total_probe += len;
+      if (len > *max_probe)
+	*max_probe = len;
+    }
+  }
+}
 
-  char fileM[300];
-  strcpy(fileM,dataD);
-  strcat(fileM,"/kmer.table.mem_map");
+/* look up encodedK; if it is a signature, fill in *entry and return 1.  A
+   delta is consulted first: what it holds replaces the base's entry, and a
+   kmer it deletes is not a signature. */
+int find_sig_kmer(kmer_scan_ctx_t *ctx,kmer_handle_t *kmersH,unsigned long long encodedK,sig_kmer_t *entry) {
+  long long where;
+  if (kmersH->delta && ((where = lookup_hash_entry(0,kmersH->delta,encodedK)) >= 0)) {
+    unpack_sig_kmer(&kmersH->delta->packed_table[where],entry);
+    return entry->function_index != DELTA_DELETED;
+  }
+  where = lookup_hash_entry(ctx,kmersH,encodedK);
+  if (where < 0)
+    return 0;
+  if (kmersH->version == 1)
+    *entry = kmersH->kmer_table[where];
+  else
+    unpack_sig_kmer(&kmersH->packed_table[where],entry);
+  return 1;
+}
 
-  if (write_mem_map) {
-    unsigned long long sz, table_size;
-    strcpy(file,dataD);
-    strcat(file,"/final.kmers");
-    
-    unsigned long long image_size;
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
 
-    image = load_raw_kmers(file, size_hash, &image_size);
+/*
+ * Building the memory map.
+ *
+ * final.kmers is mapped read-only and split at line boundaries into one
+ * range per thread, and the table is written in place through a shared,
+ * file-backed mapping of the new kmer.table.mem_map -- there is no heap
+ * copy of the table.  To keep the threads from contending for slots, the
+ * table is cut into partitions by home slot:
+ *
+ *   1. each thread parses its range and counts its kmers per partition;
+ *   2. each thread parses its range again and files the offset of each
+ *      line under its partition (in file order);
+ *   3. the threads take partitions one at a time and insert their kmers,
+ *      never probing past the end of the partition; a kmer that would is
+ *      set aside;
+ *   4. the set-aside kmers are inserted serially.
+ *
+ * The only heap use is one 8-byte line offset per kmer.  The slot layout
+ * can differ from a serial build, but every lookup gives the same answer.
+ */
+typedef struct kmer_builder {
+  kmer_handle_t *kmersH;
+  char  *in;                          /* the mapped final.kmers */
+  size_t in_len;
+  int    nthreads;
+  size_t *range;                      /* nthreads+1 line-aligned offsets into in */
+  int    nparts;
+  unsigned long long part_size;       /* slots per partition */
+  unsigned long long *counts;         /* [thread * nparts + part] */
+  unsigned long long *part_start;     /* nparts+1 offsets into lines */
+  unsigned long long *lines;          /* line offsets, grouped by partition (for
+					 a perfect hash, the kmers themselves) */
+  unsigned long long *loaded;         /* per thread */
+  sig_kmer_t **spills;                /* per partition */
+  unsigned long long *num_spills;
+  unsigned long long *spills_size;
+  int    next_part;
+  pthread_mutex_t lock;
+} kmer_builder_t;
+
+typedef struct builder_job {
+  kmer_builder_t *b;
+  int t;
+  pthread_t thread;
+} builder_job_t;
+
+/* parse one line of final.kmers starting at p; returns the start of the
+   next line.  *ok is 1 for a kmer, 2 for a deletion ("kmer<tab>-", only
+   in delta.kmers; see -u) and 0 for a line that holds neither. */
+char *parse_kmer_line(char *p, char *end, int k, sig_kmer_t *entry, int *ok) {
+  char *line = p;
+  char *fields[5];
+  int n = 0;
+
+  while ((p < end) && (*p != '\n')) {
+    while ((p < end) && ((*p == '\t') || (*p == ' ') || (*p == '\r')))
+      p++;
+    if ((p >= end) || (*p == '\n'))
+      break;
+    if (n < 5)
+      fields[n++] = p;
+    while ((p < end) && (*p != '\t') && (*p != ' ') && (*p != '\r') && (*p != '\n'))
+      p++;
+  }
+  if (p < end)
+    p++;
 
-    handle->kmer_table = (sig_kmer_t *) (image + 1);
-    handle->num_sigs   = image->num_sigs;
+  *ok = 0;
+  int deletion = (n == 2) && (fields[1][0] == '-') && ((fields[1] + 1 == end) || isspace((unsigned char) fields[1][1]));
+  if ((n < 4) && !deletion)
+    return p;
+  if ((fields[1] - fields[0]) <= k) {
+    fprintf(stderr,"kmer too short in final.kmers at '%.*s'\n",(int) (p - line),line);
+    exit(1);
+  }
+  memset(entry, 0, sizeof(sig_kmer_t));
+  entry->which_kmer     = encoded_aa_kmer(fields[0],k);
+  if (deletion) {
+    entry->function_index = DELTA_DELETED;
+    *ok = 2;
+    return p;
+  }
+  entry->avg_from_end   = strtol(fields[1],0,10);
+  entry->function_index = strtol(fields[2],0,10);
+  entry->function_wt    = strtof(fields[3],0);
+  entry->otu_index      = (n >= 5) ? strtol(fields[4],0,10) : 0;
+  *ok = 1;
+  return p;
+}
 
-    FILE *fp = fopen(fileM,"w");
-    if (fp == NULL) { 
-      fprintf(stderr,"could not open %s for writing: %s ",fileM, strerror(errno));
-      exit(1);
-    }
-    fwrite(image, image_size, 1, fp);
-    fclose(fp);
+static inline int build_partition(kmer_builder_t *b, unsigned long long encodedK) {
+  if (b->nparts == 1)
+    return 0;
+  return home_slot(b->kmersH,encodedK) / b->part_size;
+}
 
-    strcpy(fileM,dataD);
-    strcat(fileM,"/size_hash.and.table_size");
-    fp = fopen(fileM,"w");
-    fprintf(fp,"%lld\t%lld\n",sz,table_size);
-    fclose(fp);
-  }
-  else {
-    int fd;
-    if ((fd = open(fileM, O_RDONLY)) == -1) {
-      perror("open");
-      exit(1);
-    }
+/* store an entry in slot i of either version of the table */
+static inline void store_sig_kmer(kmer_handle_t *kmersH, unsigned long long i, sig_kmer_t *entry) {
+  if (kmersH->version == 1)
+    kmersH->kmer_table[i] = *entry;
+  else
+    pack_sig_kmer(entry, &kmersH->packed_table[i]);
+}
 
-    /*
-     * Set up for creating memory image from file. Start by determining file size
-     * on disk with a stat() call.
-     */
-    struct stat sbuf;
-    if (stat(fileM, &sbuf) == -1) {
-      fprintf(stderr, "stat %s failed: %s\n", fileM, strerror(errno));
+void run_build_phase(kmer_builder_t *b, void *(*phase)(void *)) {
+  builder_job_t *jobs = malloc(b->nthreads * sizeof(builder_job_t));
+  int t;
+  for (t=0; (t < b->nthreads); t++) {
+    jobs[t].b = b;
+    jobs[t].t = t;
+    int rc = pthread_create(&jobs[t].thread, NULL, phase, &jobs[t]);
+    if (rc != 0) {
+      fprintf(stderr,"could not create builder thread: %s\n",strerror(rc));
       exit(1);
     }
-    unsigned long long file_size = sbuf.st_size;
+  }
+  for (t=0; (t < b->nthreads); t++)
+    pthread_join(jobs[t].thread, NULL);
+  free(jobs);
+}
 
-    /* 
-     * Memory map.
-     */
-    int flags = MAP_SHARED;
-    #ifdef MAP_POPULATE
-    flags |= MAP_POPULATE;
-    #endif
-    
-    image = (kmer_memory_image_t *) mmap((caddr_t)0, file_size, PROT_READ, flags, fd, 0);
-
-    if (image == (kmer_memory_image_t *)(-1)) {
-      fprintf(stderr, "mmap of kmer_table %s failed: %s\n", fileM, strerror(errno));
-      exit(1);
+void *build_clear_phase(void *arg) {
+  builder_job_t *job = (builder_job_t *) arg;
+  kmer_handle_t *kmersH = job->b->kmersH;
+  unsigned long long from = (kmersH->num_sigs * job->t) / job->b->nthreads;
+  unsigned long long to   = (kmersH->num_sigs * (job->t + 1)) / job->b->nthreads;
+  unsigned long long i;
+  for (i=from; (i < to); i++) {
+    if (kmersH->version == 1)
+      kmersH->kmer_table[i].which_kmer = kmersH->max_encoded + 1;
+    else {
+      kmersH->packed_table[i].lo = kmersH->max_encoded + 1;
+      kmersH->packed_table[i].hi = 0;
     }
+  }
+  return 0;
+}
 
-    /* 
-     * Our image is mapped. Validate against the current version of this code.
-     */
-    if (image->version != (long long) VERSION) {
-      fprintf(stderr, "Version mismatch for file %s: file has %lld code has %lld\n", 
-	      fileM, image->version, (long long) VERSION);
+void *build_count_phase(void *arg) {
+  builder_job_t *job = (builder_job_t *) arg;
+  kmer_builder_t *b = job->b;
+  unsigned long long *counts = b->counts + ((unsigned long long) job->t * b->nparts);
+  char *p   = b->in + b->range[job->t];
+  char *end = b->in + b->range[job->t + 1];
+  unsigned long long loaded = 0;
+
+  while (p < end) {
+    sig_kmer_t entry;
+    int ok;
+    p = parse_kmer_line(p,end,b->kmersH->k,&entry,&ok);
+    if (!ok)
+      continue;
+    if ((ok == 2) && !b->kmersH->base_id) {
+      fprintf(stderr,"deletions (kmer<tab>- lines) belong in delta.kmers, not final.kmers\n");
       exit(1);
     }
-
-    if (image->entry_size != (unsigned long long) sizeof(sig_kmer_t)) {
-      fprintf(stderr, "Version mismatch for file %s: file has entry size %lld code has %lld\n",
-	      fileM, image->entry_size, (unsigned long long) sizeof(sig_kmer_t));
+    if ((ok == 1) && (b->kmersH->version >= 2) &&
+	((entry.function_index < 0) || (entry.otu_index < 0) ||
+	 (entry.function_index > V2_MAX_FI) || (entry.otu_index > V2_MAX_OI))) {
+      fprintf(stderr,"function index %d or OTU index %d does not fit a version %d image; use -V 1\n",
+	      entry.function_index,entry.otu_index,b->kmersH->version);
       exit(1);
     }
-
-    size_hash = image->num_sigs;
-    handle->num_sigs = size_hash;
-    handle->kmer_table = (sig_kmer_t *) (image + 1);
-
-    /* Validate overall file size vs the entry size and number of entries */
-    if (file_size != ((sizeof(sig_kmer_t) * image->num_sigs) + sizeof(kmer_memory_image_t))) {
-      fprintf(stderr, "Version mismatch for file %s: file size does not match\n", fileM);
+    if ((ok == 1) && b->kmersH->base_id && (entry.function_index == DELTA_DELETED)) {
+      fprintf(stderr,"function index %d is reserved for deletions in a delta\n",(int) DELTA_DELETED);
       exit(1);
     }
-
-    fprintf(stderr, "Set size_hash=%lld from file size %lld\n", size_hash, file_size);
-
+    counts[build_partition(b,entry.which_kmer)]++;
+    loaded++;
   }
-  return handle;
+  b->loaded[job->t] = loaded;
+  return 0;
 }
 
-void advance_past_ambig(unsigned char **p,unsigned char *bound) {
-
-  if (K == 5) {
-    while (((*p) < bound) &&
-	   ((*(*p) == 20)     || 
-            (*((*p)+1) == 20) || 
-            (*((*p)+2) == 20) || 
-            (*((*p)+3) == 20) || 
-	    (*((*p)+4) == 20) )) {
-      (*p)++;
-    }
-  }
-  else {   /*  ##### ASSUMING K == 8 #### */
-    int bad = 1;
-    while ((*p < bound) && (bad == 1)) {
-      bad = 0;
-      if      (*((*p)+7) == 20) {
-	bad = 1;
-	(*p) += 8;
-      }
-      else if (*((*p)+6) == 20) {
-	bad = 1;
-	(*p) += 7;
-      }
-      else if (*((*p)+5) == 20) {
-	bad = 1;
-	(*p) += 6;
-      }
-      else if (*((*p)+4) == 20) {
-	bad = 1;
-	(*p) += 5;
-      }
-      else if (*((*p)+3) == 20) {
-	bad = 1;
-	(*p) += 4;
-      }
-      else if (*((*p)+2) == 20) {
-	bad = 1;
-	(*p) += 3;
-      }
-      else if (*((*p)+1) == 20) {
-	bad = 1;
-	(*p) += 2;
-      }
-      else if (*((*p)+0) == 20) {
-	bad = 1;
-	(*p) += 1;
-      }
-    } 
+void *build_place_phase(void *arg) {
+  builder_job_t *job = (builder_job_t *) arg;
+  kmer_builder_t *b = job->b;
+  unsigned long long *next = b->counts + ((unsigned long long) job->t * b->nparts);
+  char *p   = b->in + b->range[job->t];
+  char *end = b->in + b->range[job->t + 1];
+
+  while (p < end) {
+    sig_kmer_t entry;
+    int ok;
+    char *line = p;
+    p = parse_kmer_line(p,end,b->kmersH->k,&entry,&ok);
+    if (ok)
+      b->lines[next[build_partition(b,entry.which_kmer)]++] = line - b->in;
   }
+  return 0;
 }
 
-void display_hits(FILE *fh) {
-  fprintf(fh, "hits: ");
-  int i;
-  for (i=0; (i < num_hits); i++) {
-    fprintf(fh, "%d/%f/%d ", hits[i].from0_in_prot,hits[i].function_wt,hits[i].fI);
+void *build_filter_phase(void *arg) {
+  builder_job_t *job = (builder_job_t *) arg;
+  kmer_handle_t *kmersH = job->b->kmersH;
+  unsigned long long from = (kmersH->num_sigs * job->t) / job->b->nthreads;
+  unsigned long long to   = (kmersH->num_sigs * (job->t + 1)) / job->b->nthreads;
+  unsigned long long i;
+  for (i=from; (i < to); i++) {
+    unsigned long long which = slot_kmer(kmersH,i);
+    if (which <= kmersH->max_encoded)
+      filter_add(kmersH,which);
   }
-  fprintf(fh, "\n");
+  return 0;
 }
 
+void *build_insert_phase(void *arg) {
+  builder_job_t *job = (builder_job_t *) arg;
+  kmer_builder_t *b = job->b;
+  kmer_handle_t *kmersH = b->kmersH;
 
-void process_set_of_hits(kmer_handle_t *kmersH, FILE *fh) {
-  int fI_count = 0;
-  float weighted_hits = 0;
-  int last_hit=0;
-  int i=0;
-  while (i < num_hits) {
-    if (hits[i].fI == current_fI) {
-      last_hit = i;
-      fI_count++;
-      weighted_hits += hits[i].function_wt;
-    }
-    i++;
-  }
-  if ((fI_count >= min_hits) && (weighted_hits >= min_weighted_hits)) {
-      if (!hits_only)
-	  fprintf(fh, "CALL\t%d\t%d\t%d\t%d\t%s\t%f\n",hits[0].from0_in_prot,
-		  hits[last_hit].from0_in_prot+(K-1),
-		  fI_count,
-		  current_fI,
-		  kmersH->function_array[current_fI],
-		  weighted_hits);
+  while (1) {
+    pthread_mutex_lock(&b->lock);
+    int part = b->next_part++;
+    pthread_mutex_unlock(&b->lock);
+    if (part >= b->nparts)
+      break;
 
-      if (debug > 1) {
-	  fprintf(fh, "after-call: ");
-	  display_hits(fh);
-    }
-    /* once we have decided to call a region, we take the kmers for fI and
-       add them to the counts maintained to assign an OTU to the sequence */
-    for (i=0; (i <= last_hit); i++) {
-      if (hits[i].fI == current_fI) {
-	int j;
-	for (j=0; (j < num_oI) && (oI_counts[j].oI != hits[i].oI); j++) {}
-	if (j == num_oI) {
-	  if (num_oI == OI_BUFSZ) {
-	    j--;   /* we overwrite the last entry */
+    unsigned long long end = (part + 1) * b->part_size;
+    if (end > kmersH->num_sigs)
+      end = kmersH->num_sigs;
+
+    unsigned long long l;
+    for (l=b->part_start[part]; (l < b->part_start[part+1]); l++) {
+      sig_kmer_t entry;
+      int ok;
+      char *line = b->in + b->lines[l];
+      parse_kmer_line(line,b->in + b->in_len,b->kmersH->k,&entry,&ok);
+
+      int placed;
+      if (kmersH->hash_scheme == HASH_ROBIN_HOOD) {
+	sig_kmer_v2_t packed, spill;
+	pack_sig_kmer(&entry, &packed);
+	placed = insert_robin_hood(kmersH, &packed, end, &spill);
+	if (!placed)
+	  unpack_sig_kmer(&spill, &entry);
+      }
+      else {
+	unsigned long long i = home_slot(kmersH,entry.which_kmer);
+	while ((i < end) && (slot_kmer(kmersH,i) <= kmersH->max_encoded))
+	  i++;
+	placed = (i < end);
+	if (placed)
+	  store_sig_kmer(kmersH, i, &entry);
+      }
+
+      if (!placed) {
+	if (b->num_spills[part] == b->spills_size[part]) {
+	  b->spills_size[part] = b->spills_size[part] ? 2 * b->spills_size[part] : 64;
+	  b->spills[part] = realloc(b->spills[part], b->spills_size[part] * sizeof(sig_kmer_t));
+	  if (b->spills[part] == 0) {
+	    fprintf(stderr,"could not allocate %llu spilled kmers\n",b->spills_size[part]);
+	    exit(1);
 	  }
-	  else
-	    num_oI++;
-	  oI_counts[j].oI    = hits[i].oI;
-	  oI_counts[j].count = 1;
-	}
-	else {
-	  oI_counts[j].count++;
-	}
-	/* now we bubble the count back, allowing it to establish */
-	while ((j > 0) && (oI_counts[j-1].count <= oI_counts[j].count)) {
-	  int oI_tmp    = oI_counts[j-1].oI;
-	  int count_tmp = oI_counts[j-1].count;
-	  oI_counts[j-1].oI    = oI_counts[j].oI;
-	  oI_counts[j-1].count = oI_counts[j].count;
-	  oI_counts[j].oI    = oI_tmp;
-	  oI_counts[j].count = count_tmp;
-	  j--;
 	}
+	b->spills[part][b->num_spills[part]++] = entry;
       }
     }
   }
+  return 0;
+}
 
-  if ((hits[num_hits-2].fI != current_fI) && (hits[num_hits-2].fI == hits[num_hits-1].fI)) {
-      /*
-    fprintf(stderr, "Copying two entries cur=%d %d: %d, %d: %d\n",
-	    current_fI,
-	    num_hits - 2, hits[num_hits-2].fI, 
-	    num_hits - 1, hits[num_hits-1].fI);
-      */
-    current_fI = hits[num_hits-1].fI;
-    /* now copy the last two entries to the start of the hits array.  Sorry this is so clumsy */
-    hits[0].oI               = hits[num_hits-2].oI;
-    hits[0].from0_in_prot    = hits[num_hits-2].from0_in_prot;
-    hits[0].avg_off_from_end = hits[num_hits-2].avg_off_from_end;
-    hits[0].fI               = hits[num_hits-2].fI;
-    hits[0].function_wt      = hits[num_hits-2].function_wt;
-      
-    hits[1].oI               = hits[num_hits-1].oI;
-    hits[1].from0_in_prot    = hits[num_hits-1].from0_in_prot;
-    hits[1].avg_off_from_end = hits[num_hits-1].avg_off_from_end;
-    hits[1].fI               = hits[num_hits-1].fI;
-    hits[1].function_wt      = hits[num_hits-1].function_wt;
-    num_hits                 = 2;
-  }
-  else {
-    num_hits = 0;
+/* HASH_MPH: gather the kmers into lines[], in file order */
+void *build_key_phase(void *arg) {
+  builder_job_t *job = (builder_job_t *) arg;
+  kmer_builder_t *b = job->b;
+  unsigned long long next = b->counts[job->t];
+  char *p   = b->in + b->range[job->t];
+  char *end = b->in + b->range[job->t + 1];
+
+  while (p < end) {
+    sig_kmer_t entry;
+    int ok;
+    p = parse_kmer_line(p,end,b->kmersH->k,&entry,&ok);
+    if (ok)
+      b->lines[next++] = entry.which_kmer;
   }
+  return 0;
 }
 
-void gather_hits(int ln_DNA, char strand,int prot_off,char *pseq,
-		 unsigned char *pIseq, kmer_handle_t *kmersH, FILE *fh) {
-  
-  if (debug >= 3) {
-      fprintf(fh, "translated: %c\t%d\t%s\n",strand,prot_off,pseq);
+/* HASH_MPH: every kmer has a slot of its own, so the threads store their
+   kmers straight into the table */
+void *build_mph_insert_phase(void *arg) {
+  builder_job_t *job = (builder_job_t *) arg;
+  kmer_builder_t *b = job->b;
+  char *p   = b->in + b->range[job->t];
+  char *end = b->in + b->range[job->t + 1];
+
+  while (p < end) {
+    sig_kmer_t entry;
+    int ok;
+    p = parse_kmer_line(p,end,b->kmersH->k,&entry,&ok);
+    if (ok)
+      store_sig_kmer(b->kmersH, mph_slot(b->kmersH,entry.which_kmer), &entry);
   }
+  return 0;
+}
 
-  unsigned char *p = pIseq;
- /* pseq and pIseq are the same length */
+/*
+ * The perfect hash (-I mph), after PTHash.  Each kmer is hashed (with a
+ * seed) into one of about n / MPH_BUCKET_SIZE buckets.  Taking the
+ * buckets largest first, each is given the smallest pilot that sends all
+ * its kmers to positions no kmer has yet, where a kmer with hash h goes to
+ * mph_position(h, pilot), one of slightly more positions than there are
+ * kmers.  Positions past the last slot are then remapped to the slots
+ * left free below it, which makes the hash minimal.  A lookup is two
+ * hashes, a pilot (the pilots take 3 to 7 bits per kmer and mostly stay
+ * in cache), rarely a remap entry, and the one slot.  In the image it is
+ *
+ *     u64 seed, u64 buckets, u64 positions, u64 pilot bytes (2 or 4),
+ *     u64 padding to MPH_HEADER bytes, the pilots (padded to 8 bytes),
+ *     u64 remap[positions - slots]
+ */
+#define MPH_HEADER      64
+#define MPH_BUCKET_SIZE 5          /* kmers per bucket, on average */
+#define MPH_SLACK       32         /* positions = slots + slots / MPH_SLACK + 1 */
+#define MPH_MAX_PILOT   (1U << 24) /* a bucket that gets this far starts a new seed */
+#define MPH_MAX_SEEDS   16
+
+static inline unsigned long long mph_pilots_bytes(unsigned long long buckets, unsigned long long pilot_bytes) {
+  return (buckets * pilot_bytes + 7) & ~7ULL;
+}
 
-  unsigned char *bound = pIseq + strlen(pseq) - K;
-  advance_past_ambig(&p,bound);
-  unsigned long long encodedK=0;
-  if (p < bound) {
-    encodedK = encoded_kmer(p);
-  }
-  while (p < bound) {
-    long long  where = lookup_hash_entry(kmersH->kmer_table,encodedK);
-    // printf("%lu %lld\n", p - pIseq, where);
-    if (where >= 0) {
-      sig_kmer_t *kmers_hash_entry = &(kmersH->kmer_table[where]);
+/* point kmersH at a perfect hash laid out as in the image */
+void attach_mph(kmer_handle_t *kmersH, const unsigned long long *mph) {
+  kmersH->mph_seed        = mph[0];
+  kmersH->mph_buckets     = mph[1];
+  kmersH->mph_positions   = mph[2];
+  kmersH->mph_pilot_bytes = (int) mph[3];
+  kmersH->mph_pilots      = (const char *) mph + MPH_HEADER;
+  kmersH->mph_remap       = (const unsigned long long *) ((const char *) mph + MPH_HEADER +
+							  mph_pilots_bytes(mph[1], mph[3]));
+}
+
+/* the perfect hash of the n kmers in keys, for a table of slots slots (n,
+   or 1 if n is 0), laid out as in the image; its size goes in *size */
+unsigned long long *build_mph(unsigned long long *keys, unsigned long long n, unsigned long long slots,
+			      unsigned long long *size) {
+  unsigned long long buckets   = n / MPH_BUCKET_SIZE + 1;
+  unsigned long long positions = slots + slots / MPH_SLACK + 1;
+  unsigned long long words     = (positions + 63) / 64;
+  unsigned long long *start  = malloc((buckets + 1) * sizeof(unsigned long long));
+  unsigned long long *order  = malloc(buckets * sizeof(unsigned long long));
+  unsigned long long *hashes = malloc((n ? n : 1) * sizeof(unsigned long long));
+  unsigned long long *taken  = malloc(words * sizeof(unsigned long long));
+  unsigned int *pilots = malloc(buckets * sizeof(unsigned int));
+  unsigned long long seed = 0, i, j, b, max_size = 0, max_pilot = 0;
+  int attempt;
+
+  if (!start || !order || !hashes || !taken || !pilots) {
+    fprintf(stderr,"could not allocate the perfect hash of %lld kmers\n",n);
+    exit(1);
+  }
+  for (attempt = 1; (attempt <= MPH_MAX_SEEDS); attempt++) {
+    seed = FIB_HASH_MULT * attempt;
+
+    /* the hashes, grouped by bucket */
+    memset(start, 0, (buckets + 1) * sizeof(unsigned long long));
+    for (i=0; (i < n); i++)
+      start[fast_range(filter_hash(keys[i] ^ seed), buckets) + 1]++;
+    for (b=0; (b < buckets); b++) {
+      start[b+1] += start[b];
+      order[b] = start[b];
+    }
+    for (i=0; (i < n); i++) {
+      unsigned long long h = filter_hash(keys[i] ^ seed);
+      hashes[order[fast_range(h, buckets)]++] = h;
+    }
+
+    /* the hash is one-to-one, so a repeated hash is a repeated kmer */
+    max_size = 0;
+    for (b=0; (b < buckets); b++) {
+      if (start[b+1] - start[b] > max_size)
+	max_size = start[b+1] - start[b];
+      for (i=start[b]; (i < start[b+1]); i++)
+	for (j=i+1; (j < start[b+1]); j++)
+	  if (hashes[i] == hashes[j]) {
+	    char kmer[MAX_K+1];
+	    unsigned long long k;
+	    for (k=0; (filter_hash(keys[k] ^ seed) != hashes[i]); k++)
+	      ;
+	    decoded_kmer(keys[k], kmer_size, kmer);
+	    fprintf(stderr,"%s is listed more than once; a perfect hash needs each kmer once\n",kmer);
+	    exit(1);
+	  }
+    }
+
+    /* the buckets, largest first (a counting sort by size) */
+    unsigned long long *by_size = calloc(max_size + 2, sizeof(unsigned long long));
+    for (b=0; (b < buckets); b++)
+      by_size[max_size - (start[b+1] - start[b]) + 1]++;
+    for (i=0; (i <= max_size); i++)
+      by_size[i+1] += by_size[i];
+    for (b=0; (b < buckets); b++)
+      order[by_size[max_size - (start[b+1] - start[b])]++] = b;
+    free(by_size);
+
+    /* the pilots */
+    unsigned long long *pos = malloc((max_size ? max_size : 1) * sizeof(unsigned long long));
+    int placed_all = 1;
+    memset(taken, 0, words * sizeof(unsigned long long));
+    memset(pilots, 0, buckets * sizeof(unsigned int));
+    max_pilot = 0;
+    for (i=0; (i < buckets); i++) {
+      unsigned long long bk = order[i], sz = start[bk+1] - start[bk];
+      unsigned int pilot;
+      if (sz == 0)
+	break;
+      for (pilot=0; (pilot < MPH_MAX_PILOT); pilot++) {
+	for (j=0; (j < sz); j++) {
+	  unsigned long long p = mph_position(hashes[start[bk] + j], pilot, positions);
+	  if (taken[p >> 6] & (1ULL << (p & 63)))
+	    break;
+	  taken[p >> 6] |= 1ULL << (p & 63);
+	  pos[j] = p;
+	}
+	if (j == sz)
+	  break;
+	while (j > 0) {
+	  j--;
+	  taken[pos[j] >> 6] &= ~(1ULL << (pos[j] & 63));
+	}
+      }
+      if (pilot == MPH_MAX_PILOT) {
+	placed_all = 0;
+	break;
+      }
+      pilots[bk] = pilot;
+      if (pilot > max_pilot)
+	max_pilot = pilot;
+    }
+    free(pos);
+    if (placed_all)
+      break;
+    fprintf(stderr,"perfect hash: a bucket found no pilot; trying another seed\n");
+  }
+  if (attempt > MPH_MAX_SEEDS) {
+    fprintf(stderr,"could not build a perfect hash of %lld kmers\n",n);
+    exit(1);
+  }
+
+  /* lay it out, remapping the positions past the last slot to free slots */
+  unsigned long long pilot_bytes = (max_pilot < 65536) ? 2 : 4;
+  *size = MPH_HEADER + mph_pilots_bytes(buckets, pilot_bytes) + 8 * (positions - slots);
+  unsigned long long *mph = calloc(*size / 8, sizeof(unsigned long long));
+  if (mph == 0) {
+    fprintf(stderr,"could not allocate the perfect hash of %lld kmers\n",n);
+    exit(1);
+  }
+  mph[0] = seed;
+  mph[1] = buckets;
+  mph[2] = positions;
+  mph[3] = pilot_bytes;
+  for (b=0; (b < buckets); b++) {
+    if (pilot_bytes == 2)
+      ((unsigned short *) ((char *) mph + MPH_HEADER))[b] = pilots[b];
+    else
+      ((unsigned int *) ((char *) mph + MPH_HEADER))[b] = pilots[b];
+  }
+  unsigned long long *remap = (unsigned long long *) ((char *) mph + MPH_HEADER + mph_pilots_bytes(buckets, pilot_bytes));
+  unsigned long long free_slot = 0;
+  for (i=slots; (i < positions); i++) {
+    if (taken[i >> 6] & (1ULL << (i & 63))) {
+      while (taken[free_slot >> 6] & (1ULL << (free_slot & 63)))
+	free_slot++;
+      remap[i - slots] = free_slot++;
+    }
+  }
+
+  free(start);
+  free(order);
+  free(hashes);
+  free(taken);
+  free(pilots);
+  return mph;
+}
+
+/* a new build_id, from /dev/urandom or failing that the clock and pid */
+unsigned long long new_build_id() {
+  unsigned long long id = 0;
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0) {
+    if (read(fd, &id, sizeof(id)) != sizeof(id))
+      id = 0;
+    close(fd);
+  }
+  if (id == 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    id = filter_hash(((unsigned long long) ts.tv_sec << 30) ^ ts.tv_nsec ^ ((unsigned long long) getpid() << 48));
+  }
+  return id | 1;
+}
+
+/*
+ * Build dataD's memory map from final.kmers into fileM (through a temporary
+ * file that is renamed into place when complete).  Returns the image size.
+ */
+unsigned long long build_mem_map(char *fileK, char *fileM, kmer_handle_t *kmersH) {
+  double t_start = now_seconds();
+  unsigned long long num_entries = size_hash;
+
+  /*
+   * A Robin Hood table needs the packed entries and a power-of-two size;
+   * a perfect hash the packed entries, and its size is the kmer count.
+   */
+  if ((filter_rate > 0) && (write_version < 3)) {
+    fprintf(stderr,"-E needs a version 3 image\n");
+    exit(1);
+  }
+  if ((write_hash_scheme != HASH_MODULO) && (write_version < 2)) {
+    fprintf(stderr,"-I %s needs a version 2 image\n",hash_scheme_name(write_hash_scheme));
+    exit(1);
+  }
+  if (write_hash_scheme == HASH_ROBIN_HOOD) {
+    unsigned long long pow2 = 1;
+    while (pow2 < num_entries)
+      pow2 <<= 1;
+    num_entries = pow2;
+    size_hash   = pow2;
+  }
+
+  unsigned long long header_size, entry_size;
+  if (write_version == 1) {
+    header_size = sizeof(kmer_memory_image_t);
+    entry_size  = sizeof(sig_kmer_t);
+  }
+  else {
+    header_size = sizeof(kmer_memory_image_v2_t);
+    entry_size  = sizeof(sig_kmer_v2_t);
+  }
+
+  /*
+   * Map the input.
+   */
+  int fdK = open(fileK, O_RDONLY);
+  if (fdK < 0) {
+    fprintf(stderr,"could not open %s: %s\n",fileK,strerror(errno));
+    exit(1);
+  }
+  struct stat sbuf;
+  if (fstat(fdK, &sbuf) == -1) {
+    fprintf(stderr, "stat %s failed: %s\n", fileK, strerror(errno));
+    exit(1);
+  }
+
+  kmer_builder_t b;
+  memset(&b, 0, sizeof(b));
+  b.kmersH   = kmersH;
+  b.in_len   = sbuf.st_size;
+  b.in       = "";
+  if (b.in_len > 0) {
+    b.in = mmap(0, b.in_len, PROT_READ, MAP_PRIVATE, fdK, 0);
+    if (b.in == MAP_FAILED) {
+      fprintf(stderr, "mmap of %s failed: %s\n", fileK, strerror(errno));
+      exit(1);
+    }
+  }
+
+  kmersH->version  = write_version;
+  kmersH->k        = kmer_size;
+  kmersH->max_encoded = pow20[kmer_size];
+  kmersH->num_sigs = num_entries;
+  set_hash_scheme(kmersH, write_hash_scheme);
+
+  /*
+   * Split the input at line boundaries and the table into partitions (a
+   * perfect hash has one, as the kmers are counted before it exists).
+   */
+  b.nthreads = num_threads;
+  b.range    = malloc((b.nthreads + 1) * sizeof(size_t));
+  int t;
+  b.range[0] = 0;
+  for (t=1; (t < b.nthreads); t++) {
+    size_t r = (b.in_len * t) / b.nthreads;
+    if (r < b.range[t-1])
+      r = b.range[t-1];
+    while ((r > 0) && (r < b.in_len) && (b.in[r-1] != '\n'))
+      r++;
+    b.range[t] = r;
+  }
+  b.range[b.nthreads] = b.in_len;
+
+  b.nparts = b.nthreads * 16;
+  if (((unsigned long long) b.nparts > num_entries) || (write_hash_scheme == HASH_MPH))
+    b.nparts = 1;
+  b.part_size   = (num_entries + b.nparts - 1) / b.nparts;
+  b.counts      = calloc((unsigned long long) b.nthreads * b.nparts, sizeof(unsigned long long));
+  b.part_start  = calloc(b.nparts + 1, sizeof(unsigned long long));
+  b.loaded      = calloc(b.nthreads, sizeof(unsigned long long));
+  b.spills      = calloc(b.nparts, sizeof(sig_kmer_t *));
+  b.num_spills  = calloc(b.nparts, sizeof(unsigned long long));
+  b.spills_size = calloc(b.nparts, sizeof(unsigned long long));
+  pthread_mutex_init(&b.lock, NULL);
+
+  run_build_phase(&b, build_count_phase);
+
+  unsigned long long loaded = 0;
+  for (t=0; (t < b.nthreads); t++)
+    loaded += b.loaded[t];
+  if ((write_hash_scheme == HASH_MODULO) && (loaded >= (size_hash / 2))) {
+    fprintf(stderr,"Your Kmer hash is half-full; use -s (and -w) to bump it\n");
+    exit(1);
+  }
+  if ((write_hash_scheme == HASH_ROBIN_HOOD) && (loaded >= (size_hash / 8) * 7)) {
+    fprintf(stderr,"Your Kmer hash is 7/8 full; use -s (and -w) to bump it\n");
+    exit(1);
+  }
+
+  /* turn the per-thread counts into each thread's first index in lines[] */
+  int part;
+  unsigned long long next = 0;
+  for (part=0; (part < b.nparts); part++) {
+    b.part_start[part] = next;
+    for (t=0; (t < b.nthreads); t++) {
+      unsigned long long n = b.counts[(unsigned long long) t * b.nparts + part];
+      b.counts[(unsigned long long) t * b.nparts + part] = next;
+      next += n;
+    }
+  }
+  b.part_start[b.nparts] = next;
+  b.lines = malloc((loaded ? loaded : 1) * sizeof(unsigned long long));
+
+  /*
+   * The perfect hash is built from the kmers alone, gathered into lines[],
+   * and sizes the table: one slot per kmer.
+   */
+  unsigned long long *mph = 0, mph_size = 0;
+  if (write_hash_scheme == HASH_MPH) {
+    double t_mph = now_seconds();
+    run_build_phase(&b, build_key_phase);
+    num_entries = loaded ? loaded : 1;
+    mph = build_mph(b.lines, loaded, num_entries, &mph_size);
+    size_hash = num_entries;
+    kmersH->num_sigs = num_entries;
+    fprintf(stderr,"perfect hash: %lld buckets, %lld-byte pilots, %lld bytes, %.2fs\n",
+	    mph[1], mph[3], mph_size, now_seconds() - t_mph);
+  }
+
+  unsigned long long table_end  = header_size + (entry_size * num_entries);
+  unsigned long long strings_size = 0;
+  if (write_version >= 3)
+    strings_size = string_table_bytes(&kmersH->functions) + string_table_bytes(&kmersH->otus);
+  unsigned long long image_size = table_end + strings_size;
+  unsigned long long mph_offset = 0;
+  if (mph) {
+    mph_offset = (image_size + 63) & ~63ULL;
+    image_size = mph_offset + mph_size;
+  }
+
+  /*
+   * Create the output and map it.
+   */
+  char fileTmp[320];
+  snprintf(fileTmp, sizeof(fileTmp), "%s.tmp", fileM);
+  int fdM = open(fileTmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fdM < 0) {
+    fprintf(stderr,"could not open %s for writing: %s\n",fileTmp, strerror(errno));
+    exit(1);
+  }
+  if (ftruncate(fdM, image_size) < 0) {
+    fprintf(stderr,"could not size %s to %lld bytes: %s\n",fileTmp, image_size, strerror(errno));
+    exit(1);
+  }
+  kmer_memory_image_t *image = mmap(0, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fdM, 0);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "mmap of %s failed: %s\n", fileTmp, strerror(errno));
+    exit(1);
+  }
+
+  memset(image, 0, header_size);
+  image->num_sigs   = num_entries;
+  image->entry_size = entry_size;
+  image->version    = (long long) write_version;
+
+  if (write_version == 1) {
+    kmersH->kmer_table   = (sig_kmer_t *) ((char *) image + header_size);
+    kmersH->packed_table = 0;
+  }
+  else {
+    ((kmer_memory_image_v2_t *) image)->header_size = header_size;
+    ((kmer_memory_image_v2_t *) image)->hash_scheme = write_hash_scheme;
+    ((kmer_memory_image_v2_t *) image)->kmer_size   = kmer_size;
+    ((kmer_memory_image_v2_t *) image)->build_id    = new_build_id();
+    if (write_version >= 3) {
+      char *p = (char *) image + table_end;
+      p += write_string_table(p, &kmersH->functions);
+      write_string_table(p, &kmersH->otus);
+      ((kmer_memory_image_v2_t *) image)->strings_offset = table_end;
+      ((kmer_memory_image_v2_t *) image)->strings_size   = strings_size;
+      ((kmer_memory_image_v2_t *) image)->base_id        = kmersH->base_id;
+      ((kmer_memory_image_v2_t *) image)->first_function = kmersH->first_function;
+      ((kmer_memory_image_v2_t *) image)->first_otu      = kmersH->first_otu;
+    }
+    if (mph) {
+      memcpy((char *) image + mph_offset, mph, mph_size);
+      ((kmer_memory_image_v2_t *) image)->mph_offset = mph_offset;
+      ((kmer_memory_image_v2_t *) image)->mph_size   = mph_size;
+      attach_mph(kmersH, (unsigned long long *) ((char *) image + mph_offset));
+      free(mph);
+    }
+    kmersH->kmer_table   = 0;
+    kmersH->packed_table = (sig_kmer_v2_t *) ((char *) image + header_size);
+  }
+
+  run_build_phase(&b, build_clear_phase);
+
+  unsigned long long spilled = 0;
+  double t_parsed;
+  if (write_hash_scheme == HASH_MPH) {
+    t_parsed = now_seconds();
+    run_build_phase(&b, build_mph_insert_phase);
+  }
+  else {
+    run_build_phase(&b, build_place_phase);
+    t_parsed = now_seconds();
+
+    run_build_phase(&b, build_insert_phase);
+
+    for (part=0; (part < b.nparts); part++) {
+      unsigned long long j;
+      for (j=0; (j < b.num_spills[part]); j++) {
+	sig_kmer_t *entry = &b.spills[part][j];
+	if (kmersH->hash_scheme == HASH_ROBIN_HOOD) {
+	  sig_kmer_v2_t packed;
+	  pack_sig_kmer(entry, &packed);
+	  insert_robin_hood(kmersH, &packed, NO_SLOT_LIMIT, 0);
+	}
+	else
+	  store_sig_kmer(kmersH, find_empty_hash_entry(kmersH,entry->which_kmer), entry);
+      }
+      spilled += b.num_spills[part];
+      free(b.spills[part]);
+    }
+  }
+  double t_inserted = now_seconds();
+
+  unsigned long long max_probe, total_probe;
+  probe_length_stats(kmersH, &max_probe, &total_probe);
+  kmersH->max_probe = max_probe;
+  if (write_version >= 2) {
+    ((kmer_memory_image_v2_t *) image)->num_loaded  = loaded;
+    ((kmer_memory_image_v2_t *) image)->max_probe   = max_probe;
+    ((kmer_memory_image_v2_t *) image)->total_probe = total_probe;
+  }
+
+  /*
+   * The prefilter, sized for the -E false-positive rate: -ln(rate)/ln(2)^2
+   * bits and ln(2) times as many hashes per kmer.  It is built in memory
+   * and written after the string tables (and the perfect hash).
+   */
+  unsigned long long *filter_buf = 0;
+  unsigned long long filter_offset = 0, filter_size = 0;
+  if (filter_rate > 0) {
+    double bits = -(double) (loaded ? loaded : 1) * log(filter_rate) / (M_LN2 * M_LN2);
+    unsigned long long blocks = (unsigned long long) (bits / FILTER_BLOCK_BITS) + 1;
+    int nh = (int) (bits / (loaded ? loaded : 1) * M_LN2 + 0.5);
+    if (nh < 1)
+      nh = 1;
+    if (nh > FILTER_MAX_HASHES)
+      nh = FILTER_MAX_HASHES;
+    filter_size   = FILTER_HEADER + blocks * (FILTER_BLOCK_BITS / 8);
+    filter_offset = (image_size + 63) & ~63ULL;
+    filter_buf    = aligned_alloc(64, filter_size);
+    if (filter_buf == 0) {
+      fprintf(stderr,"could not allocate a %lld byte prefilter\n",filter_size);
+      exit(1);
+    }
+    memset(filter_buf, 0, filter_size);
+    filter_buf[0] = blocks;
+    filter_buf[1] = nh;
+    kmersH->filter        = filter_buf + FILTER_HEADER / 8;
+    kmersH->filter_blocks = blocks;
+    kmersH->filter_hashes = nh;
+    run_build_phase(&b, build_filter_phase);
+    ((kmer_memory_image_v2_t *) image)->filter_offset = filter_offset;
+    ((kmer_memory_image_v2_t *) image)->filter_size   = filter_size;
+    fprintf(stderr,"prefilter: %lld bytes, %d hashes per kmer, false-positive rate %g\n",
+	    filter_size, nh, filter_rate);
+  }
+
+  if (munmap(image, image_size) < 0) {
+    fprintf(stderr,"error writing %s: %s\n",fileTmp,strerror(errno));
+    exit(1);
+  }
+  if (filter_size) {
+    unsigned long long done = 0;
+    while (done < filter_size) {
+      ssize_t n = pwrite(fdM, (char *) filter_buf + done, filter_size - done, filter_offset + done);
+      if ((n < 0) && (errno == EINTR))
+	continue;
+      if (n <= 0) {
+	fprintf(stderr,"error writing %s: %s\n",fileTmp,strerror(errno));
+	exit(1);
+      }
+      done += n;
+    }
+    image_size = filter_offset + filter_size;
+    free(filter_buf);
+    kmersH->filter = 0;
+  }
+  if (close(fdM) < 0) {
+    fprintf(stderr,"error writing %s: %s\n",fileTmp,strerror(errno));
+    exit(1);
+  }
+  if (rename(fileTmp, fileM) < 0) {
+    fprintf(stderr,"could not rename %s to %s: %s\n",fileTmp,fileM,strerror(errno));
+    exit(1);
+  }
+  if (b.in_len > 0)
+    munmap(b.in, b.in_len);
+  close(fdK);
+  kmersH->kmer_table   = 0;
+  kmersH->packed_table = 0;
+
+  fprintf(stderr,"loaded %lld kmers into %lld slots (%s, version %d) with %d thread%s\n",
+	  loaded, num_entries, hash_scheme_name(write_hash_scheme), write_version,
+	  b.nthreads, (b.nthreads == 1) ? "" : "s");
+  fprintf(stderr,"build: parse %.2fs insert %.2fs (%lld of %lld kmers set aside) total %.2fs\n",
+	  t_parsed - t_start, t_inserted - t_parsed, spilled, loaded, now_seconds() - t_start);
+  fprintf(stderr,"probe length max %lld avg %.3f; load factor %.3f\n",
+	  max_probe, loaded ? (double) total_probe / loaded : 0.0, (double) loaded / num_entries);
+
+  free(b.range);
+  free(b.counts);
+  free(b.part_start);
+  free(b.lines);
+  free(b.loaded);
+  free(b.spills);
+  free(b.num_spills);
+  free(b.spills_size);
+  pthread_mutex_destroy(&b.lock);
+
+  return image_size;
+}
+
+/*
+ * Holding the table in memory.  The image file is mapped and then paged in
+ * by warm-up threads (-T of them), which advise the kernel of each chunk
+ * (MADV_WILLNEED) before touching it and report progress every
+ * WARM_REPORT seconds.  Scanning waits for them unless -A is given; the
+ * server always binds its socket first and publishes its port (the
+ * "Listening on" line and the -L file) only once the table is in memory.
+ *
+ * With -G thp or -G hugetlb the threads copy the image into anonymous
+ * memory backed by transparent or explicit (hugetlbfs) huge pages
+ * instead, which takes most of the TLB misses out of random probes into a
+ * large table; a copied table is always complete before scanning starts.
+ * -Y locks the table in memory once it is loaded, and -N sets the NUMA
+ * policy of the threads that fault it in: interleave across all nodes,
+ * or local to each thread.  With -j a mapped table is not paged in at
+ * all; it is read only to make kmer.sorted (see run_join_batch).
+ */
+#define PAGES_MAPPED  0
+#define PAGES_THP     1
+#define PAGES_HUGETLB 2
+
+#define NUMA_DEFAULT    0
+#define NUMA_INTERLEAVE 1
+#define NUMA_LOCAL      2
+
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL      4
+#endif
+
+#define WARM_CHUNK  (64ULL << 20)
+#define WARM_REPORT 5
+#define THP_SIZE    (2ULL << 20)
+#define MAX_NODES   1024
+
+int table_pages = PAGES_MAPPED;
+int lock_table  = 0;
+int numa_policy = NUMA_DEFAULT;
+int warm_in_background = 0;
+int page_in_table = 1;             /* -j reads the table only to make kmer.sorted */
+
+/* the size of an explicit huge page, from /proc/meminfo */
+unsigned long long huge_page_size() {
+  unsigned long long kb = 0;
+  char line[256];
+  FILE *fp = fopen("/proc/meminfo","r");
+  if (fp) {
+    while (fgets(line,sizeof(line),fp))
+      if (sscanf(line,"Hugepagesize: %llu kB",&kb) == 1)
+	break;
+    fclose(fp);
+  }
+  return kb ? (kb << 10) : THP_SIZE;
+}
+
+/* apply -N to the calling thread; the kernel places the pages it faults in */
+void set_numa_policy(int policy) {
+  static int warned = 0;
+  unsigned long nodes[MAX_NODES / (8 * sizeof(unsigned long))];
+  int node, max_node = -1;
+  long rc;
+  char path[64];
+
+  if (policy == NUMA_DEFAULT)
+    return;
+  if (policy == NUMA_LOCAL)
+    rc = syscall(SYS_set_mempolicy, MPOL_LOCAL, 0, 0);
+  else {
+    memset(nodes, 0, sizeof(nodes));
+    for (node=0; (node < MAX_NODES); node++) {
+      snprintf(path,sizeof(path),"/sys/devices/system/node/node%d",node);
+      if (access(path, F_OK) == 0) {
+	nodes[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+	max_node = node;
+      }
+    }
+    rc = (max_node < 0) ? -1 : syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, nodes, max_node + 2);
+  }
+  if ((rc != 0) && !warned) {
+    warned = 1;
+    fprintf(stderr,"could not set the NUMA policy, using the default: %s\n",
+	    (max_node < 0) && (policy == NUMA_INTERLEAVE) ? "no NUMA nodes found" : strerror(errno));
+  }
+}
+
+/* anonymous memory for a copy of the image, in huge pages of the kind -G
+   asks for; the mapping is recorded in handle, and 0 returned if it fails */
+char *alloc_table_copy(kmer_handle_t *handle, unsigned long long size) {
+  char *p;
+  if (table_pages == PAGES_HUGETLB) {
+    unsigned long long hp = huge_page_size();
+    p = mmap(0, (size + hp - 1) / hp * hp, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      handle->image_map      = p;
+      handle->image_map_size = (size + hp - 1) / hp * hp;
+      return p;
+    }
+    fprintf(stderr,"could not allocate %llu MB of huge pages (%s), using transparent huge pages\n",
+	    size >> 20, strerror(errno));
+  }
+  /* over-allocate so that the copy can start on a huge page boundary */
+  p = mmap(0, size + THP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return 0;
+  handle->image_map      = p;
+  handle->image_map_size = size + THP_SIZE;
+  p = (char *) (((unsigned long long) p + THP_SIZE - 1) & ~(THP_SIZE - 1));
+#ifdef MADV_HUGEPAGE
+  if (madvise(p, size, MADV_HUGEPAGE) != 0)
+    fprintf(stderr,"transparent huge pages are not available: %s\n",strerror(errno));
+#endif
+  return p;
+}
+
+/* make sure that bytes [from, from + n) of the image are in place: a copy is
+   only filled in by the warm-up threads, so read them now.  Returns 0, or
+   -1 with the reason in err. */
+int read_image_range(kmer_handle_t *handle, unsigned long long from, unsigned long long n, const char *fileM,
+		     char *err, size_t err_len) {
+  if (!handle->image_copied)
+    return 0;
+  while (n > 0) {
+    ssize_t r = pread(handle->image_fd, handle->image + from, n, from);
+    if ((r < 0) && (errno == EINTR))
+      continue;
+    if (r <= 0) {
+      snprintf(err, err_len, "could not read %s: %s", fileM, (r < 0) ? strerror(errno) : "file is short");
+      return -1;
+    }
+    from += r;
+    n    -= r;
+  }
+  return 0;
+}
+
+/* map the image (or start a copy of it) without reading any of it yet but
+   the header; returns 0 with the reason in err if that fails */
+char *open_table_image(kmer_handle_t *handle, int fd, unsigned long long size, const char *fileM,
+		       char *err, size_t err_len) {
+  char *image;
+  handle->image_fd   = fd;
+  handle->image_size = size;
+  if (table_pages == PAGES_MAPPED) {
+    image = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+      snprintf(err, err_len, "mmap of kmer_table %s failed: %s", fileM, strerror(errno));
+      return 0;
+    }
+    handle->image_map      = image;
+    handle->image_map_size = size;
+  }
+  else {
+    set_numa_policy(numa_policy);
+    image = alloc_table_copy(handle, size);
+    if (image == 0) {
+      snprintf(err, err_len, "could not allocate %llu MB for the kmer table: %s", size >> 20, strerror(errno));
+      return 0;
+    }
+    handle->image_copied = 1;
+  }
+  handle->image = image;
+  if (read_image_range(handle, 0, (size < sizeof(kmer_memory_image_v2_t)) ? size : sizeof(kmer_memory_image_v2_t),
+		       fileM, err, err_len) < 0)
+    return 0;
+  return image;
+}
+
+void *warm_table_main(void *arg) {
+  kmer_handle_t *handle = (kmer_handle_t *) arg;
+  unsigned long long chunk;
+  volatile char sink = 0;
+
+  set_numa_policy(numa_policy);
+  while ((chunk = __sync_fetch_and_add(&handle->warm_next, 1)) * WARM_CHUNK < handle->image_size) {
+    unsigned long long from = chunk * WARM_CHUNK;
+    unsigned long long n = (handle->image_size - from < WARM_CHUNK) ? (handle->image_size - from) : WARM_CHUNK;
+    char *p = handle->image + from;
+    if (handle->image_copied) {
+      unsigned long long got = 0;
+      while (got < n) {
+	ssize_t r = pread(handle->image_fd, p + got, n - got, from + got);
+	if ((r < 0) && (errno == EINTR))
+	  continue;
+	if (r <= 0) {
+	  fprintf(stderr,"could not read the kmer table: %s\n",(r < 0) ? strerror(errno) : "file is short");
+	  exit(1);
+	}
+	got += r;
+      }
+    }
+    else {
+      unsigned long long i;
+      madvise(p, n, MADV_WILLNEED);
+      for (i = 0; (i < n); i += 4096)
+	sink += p[i];
+    }
+    if (__sync_add_and_fetch(&handle->warm_done, n) == handle->image_size) {
+      pthread_mutex_lock(&handle->ready_lock);
+      pthread_cond_broadcast(&handle->ready_cond);
+      pthread_mutex_unlock(&handle->ready_lock);
+    }
+  }
+  return 0;
+}
+
+/* runs the warm-up threads, reports progress and marks the table ready */
+void *warm_table_coordinator(void *arg) {
+  kmer_handle_t *handle = (kmer_handle_t *) arg;
+
+  if (!page_in_table && !handle->image_copied) {
+    close(handle->image_fd);
+    handle->image_fd = -1;
+    pthread_mutex_lock(&handle->ready_lock);
+    handle->ready = 1;
+    pthread_cond_broadcast(&handle->ready_cond);
+    pthread_mutex_unlock(&handle->ready_lock);
+    return 0;
+  }
+
+  int nthreads = num_threads;
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  double start = now_seconds();
+  char *verb = handle->image_copied ? "copied" : "paged in";
+  int t;
+
+  for (t=0; (t < nthreads); t++) {
+    int rc = pthread_create(&threads[t], NULL, warm_table_main, handle);
+    if (rc != 0) {
+      fprintf(stderr,"could not create warm-up thread: %s\n",strerror(rc));
+      exit(1);
+    }
+  }
+  pthread_mutex_lock(&handle->ready_lock);
+  while (__sync_fetch_and_add(&handle->warm_done, 0) < handle->image_size) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += WARM_REPORT;
+    if (pthread_cond_timedwait(&handle->ready_cond, &handle->ready_lock, &until) == ETIMEDOUT) {
+      unsigned long long done = __sync_fetch_and_add(&handle->warm_done, 0);
+      fprintf(stderr,"kmer table: %llu of %llu MB %s (%.0f%%), %.0f s\n",
+	      done >> 20, handle->image_size >> 20, verb, 100.0 * done / handle->image_size,
+	      now_seconds() - start);
+    }
+  }
+  pthread_mutex_unlock(&handle->ready_lock);
+  for (t=0; (t < nthreads); t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+  close(handle->image_fd);
+  handle->image_fd = -1;
+
+  if (handle->image_copied)
+    mprotect(handle->image, handle->image_size, PROT_READ);
+  if (lock_table && (mlock(handle->image, handle->image_size) != 0))
+    fprintf(stderr,"could not lock the kmer table in memory: %s\n",strerror(errno));
+  fprintf(stderr,"kmer table: %llu MB %s%s, %.3f s\n", handle->image_size >> 20, verb,
+	  lock_table ? " and locked" : "", now_seconds() - start);
+
+  pthread_mutex_lock(&handle->ready_lock);
+  handle->ready = 1;
+  pthread_cond_broadcast(&handle->ready_cond);
+  pthread_mutex_unlock(&handle->ready_lock);
+  return 0;
+}
+
+/* the coordinator is joined by close_kmers; the programs never close the table */
+void start_table_warmup(kmer_handle_t *handle) {
+  int rc = pthread_create(&handle->warm_thread, NULL, warm_table_coordinator, handle);
+  if (rc != 0) {
+    fprintf(stderr,"could not create warm-up thread: %s\n",strerror(rc));
+    exit(1);
+  }
+}
+
+void wait_for_table(kmer_handle_t *handle) {
+  pthread_mutex_lock(&handle->ready_lock);
+  while (!handle->ready)
+    pthread_cond_wait(&handle->ready_cond, &handle->ready_lock);
+  pthread_mutex_unlock(&handle->ready_lock);
+}
+
+/* everything open_image sets up; the warm-up must be over */
+void release_image(kmer_handle_t *handle) {
+  if (handle->version < 3) {
+    free_string_table(&handle->functions);
+    free_string_table(&handle->otus);
+  }
+  if (handle->image_map)
+    munmap(handle->image_map, handle->image_map_size);
+  if (handle->image_fd >= 0)
+    close(handle->image_fd);
+  pthread_mutex_destroy(&handle->ready_lock);
+  pthread_cond_destroy(&handle->ready_cond);
+  free(handle);
+}
+
+/*
+ * What identifies an image, for deltas (base_id) and kmer.sorted: the
+ * build_id drawn when it was built, so that every -w, -u or -c makes a
+ * new one.  Images from before build_id get a hash of the header words
+ * (deltas' own fields aside) and the file size instead, which does not
+ * see the table's contents; a rebuild with the same kmers and -s but
+ * other functions or weights repeats it.
+ */
+unsigned long long image_fingerprint(kmer_memory_image_t *image, unsigned long long header_size,
+				     unsigned long long file_size) {
+  unsigned long long *w = (unsigned long long *) image;
+  unsigned long long n = header_size / 8, i, h = filter_hash(file_size);
+  if ((header_size > offsetof(kmer_memory_image_v2_t, build_id)) &&
+      ((kmer_memory_image_v2_t *) image)->build_id)
+    return ((kmer_memory_image_v2_t *) image)->build_id;
+  if (n > offsetof(kmer_memory_image_v2_t, base_id) / 8)
+    n = offsetof(kmer_memory_image_v2_t, base_id) / 8;
+  for (i=0; (i < n); i++)
+    h = filter_hash(h ^ w[i]);
+  return h | 1;
+}
+
+/*
+ * Map (or start copying, see -G) the image in fileM and check it; dataD
+ * supplies the index files of images older than version 3.  Nothing of
+ * the table itself is read.  Returns 0, with the reason in err, if it
+ * cannot be opened or is not an image this code understands; nothing is
+ * left open then.
+ */
+kmer_handle_t *open_image(const char *fileM, const char *dataD, char *err, size_t err_len) {
+  kmer_handle_t *handle = malloc(sizeof(kmer_handle_t));
+  if (handle == 0) {
+    snprintf(err, err_len, "could not allocate the kmer table handle");
+    return 0;
+  }
+  memset(handle, 0, sizeof(kmer_handle_t));
+  handle->image_fd = -1;
+  pthread_mutex_init(&handle->ready_lock, NULL);
+  pthread_cond_init(&handle->ready_cond, NULL);
+
+  kmer_memory_image_t *image;
+
+  char fileF[300];
+  snprintf(fileF, sizeof(fileF), "%s/function.index", dataD);
+  char fileO[300];
+  snprintf(fileO, sizeof(fileO), "%s/otu.index", dataD);
+
+  {
+    int fd;
+    if ((fd = open(fileM, O_RDONLY)) == -1) {
+      snprintf(err, err_len, "could not open %s: %s", fileM, strerror(errno));
+      goto fail;
+    }
+    handle->image_fd = fd;
+
+    /*
+     * Set up for creating memory image from file. Start by determining file size
+     * on disk with a stat() call.
+     */
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == -1) {
+      snprintf(err, err_len, "stat %s failed: %s", fileM, strerror(errno));
+      goto fail;
+    }
+    unsigned long long file_size = sbuf.st_size;
+    if (file_size < sizeof(kmer_memory_image_t)) {
+      snprintf(err, err_len, "Version mismatch for file %s: file is too short", fileM);
+      goto fail;
+    }
+
+    /* 
+     * Memory map (or copy, see -G); the warm-up threads started below
+     * bring the rest of the table into memory.
+     */
+    image = (kmer_memory_image_t *) open_table_image(handle, fd, file_size, fileM, err, err_len);
+    if (image == 0)
+      goto fail;
+
+    /* 
+     * Our image is mapped. Validate against the versions this code understands.
+     */
+    if ((image->version < (long long) OLDEST_VERSION) || (image->version > (long long) VERSION)) {
+      snprintf(err, err_len, "Version mismatch for file %s: file has %lld code handles %lld to %lld", 
+	       fileM, image->version, (long long) OLDEST_VERSION, (long long) VERSION);
+      goto fail;
+    }
+
+    unsigned long long header_size, entry_size;
+    if (image->version == 1) {
+      header_size = sizeof(kmer_memory_image_t);
+      entry_size  = sizeof(sig_kmer_t);
+    }
+    else {
+      header_size = ((kmer_memory_image_v2_t *) image)->header_size;
+      entry_size  = sizeof(sig_kmer_v2_t);
+      if ((header_size < offsetof(kmer_memory_image_v2_t, kmer_size)) || (header_size > file_size)) {
+	snprintf(err, err_len, "Version mismatch for file %s: bad header size %lld", fileM, header_size);
+	goto fail;
+      }
+    }
+
+    if (image->entry_size != entry_size) {
+      snprintf(err, err_len, "Version mismatch for file %s: file has entry size %lld code has %lld",
+	       fileM, image->entry_size, entry_size);
+      goto fail;
+    }
+
+    handle->version  = (int) image->version;
+    handle->num_sigs = image->num_sigs;
+    if (handle->version == 1) {
+      handle->kmer_table   = (sig_kmer_t *) ((char *) image + header_size);
+      handle->k            = kmer_size;
+      handle->max_encoded  = pow20[kmer_size];
+      set_hash_scheme(handle, HASH_MODULO);
+    }
+    else {
+      kmer_memory_image_v2_t *image2 = (kmer_memory_image_v2_t *) image;
+      handle->packed_table = (sig_kmer_v2_t *) ((char *) image + header_size);
+      if ((image2->hash_scheme != HASH_MODULO) && (image2->hash_scheme != HASH_ROBIN_HOOD) &&
+	  ((image2->hash_scheme != HASH_MPH) || (header_size < offsetof(kmer_memory_image_v2_t, reserved)))) {
+	snprintf(err, err_len, "Version mismatch for file %s: unknown hash scheme %lld", fileM, image2->hash_scheme);
+	goto fail;
+      }
+      if ((image2->hash_scheme == HASH_ROBIN_HOOD) && (image->num_sigs & (image->num_sigs - 1))) {
+	snprintf(err, err_len, "Version mismatch for file %s: Robin Hood table size is not a power of two", fileM);
+	goto fail;
+      }
+      set_hash_scheme(handle, (int) image2->hash_scheme);
+      handle->max_probe = image2->max_probe;
+      handle->k = (header_size > offsetof(kmer_memory_image_v2_t, kmer_size)) ? image2->kmer_size : 8;
+      if ((handle->k < MIN_K) || (handle->k > MAX_K)) {
+	snprintf(err, err_len, "Version mismatch for file %s: unsupported kmer size %d", fileM, handle->k);
+	goto fail;
+      }
+      handle->max_encoded = pow20[handle->k];
+      if (header_size > offsetof(kmer_memory_image_v2_t, base_id)) {
+	handle->base_id        = image2->base_id;
+	handle->first_function = image2->first_function;
+	handle->first_otu      = image2->first_otu;
+      }
+      if (image2->num_loaded)
+	fprintf(stderr, "%lld kmers, %s hash, probe length max %lld avg %.3f\n",
+		image2->num_loaded, hash_scheme_name(handle->hash_scheme), image2->max_probe,
+		(double) image2->total_probe / image2->num_loaded);
+    }
+    if (handle->num_sigs == 0) {
+      snprintf(err, err_len, "Version mismatch for file %s: empty table", fileM);
+      goto fail;
+    }
+
+    /* Validate overall file size vs the entry size and number of entries */
+    unsigned long long table_end = (entry_size * image->num_sigs) + header_size;
+    unsigned long long strings_size = 0;
+    if (handle->version >= 3) {
+      strings_size = ((kmer_memory_image_v2_t *) image)->strings_size;
+      if (((kmer_memory_image_v2_t *) image)->strings_offset != table_end) {
+	snprintf(err, err_len, "Version mismatch for file %s: bad string table offset", fileM);
+	goto fail;
+      }
+    }
+    unsigned long long end = table_end + strings_size;
+    unsigned long long mph_offset = 0, mph_size = 0;
+    if (handle->hash_scheme == HASH_MPH) {
+      mph_offset = ((kmer_memory_image_v2_t *) image)->mph_offset;
+      mph_size   = ((kmer_memory_image_v2_t *) image)->mph_size;
+      if ((mph_offset != ((end + 63) & ~63ULL)) || (mph_size < MPH_HEADER) || (mph_offset + mph_size > file_size)) {
+	snprintf(err, err_len, "Version mismatch for file %s: bad perfect hash", fileM);
+	goto fail;
+      }
+      end = mph_offset + mph_size;
+    }
+    unsigned long long filter_offset = 0, filter_size = 0;
+    if (handle->version >= 3) {
+      filter_offset = ((kmer_memory_image_v2_t *) image)->filter_offset;
+      filter_size   = ((kmer_memory_image_v2_t *) image)->filter_size;
+      if (filter_size && ((filter_offset & 63) || (filter_offset < end) ||
+			  (filter_size < FILTER_HEADER) || (filter_offset > file_size))) {
+	snprintf(err, err_len, "Version mismatch for file %s: bad prefilter", fileM);
+	goto fail;
+      }
+    }
+    if (file_size != (filter_size ? filter_offset + filter_size : end)) {
+      snprintf(err, err_len, "Version mismatch for file %s: file size does not match", fileM);
+      goto fail;
+    }
+
+    /* the names come with a version 3 image; older ones need the index files */
+    if (handle->version >= 3) {
+      char *p = (char *) image + table_end;
+      if (read_image_range(handle, table_end, strings_size, fileM, err, err_len) < 0)
+	goto fail;
+      if (((p = attach_string_table(p, p + strings_size, &handle->functions)) == 0) ||
+	  (attach_string_table(p, (char *) image + file_size, &handle->otus) == 0)) {
+	snprintf(err, err_len, "Version mismatch for file %s: bad string table", fileM);
+	goto fail;
+      }
+    }
+    else {
+      if ((load_string_table(fileF, &handle->functions, err, err_len) < 0) ||
+	  (load_string_table(fileO, &handle->otus, err, err_len) < 0))
+	goto fail;
+    }
+
+    if (mph_size) {
+      unsigned long long *hdr = (unsigned long long *) ((char *) image + mph_offset);
+      if (read_image_range(handle, mph_offset, MPH_HEADER, fileM, err, err_len) < 0)
+	goto fail;
+      if ((hdr[1] == 0) || (hdr[1] > handle->num_sigs) || ((hdr[3] != 2) && (hdr[3] != 4)) ||
+	  (hdr[2] < handle->num_sigs) || (hdr[2] - handle->num_sigs > handle->num_sigs) ||
+	  (mph_size != MPH_HEADER + mph_pilots_bytes(hdr[1], hdr[3]) + 8 * (hdr[2] - handle->num_sigs))) {
+	snprintf(err, err_len, "Version mismatch for file %s: bad perfect hash", fileM);
+	goto fail;
+      }
+      attach_mph(handle, hdr);
+    }
+
+    if (filter_size) {
+      unsigned long long *hdr = (unsigned long long *) ((char *) image + filter_offset);
+      if (read_image_range(handle, filter_offset, FILTER_HEADER, fileM, err, err_len) < 0)
+	goto fail;
+      if ((hdr[0] == 0) || (hdr[0] != (filter_size - FILTER_HEADER) / (FILTER_BLOCK_BITS / 8)) ||
+	  ((filter_size - FILTER_HEADER) % (FILTER_BLOCK_BITS / 8)) ||
+	  (hdr[1] < 1) || (hdr[1] > FILTER_MAX_HASHES)) {
+	snprintf(err, err_len, "Version mismatch for file %s: bad prefilter", fileM);
+	goto fail;
+      }
+      handle->filter        = hdr + FILTER_HEADER / 8;
+      handle->filter_blocks = hdr[0];
+      handle->filter_hashes = (int) hdr[1];
+      fprintf(stderr, "prefilter: %lld bytes, %d hashes per kmer\n", filter_size, handle->filter_hashes);
+    }
+
+    handle->fingerprint = image_fingerprint(image, header_size, file_size);
+    if (!handle->base_id)
+      fprintf(stderr, "Set size_hash=%lld from file size %lld (version %d image, K=%d)\n", handle->num_sigs, file_size, handle->version, handle->k);
+
+  }
+  return handle;
+
+ fail:
+  release_image(handle);
+  return 0;
+}
+
+/*
+ * Open the memory image in dataD for searching, with the delta beside it
+ * if there is one (see -u), and start paging it in.  The delta, which is
+ * small, is read in full here.  Returns 0, with the reason in err, if
+ * either cannot be opened or the delta was made for some other table;
+ * nothing is left open then.
+ */
+kmer_handle_t *open_kmers(const char *dataD, char *err, size_t err_len) {
+  char fileM[300];
+  snprintf(fileM, sizeof(fileM), "%s/kmer.table.mem_map", dataD);
+  char fileD[300];
+  snprintf(fileD, sizeof(fileD), "%s/kmer.delta.mem_map", dataD);
+
+  kmer_handle_t *handle = open_image(fileM, dataD, err, err_len);
+  if (handle == 0)
+    return 0;
+  if (handle->base_id) {
+    snprintf(err, err_len, "%s is a delta, not a table", fileM);
+    release_image(handle);
+    return 0;
+  }
+
+  if (access(fileD, F_OK) == 0) {
+    kmer_handle_t *delta = open_image(fileD, dataD, err, err_len);
+    if (delta == 0) {
+      release_image(handle);
+      return 0;
+    }
+    if ((delta->version < 3) || (delta->base_id != handle->fingerprint) ||
+	(delta->first_function != table_count(&handle->functions)) ||
+	(delta->first_otu != table_count(&handle->otus)) || (delta->k != handle->k)) {
+      snprintf(err, err_len, "%s was not made for %s; rebuild it with -u, or remove it", fileD, fileM);
+      release_image(delta);
+      release_image(handle);
+      return 0;
+    }
+    if (read_image_range(delta, 0, delta->image_size, fileD, err, err_len) < 0) {
+      release_image(delta);
+      release_image(handle);
+      return 0;
+    }
+    close(delta->image_fd);
+    delta->image_fd = -1;
+    delta->ready    = 1;
+    handle->delta = delta;
+    handle->functions.appended = &delta->functions;
+    handle->otus.appended      = &delta->otus;
+    fprintf(stderr, "applied %s: %lld functions and %lld OTUs added\n", fileD,
+	    delta->functions.count, delta->otus.count);
+  }
+
+  start_table_warmup(handle);
+  return handle;
+}
+
+/* release a table from open_kmers, once the warm-up is over; no scan may
+   be using it */
+void close_kmers(kmer_handle_t *handle) {
+  pthread_join(handle->warm_thread, NULL);
+  if (handle->delta)
+    release_image(handle->delta);
+  release_image(handle);
+}
+
+/*
+ * Deltas.  Rebuilding a large table for every curation change means
+ * building and shipping the whole image again.  Instead -u builds a small
+ * second image, kmer.delta.mem_map, from delta.kmers: the kmers added or
+ * given new data, in final.kmers form, and the kmers deleted, as
+ * "kmer<tab>-" lines.  It holds the names appended to function.index and
+ * otu.index since the table was built, records the fingerprint of the
+ * table it applies to, and is looked up before the table (see
+ * find_sig_kmer).  delta.kmers holds every change since the table was
+ * built; -u replaces any delta there was.  -c folds the delta into a new
+ * table.
+ */
+
+/* read an index file of dataD in full, checking that it extends base's names */
+void load_extended_names(char *dataD, char *name, const string_table_t *base, string_table_t *t) {
+  char file[300], err[1024];
+  unsigned long long i;
+  snprintf(file, sizeof(file), "%s/%s", dataD, name);
+  if (load_string_table(file, t, err, sizeof(err)) < 0) {
+    fprintf(stderr, "%s\n", err);
+    exit(1);
+  }
+  if (t->count < table_count(base)) {
+    fprintf(stderr,"%s has %lld names, fewer than the table's %lld; names may only be appended\n",
+	    file, t->count, table_count(base));
+    exit(1);
+  }
+  for (i=0; (i < table_count(base)); i++)
+    if (strcmp(table_string(t,i), table_string(base,i)) != 0) {
+      fprintf(stderr,"%s does not match the table at index %lld; names may only be appended\n",file,i);
+      exit(1);
+    }
+}
+
+/* -u: build dataD's delta from delta.kmers against its table */
+void build_delta(char *dataD) {
+  char err[1024];
+  char fileM[300];
+  snprintf(fileM, sizeof(fileM), "%s/kmer.table.mem_map", dataD);
+  char fileK[300];
+  snprintf(fileK, sizeof(fileK), "%s/delta.kmers", dataD);
+  char fileD[300];
+  snprintf(fileD, sizeof(fileD), "%s/kmer.delta.mem_map", dataD);
+
+  if (write_version < 3) {
+    fprintf(stderr,"a delta is always a version 3 image; -V does not apply to -u\n");
+    exit(1);
+  }
+  kmer_handle_t *base = open_image(fileM, dataD, err, sizeof(err));
+  if (base == 0) {
+    fprintf(stderr, "%s\n", err);
+    exit(1);
+  }
+  if (base->base_id) {
+    fprintf(stderr, "%s is a delta, not a table\n", fileM);
+    exit(1);
+  }
+
+  string_table_t functions, otus;
+  load_extended_names(dataD, "function.index", &base->functions, &functions);
+  load_extended_names(dataD, "otu.index", &base->otus, &otus);
+
+  kmer_handle_t build;
+  memset(&build, 0, sizeof(build));
+  build.base_id        = base->fingerprint;
+  build.first_function = table_count(&base->functions);
+  build.first_otu      = table_count(&base->otus);
+  build.functions = functions;
+  build.functions.count   -= build.first_function;
+  build.functions.offsets += build.first_function;
+  build.otus = otus;
+  build.otus.count   -= build.first_otu;
+  build.otus.offsets += build.first_otu;
+
+  /* size the table for the lines of delta.kmers, as -s would; no prefilter */
+  FILE *fp = fopen(fileK, "r");
+  if (fp == 0) {
+    fprintf(stderr,"could not open %s: %s\n",fileK,strerror(errno));
+    exit(1);
+  }
+  long long lines = 0;
+  int c;
+  while ((c = getc(fp)) != EOF)
+    lines += (c == '\n');
+  fclose(fp);
+  size_hash   = 3 * lines + 61;
+  kmer_size   = base->k;
+  filter_rate = 0;
+  build_mem_map(fileK, fileD, &build);
+  fprintf(stderr,"delta for %s: %lld functions and %lld OTUs added\n",
+	  fileM, build.functions.count, build.otus.count);
+
+  free_string_table(&functions);
+  free_string_table(&otus);
+  release_image(base);
+}
+
+/* write one kmer's data as a line of final.kmers */
+static void write_kmer_line(FILE *fp, int k, sig_kmer_t *entry) {
+  char kmer[MAX_K+1];
+  decoded_kmer(entry->which_kmer, k, kmer);
+  fprintf(fp, "%s\t%d\t%d\t%.9g\t%d\n", kmer, entry->avg_from_end, entry->function_index,
+	  entry->function_wt, entry->otu_index);
+}
+
+/*
+ * -c: fold dataD's delta into a new table.  The table's kmers, less those
+ * the delta deletes or replaces, and the delta's own are written out in
+ * final.kmers form and built into a table of the same size, scheme and K
+ * (bigger if they no longer fit), with a prefilter of the same rate if
+ * the old one had a prefilter and -E does not say otherwise.  The new
+ * table replaces the old and the delta is removed.  Returns the size of
+ * the new image.
+ */
+unsigned long long compact_kmers(char *dataD) {
+  char err[1024];
+  char fileM[300];
+  snprintf(fileM, sizeof(fileM), "%s/kmer.table.mem_map", dataD);
+  char fileD[300];
+  snprintf(fileD, sizeof(fileD), "%s/kmer.delta.mem_map", dataD);
+  char fileK[300];
+  snprintf(fileK, sizeof(fileK), "%s/compact.kmers.tmp", dataD);
+
+  kmer_handle_t *old = open_kmers(dataD, err, sizeof(err));
+  if (old == 0) {
+    fprintf(stderr, "%s\n", err);
+    exit(1);
+  }
+  wait_for_table(old);
+  kmer_handle_t *delta = old->delta;
+
+  FILE *fp = fopen(fileK, "w");
+  if (fp == 0) {
+    fprintf(stderr,"could not open %s for writing: %s\n",fileK,strerror(errno));
+    exit(1);
+  }
+  setvbuf(fp, NULL, _IOFBF, OUTPUT_BUFSZ);
+  unsigned long long i, kept = 0, base_loaded = 0, added = 0, deleted = 0;
+  sig_kmer_t entry;
+  for (i=0; (i < old->num_sigs); i++) {
+    unsigned long long which = slot_kmer(old,i);
+    if (which > old->max_encoded)
+      continue;
+    base_loaded++;
+    if (delta && (lookup_hash_entry(0,delta,which) >= 0))
+      continue;
+    if (old->version == 1)
+      entry = old->kmer_table[i];
+    else
+      unpack_sig_kmer(&old->packed_table[i], &entry);
+    write_kmer_line(fp, old->k, &entry);
+    kept++;
+  }
+  for (i=0; delta && (i < delta->num_sigs); i++) {
+    if (slot_kmer(delta,i) > delta->max_encoded)
+      continue;
+    unpack_sig_kmer(&delta->packed_table[i], &entry);
+    if (entry.function_index == DELTA_DELETED) {
+      deleted++;
+      continue;
+    }
+    write_kmer_line(fp, old->k, &entry);
+    added++;
+  }
+  if ((fflush(fp) != 0) || ferror(fp) || (fclose(fp) != 0)) {
+    fprintf(stderr,"error writing %s: %s\n",fileK,strerror(errno));
+    exit(1);
+  }
+
+  unsigned long long loaded = kept + added;
+  size_hash         = old->num_sigs;
+  kmer_size         = old->k;
+  write_hash_scheme = old->hash_scheme;
+  if (!version_given)
+    write_version = old->version;
+  if (loaded >= ((write_hash_scheme == HASH_ROBIN_HOOD) ? (size_hash / 8) * 7 : size_hash / 2))
+    size_hash = 3 * loaded;
+  if ((filter_rate == 0) && old->filter && base_loaded && (write_version >= 3))
+    filter_rate = exp(-(double) (old->filter_blocks * FILTER_BLOCK_BITS) / base_loaded * M_LN2 * M_LN2);
+
+  kmer_handle_t build;
+  memset(&build, 0, sizeof(build));
+  build.functions = old->functions;
+  build.otus      = old->otus;
+  unsigned long long image_size = build_mem_map(fileK, fileM, &build);
+  unlink(fileK);
+  if (delta && (unlink(fileD) != 0)) {
+    fprintf(stderr,"could not remove %s: %s\n",fileD,strerror(errno));
+    exit(1);
+  }
+  fprintf(stderr,"compacted: %lld kmers kept, %lld added or replaced, %lld deleted by the delta\n",
+	  kept, added, deleted);
+  close_kmers(old);
+  return image_size;
+}
+
+/* build the image first with -w (or the delta with -u, or a compacted
+   image with -c); any failure ends the program */
+kmer_handle_t *init_kmers(char *dataD) {
+  char err[1024];
+
+  if (write_mem_map) {
+    kmer_handle_t build;
+    memset(&build, 0, sizeof(build));
+
+    char fileK[300];
+    snprintf(fileK, sizeof(fileK), "%s/final.kmers", dataD);
+    char fileF[300];
+    snprintf(fileF, sizeof(fileF), "%s/function.index", dataD);
+    char fileO[300];
+    snprintf(fileO, sizeof(fileO), "%s/otu.index", dataD);
+    char fileM[300];
+    snprintf(fileM, sizeof(fileM), "%s/kmer.table.mem_map", dataD);
+
+    if ((load_string_table(fileF, &build.functions, err, sizeof(err)) < 0) ||
+	(load_string_table(fileO, &build.otus, err, sizeof(err)) < 0)) {
+      fprintf(stderr, "%s\n", err);
+      exit(1);
+    }
+    unsigned long long image_size = build_mem_map(fileK, fileM, &build);
+    free_string_table(&build.functions);
+    free_string_table(&build.otus);
+
+    /* a delta applies to the table it was made for, and that is gone */
+    char fileD[300];
+    snprintf(fileD, sizeof(fileD), "%s/kmer.delta.mem_map", dataD);
+    if (unlink(fileD) == 0)
+      fprintf(stderr,"removed %s, which applied to the old table\n",fileD);
+
+    char fileS[300];
+    snprintf(fileS, sizeof(fileS), "%s/size_hash.and.table_size", dataD);
+    FILE *fp = fopen(fileS,"w");
+    fprintf(fp,"%lld\t%lld\n",size_hash,image_size);
+    fclose(fp);
+  }
+  else if (write_delta)
+    build_delta(dataD);
+  else if (compact_table) {
+    unsigned long long image_size = compact_kmers(dataD);
+
+    char fileS[300];
+    snprintf(fileS, sizeof(fileS), "%s/size_hash.and.table_size", dataD);
+    FILE *fp = fopen(fileS,"w");
+    fprintf(fp,"%lld\t%lld\n",size_hash,image_size);
+    fclose(fp);
+  }
+  if (write_mem_map || write_delta || compact_table) {
+    /* -j makes it again from the new table */
+    char fileJ[300];
+    snprintf(fileJ, sizeof(fileJ), "%s/kmer.sorted", dataD);
+    unlink(fileJ);
+  }
+
+  /*
+   * Now map the image (the one we just built, with -w) for searching.
+   */
+  kmer_handle_t *handle = open_kmers(dataD, err, sizeof(err));
+  if (handle == 0) {
+    fprintf(stderr, "%s\n", err);
+    exit(1);
+  }
+  return handle;
+}
+
+/*
+ * Move *p to the first offset whose K residues are all unambiguous.  amb
+ * lists the offsets of the ambiguous residues (index 20) in ascending
+ * order, ending with INT_MAX; it is advanced past those behind *p, so it
+ * is left pointing at the first ambiguous residue after the kmer at *p.
+ */
+static inline void advance_past_ambig(long *p,int **amb,const int k) {
+
+  while (**amb < *p + k) {
+    if (**amb >= *p)
+      *p = **amb + 1;
+    (*amb)++;
+  }
+}
+
+void display_hits(kmer_scan_ctx_t *ctx, FILE *fh) {
+  fprintf(fh, "hits: ");
+  int i;
+  for (i=0; (i < ctx->num_hits); i++) {
+    fprintf(fh, "%d/%f/%d ", ctx->hits[i].from0_in_prot,ctx->hits[i].function_wt,ctx->hits[i].fI);
+  }
+  fprintf(fh, "\n");
+}
+
+
+/* -R: count n hits, of summed weight wt, for function or OTU i in the
+   read tally t, growing it if i is past its end */
+static inline void tally_add(read_tally_t *t, int i, int n, float wt) {
+  if (i >= t->size) {
+    int size = (2 * t->size > i + 1) ? 2 * t->size : i + 1024;
+    t->counts  = realloc(t->counts, size * sizeof(int));
+    t->weights = realloc(t->weights, size * sizeof(float));
+    t->seen    = realloc(t->seen, size * sizeof(int));
+    if ((t->counts == 0) || (t->weights == 0) || (t->seen == 0)) {
+      fprintf(stderr,"could not allocate a tally of %d entries\n",size);
+      exit(1);
+    }
+    memset(t->counts + t->size, 0, (size - t->size) * sizeof(int));
+    memset(t->weights + t->size, 0, (size - t->size) * sizeof(float));
+    t->size = size;
+  }
+  if (t->counts[i] == 0)
+    t->seen[t->num_seen++] = i;
+  t->counts[i]  += n;
+  t->weights[i] += wt;
+}
+
+static inline void tally_clear(read_tally_t *t) {
+  int i;
+  for (i=0; (i < t->num_seen); i++) {
+    t->counts[t->seen[i]]  = 0;
+    t->weights[t->seen[i]] = 0;
+  }
+  t->num_seen = 0;
+}
+
+void free_tally(read_tally_t *t) {
+  free(t->counts);
+  free(t->weights);
+  free(t->seen);
+  memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Memory for a scan (hits, the OTU tally, the scan window) ran out.  The
+ * program ends, as it does for any allocation that fails.  The library
+ * must not end its caller, so it only notes the failure: the scan goes on
+ * without whatever needed the memory, and kmer_scan_dna or
+ * kmer_scan_protein returns -1 with errno ENOMEM (see scan_buffer).
+ */
+static void scan_alloc_failed(kmer_scan_ctx_t *ctx, const char *fmt, ...) {
+#ifdef KMER_GUTS_LIBRARY
+  ctx->alloc_failed = 1;
+#else
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  exit(1);
+#endif
+}
+
+/*
+ * Output.  Each kind of result has a text form (the lines described at the
+ * top of this file) and a binary record (see BINARY OUTPUT); the record is
+ * a one-byte type and a four-byte payload length, then the payload.
+ */
+#define REC_HEADER 5
+
+static inline unsigned char *put_u32(unsigned char *p, unsigned int v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+  return p + 4;
+}
+
+/* charge n bytes of output, written since t0, to the counters */
+static inline void count_output(kmer_scan_ctx_t *ctx, long n, double t0) {
+  ctx->stats.bytes_out += n;
+  ctx->stats.output_time += now_seconds() - t0;
+}
+
+/* write a record whose payload is fixed followed by tail; returns its size */
+int write_record(FILE *fh, int type, unsigned char *fixed, unsigned int fixed_len,
+		 const char *tail, unsigned int tail_len) {
+  unsigned char hdr[REC_HEADER];
+  hdr[0] = type;
+  put_u32(hdr + 1, fixed_len + tail_len);
+  fwrite(hdr, 1, REC_HEADER, fh);
+  if (fixed_len)
+    fwrite(fixed, 1, fixed_len, fh);
+  if (tail_len)
+    fwrite(tail, 1, tail_len, fh);
+  return REC_HEADER + fixed_len + tail_len;
+}
+
+/* the start of a contig ("processing") or of a protein ("PROTEIN-ID") */
+void emit_sequence(kmer_scan_ctx_t *ctx, FILE *fh, char *id, long ln) {
+  double t0;
+  int n;
+  if ((ctx->aa && ctx->hits_only) || ctx->callbacks)
+    return;
+  t0 = now_seconds();
+  if (ctx->binary_output) {
+    unsigned char rec[5];
+    put_u32(rec, ln);
+    rec[4] = ctx->aa;
+    n = write_record(fh, 'S', rec, sizeof(rec), id, strlen(id));
+  }
+  else if (ctx->aa)
+    n = fprintf(fh, "PROTEIN-ID\t%s\t%d\n",id,(int) ln);
+  else
+    n = fprintf(fh, "processing %s[%ld]\n",id,ln);
+  count_output(ctx, n, t0);
+}
+
+void emit_translation(kmer_scan_ctx_t *ctx, FILE *fh, char strand, int off) {
+  double t0;
+  int n;
+  if (ctx->hits_only || ctx->callbacks)
+    return;
+  t0 = now_seconds();
+  if (ctx->binary_output) {
+    unsigned char rec[2];
+    rec[0] = strand;
+    rec[1] = off;
+    n = write_record(fh, 'T', rec, sizeof(rec), 0, 0);
+  }
+  else
+    n = fprintf(fh, "TRANSLATION\t%s\t%d\t%c\t%d\n",ctx->current_id,
+	    ctx->current_length_contig,
+	    strand,
+	    off);
+  count_output(ctx, n, t0);
+}
+
+void emit_call(kmer_scan_ctx_t *ctx, FILE *fh, int start, int end, int count, int fI, float weighted_hits) {
+  double t0;
+  int n;
+  ctx->stats.calls++;
+  if (ctx->callbacks) {
+    if (ctx->callbacks->call) {
+      kmer_call_t call;
+      call.id             = ctx->current_id;
+      call.strand         = ctx->current_strand;
+      call.frame          = ctx->current_prot_off;
+      call.start          = start;
+      call.end            = end;
+      call.hits           = count;
+      call.weighted_hits  = weighted_hits;
+      call.function_index = fI;
+      call.function       = table_string(&ctx->kmersH->functions, fI);
+      ctx->callbacks->call(ctx->callbacks->arg, &call);
+    }
+    return;
+  }
+  if (ctx->hits_only)
+    return;
+  t0 = now_seconds();
+  if (ctx->binary_output) {
+    union { unsigned int u; float f; } wt;
+    unsigned char rec[20];
+    unsigned char *p = rec;
+    wt.f = weighted_hits;
+    p = put_u32(p, start);
+    p = put_u32(p, end);
+    p = put_u32(p, count);
+    p = put_u32(p, fI);
+    put_u32(p, wt.u);
+    n = write_record(fh, 'C', rec, sizeof(rec), 0, 0);
+  }
+  else
+    n = fprintf(fh, "CALL\t%d\t%d\t%d\t%d\t%s\t%f\n",start,end,count,fI,
+		table_string(&ctx->kmersH->functions, fI),
+		weighted_hits);
+  count_output(ctx, n, t0);
+}
+
+/* the first num_top entries of ctx->otu_top */
+void emit_otu_counts(kmer_scan_ctx_t *ctx, FILE *fh, int num_top) {
+  double t0;
+  int i, n;
+  if (ctx->callbacks) {
+    if (ctx->callbacks->otu_counts)
+      ctx->callbacks->otu_counts(ctx->callbacks->arg, ctx->current_id, ctx->otu_top, num_top);
+    return;
+  }
+  if (ctx->hits_only)
+    return;
+  t0 = now_seconds();
+  if (ctx->binary_output) {
+    unsigned char hdr[REC_HEADER + 4];
+    hdr[0] = 'O';
+    put_u32(hdr + 1, 4 + 8 * num_top);
+    put_u32(hdr + REC_HEADER, num_top);
+    fwrite(hdr, 1, sizeof(hdr), fh);
+    for (i=0; (i < num_top); i++) {
+      unsigned char pair[8];
+      put_u32(put_u32(pair, ctx->otu_top[i].count), ctx->otu_top[i].otu_index);
+      fwrite(pair, 1, sizeof(pair), fh);
+    }
+    n = sizeof(hdr) + 8 * num_top;
+  }
+  else {
+    n = fprintf(fh, "OTU-COUNTS\t%s[%d]",ctx->current_id,ctx->current_length_contig);
+    for (i=0; (i < num_top); i++) {
+      n += fprintf(fh, "\t%d-%d",ctx->otu_top[i].count,ctx->otu_top[i].otu_index);
+    }
+    n += fprintf(fh, "\n");
+  }
+  count_output(ctx, n, t0);
+}
+
+void emit_flush(kmer_scan_ctx_t *ctx, FILE *fh) {
+  double t0 = now_seconds();
+  int n;
+  if (ctx->binary_output)
+    n = write_record(fh, 'F', 0, 0, 0, 0);
+  else
+    n = fprintf(fh, "//\n");
+  count_output(ctx, n, t0);
+}
+
+/* -R 1: the classification of a read; fI and oI are -1 if it has none.
+   Its time is counted with the read's (see time_reads) */
+void emit_read(kmer_scan_ctx_t *ctx, FILE *fh, char *id, int fI, int hits, float weighted_hits,
+	       int oI, int votes) {
+  int n;
+  if (ctx->binary_output) {
+    union { unsigned int u; float f; } wt;
+    unsigned char rec[20];
+    unsigned char *p = rec;
+    wt.f = weighted_hits;
+    p = put_u32(p, fI);
+    p = put_u32(p, hits);
+    p = put_u32(p, wt.u);
+    p = put_u32(p, oI);
+    put_u32(p, votes);
+    n = write_record(fh, 'R', rec, sizeof(rec), id, strlen(id));
+  }
+  else
+    n = fprintf(fh, "READ\t%s\t%d\t%d\t%.3f\t%d\t%d\n",id,fI,hits,weighted_hits,oI,votes);
+  ctx->stats.bytes_out += n;
+}
+
+/* an entry of a read tally (a function or OTU index) and its reads */
+typedef struct ranked_entry {
+  unsigned int index;
+  unsigned int count;
+} ranked_entry_t;
+
+/* more reads first, then the lower index */
+int ranked_entry_cmp(const void *a, const void *b) {
+  const ranked_entry_t *x = a, *y = b;
+  if (x->count != y->count)
+    return (x->count > y->count) ? -1 : 1;
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+/* t's entries, most first and ties by index */
+static ranked_entry_t *ranked_tally(kmer_scan_ctx_t *ctx, read_tally_t *t) {
+  ranked_entry_t *r = malloc((t->num_seen ? t->num_seen : 1) * sizeof(ranked_entry_t));
+  int i;
+  if (r == 0) {
+    scan_alloc_failed(ctx, "could not allocate a table of %d entries\n", t->num_seen);
+    return 0;
+  }
+  for (i=0; (i < t->num_seen); i++) {
+    r[i].index = t->seen[i];
+    r[i].count = t->counts[t->seen[i]];
+  }
+  qsort(r, t->num_seen, sizeof(ranked_entry_t), ranked_entry_cmp);
+  return r;
+}
+
+/* -R 2: the reads assigned to each function and OTU since the last tables,
+   which are then cleared */
+void emit_read_tables(kmer_scan_ctx_t *ctx, FILE *fh) {
+  double t0 = now_seconds();
+  ranked_entry_t *fr  = ranked_tally(ctx, &ctx->batch_functions);
+  ranked_entry_t *orr = ranked_tally(ctx, &ctx->batch_otus);
+  int nf = ctx->batch_functions.num_seen, no = ctx->batch_otus.num_seen;
+  long n = 0;
+  int i;
+
+  if ((fr == 0) || (orr == 0))
+    nf = no = 0;
+
+  if (ctx->binary_output) {
+    unsigned char hdr[REC_HEADER + 12], pair[8];
+    hdr[0] = 'A';
+    put_u32(hdr + 1, 16 + 8 * (nf + no));
+    put_u32(put_u32(put_u32(hdr + REC_HEADER, ctx->batch_reads), ctx->batch_assigned), nf);
+    fwrite(hdr, 1, sizeof(hdr), fh);
+    for (i=0; (i < nf); i++) {
+      put_u32(put_u32(pair, fr[i].count), fr[i].index);
+      fwrite(pair, 1, sizeof(pair), fh);
+    }
+    put_u32(pair, no);
+    fwrite(pair, 1, 4, fh);
+    for (i=0; (i < no); i++) {
+      put_u32(put_u32(pair, orr[i].count), orr[i].index);
+      fwrite(pair, 1, sizeof(pair), fh);
+    }
+    n = REC_HEADER + 16 + 8 * (nf + no);
+  }
+  else {
+    const string_table_t *functions = &ctx->kmersH->functions, *otus = &ctx->kmersH->otus;
+    n += fprintf(fh, "READ-COUNTS\t%llu\t%llu\n",ctx->batch_reads,ctx->batch_assigned);
+    for (i=0; (i < nf); i++)
+      n += fprintf(fh, "FUNCTION-READS\t%u\t%u\t%s\n",fr[i].count,fr[i].index,
+		   (fr[i].index < table_count(functions)) ? table_string(functions, fr[i].index) : "");
+    for (i=0; (i < no); i++)
+      n += fprintf(fh, "OTU-READS\t%u\t%u\t%s\n",orr[i].count,orr[i].index,
+		   (orr[i].index < table_count(otus)) ? table_string(otus, orr[i].index) : "");
+  }
+  count_output(ctx, n, t0);
+  free(fr);
+  free(orr);
+  tally_clear(&ctx->batch_functions);
+  tally_clear(&ctx->batch_otus);
+  ctx->batch_reads = ctx->batch_assigned = 0;
+}
+
+/* -B 2: the function strings, once, so that calls need carry only the index */
+void emit_dictionary(kmer_scan_ctx_t *ctx, FILE *fh) {
+  kmer_handle_t *kmersH = ctx->kmersH;
+  unsigned long long len = 4;
+  int i;
+  for (i=0; (i < table_count(&kmersH->functions)); i++)
+    len += 4 + strlen(table_string(&kmersH->functions, i));
+
+  unsigned char hdr[REC_HEADER + 4];
+  hdr[0] = 'D';
+  put_u32(hdr + 1, len);
+  put_u32(hdr + REC_HEADER, table_count(&kmersH->functions));
+  fwrite(hdr, 1, sizeof(hdr), fh);
+  for (i=0; (i < table_count(&kmersH->functions)); i++) {
+    unsigned char n[4];
+    unsigned int l = strlen(table_string(&kmersH->functions, i));
+    put_u32(n, l);
+    fwrite(n, 1, 4, fh);
+    fwrite(table_string(&kmersH->functions, i), 1, l, fh);
+  }
+  ctx->stats.bytes_out += REC_HEADER + len;
+}
+
+/* make room in the OTU tally for OTU indexes below need */
+int grow_otu_tally(kmer_scan_ctx_t *ctx, int need) {
+  int size = ctx->otu_counts_size ? 2 * ctx->otu_counts_size : table_count(&ctx->kmersH->otus);
+  int *counts, *seen;
+  kmer_otu_count_t *top;
+  if (size < need)
+    size = need;
+  /* each array is kept until its replacement exists, so a failure leaves the old tally usable */
+  if ((counts = realloc(ctx->otu_counts, size * sizeof(int))) != 0)
+    ctx->otu_counts = counts;
+  if ((seen = realloc(ctx->otu_seen, size * sizeof(int))) != 0)
+    ctx->otu_seen = seen;
+  if ((top = realloc(ctx->otu_top, size * sizeof(kmer_otu_count_t))) != 0)
+    ctx->otu_top = top;
+  if ((counts == 0) || (seen == 0) || (top == 0)) {
+    scan_alloc_failed(ctx, "could not allocate the OTU tally for %d OTUs\n", size);
+    return -1;
+  }
+  memset(ctx->otu_counts + ctx->otu_counts_size, 0, (size - ctx->otu_counts_size) * sizeof(int));
+  ctx->otu_counts_size = size;
+  return 0;
+}
+
+/* record one OTU vote for the current sequence.  A frame context that is
+   scanning in parallel just logs its votes; the parent replays them in frame
+   order, so the tallies come out exactly as a serial scan leaves them. */
+void count_otu(kmer_scan_ctx_t *ctx, int oI) {
+  if (ctx->log_otu_votes) {
+    if (ctx->num_otu_votes == ctx->otu_votes_size) {
+      int size = ctx->otu_votes_size ? 2 * ctx->otu_votes_size : 1024;
+      int *votes = realloc(ctx->otu_votes, size * sizeof(int));
+      if (votes == 0) {
+        scan_alloc_failed(ctx, "could not allocate %d OTU votes\n", size);
+        return;
+      }
+      ctx->otu_votes = votes;
+      ctx->otu_votes_size = size;
+    }
+    ctx->otu_votes[ctx->num_otu_votes++] = oI;
+    return;
+  }
+
+  if (oI < 0)
+    return;
+  if ((oI >= ctx->otu_counts_size) && (grow_otu_tally(ctx, oI + 1) < 0))
+    return;
+  if (ctx->otu_counts[oI]++ == 0)
+    ctx->otu_seen[ctx->num_otu_seen++] = oI;
+}
+
+/* more votes first, then the lower OTU index */
+int otu_count_cmp(const void *a, const void *b) {
+  const kmer_otu_count_t *x = a, *y = b;
+  if (x->count != y->count)
+    return (x->count > y->count) ? -1 : 1;
+  return (x->otu_index > y->otu_index) - (x->otu_index < y->otu_index);
+}
+
+/* fill ctx->otu_top with the ctx->otu_report best OTUs of the tally (all
+   of them if otu_report is 0), in otu_count_cmp order; returns how many */
+int rank_otus(kmer_scan_ctx_t *ctx) {
+  kmer_otu_count_t *top = ctx->otu_top;
+  int seen = ctx->num_otu_seen;
+  int want = ((ctx->otu_report > 0) && (ctx->otu_report < seen)) ? ctx->otu_report : seen;
+  int i, n = 0;
+
+  if (want == seen) {
+    for (i=0; (i < seen); i++) {
+      top[i].otu_index = ctx->otu_seen[i];
+      top[i].count     = ctx->otu_counts[top[i].otu_index];
+    }
+    if (seen > 1)
+      qsort(top, seen, sizeof(kmer_otu_count_t), otu_count_cmp);
+    return seen;
+  }
+
+  /* a short list kept in order; most OTUs fail the test against its last entry */
+  for (i=0; (i < seen); i++) {
+    kmer_otu_count_t c;
+    c.otu_index = ctx->otu_seen[i];
+    c.count     = ctx->otu_counts[c.otu_index];
+    if ((n == want) && (otu_count_cmp(&c, &top[n-1]) >= 0))
+      continue;
+    int j = (n < want) ? n++ : n - 1;
+    while ((j > 0) && (otu_count_cmp(&c, &top[j-1]) < 0)) {
+      top[j] = top[j-1];
+      j--;
+    }
+    top[j] = c;
+  }
+  return n;
+}
+
+/* start a set of hits for fI */
+static inline void start_set_of_hits(kmer_scan_ctx_t *ctx, int fI) {
+  ctx->current_fI = fI;
+  ctx->fI_hits    = 0;
+  ctx->fI_weight  = 0;
+  ctx->fI_last    = 0;
+}
+
+/* append a hit to the set, growing the buffer as needed */
+static inline void add_hit(kmer_scan_ctx_t *ctx, hit_t *hit) {
+  if (ctx->num_hits == ctx->hits_size) {
+    hit_t *hits = realloc(ctx->hits, 2 * ctx->hits_size * sizeof(hit_t));
+    if (hits == 0) {
+      scan_alloc_failed(ctx, "could not allocate %d hits\n", 2 * ctx->hits_size);
+      return;
+    }
+    ctx->hits = hits;
+    ctx->hits_size *= 2;
+  }
+  if (hit->fI == ctx->current_fI) {
+    ctx->fI_hits++;
+    ctx->fI_weight += hit->function_wt;
+    ctx->fI_last = ctx->num_hits;
+  }
+  ctx->hits[ctx->num_hits++] = *hit;
+}
+
+void process_set_of_hits(kmer_scan_ctx_t *ctx, FILE *fh) {
+  int fI_count = ctx->fI_hits;
+  float weighted_hits = ctx->fI_weight;
+  int last_hit = ctx->fI_last;
+  int i;
+  if ((fI_count >= ctx->min_hits) && (weighted_hits >= ctx->min_weighted_hits)) {
+      emit_call(ctx, fh, ctx->hits[0].from0_in_prot,
+		ctx->hits[last_hit].from0_in_prot+(ctx->kmersH->k-1),
+		fI_count,
+		ctx->current_fI,
+		weighted_hits);
+
+      if (ctx->debug > 1) {
+	  fprintf(fh, "after-call: ");
+	  display_hits(ctx, fh);
+    }
+    /* once we have decided to call a region, we take the kmers for fI and
+       add them to the counts maintained to assign an OTU to the sequence.
+       Each hit belongs to one set (bar the two carried below), so these
+       passes cost a constant per hit over the whole sequence. */
+    for (i=0; (i <= last_hit); i++) {
+      if (ctx->hits[i].fI == ctx->current_fI)
+	count_otu(ctx, ctx->hits[i].oI);
+    }
+  }
+
+  if ((ctx->hits[ctx->num_hits-2].fI != ctx->current_fI) && (ctx->hits[ctx->num_hits-2].fI == ctx->hits[ctx->num_hits-1].fI)) {
+      /*
+    fprintf(stderr, "Copying two entries cur=%d %d: %d, %d: %d\n",
+	    ctx->current_fI,
+	    ctx->num_hits - 2, ctx->hits[ctx->num_hits-2].fI, 
+	    ctx->num_hits - 1, ctx->hits[ctx->num_hits-1].fI);
+      */
+    /* the last two hits start the next set */
+    hit_t carry[2];
+    carry[0] = ctx->hits[ctx->num_hits-2];
+    carry[1] = ctx->hits[ctx->num_hits-1];
+    start_set_of_hits(ctx, carry[1].fI);
+    ctx->num_hits = 0;
+    add_hit(ctx, &carry[0]);
+    add_hit(ctx, &carry[1]);
+  }
+  else {
+    ctx->num_hits = 0;
+  }
+}
+
+/* -R: a read's hits are only collected, for classify_read */
+static inline void add_read_hit(kmer_scan_ctx_t *ctx, long pos, sig_kmer_t *entry) {
+  hit_t hit;
+  hit.oI = entry->otu_index;
+  hit.fI = entry->function_index;
+  hit.from0_in_prot = pos;
+  hit.avg_off_from_end = entry->avg_from_end;
+  hit.function_wt = entry->function_wt;
+  add_hit(ctx, &hit);
+}
+
+/* fold one signature hit at offset pos of the protein into the current set of hits */
+void record_hit(kmer_scan_ctx_t *ctx, long pos, unsigned long long encodedK, sig_kmer_t *kmers_hash_entry, FILE *fh) {
       int avg_off_end = kmers_hash_entry->avg_from_end;
       int fI        = kmers_hash_entry->function_index;
       int oI          = kmers_hash_entry->otu_index;
       float f_wt      = kmers_hash_entry->function_wt;
-      if (debug >= 1) {
-	  if (hits_only)
-	      fprintf(fh, "%ld\t%s\n",encodedK, current_id);
+      if (ctx->debug >= 1) {
+	  if (ctx->hits_only)
+	      fprintf(fh, "%lld\t%s\n",encodedK, ctx->current_id);
 	  else
-	      fprintf(fh, "HIT\t%ld\t%lld\t%d\t%d\t%0.3f\t%d\n",p-pIseq,encodedK,avg_off_end,fI,f_wt,oI);
+	      fprintf(fh, "HIT\t%ld\t%lld\t%d\t%d\t%0.3f\t%d\n",pos,encodedK,avg_off_end,fI,f_wt,oI);
+      }
+
+      if ((ctx->num_hits > 0) && (ctx->hits[ctx->num_hits-1].from0_in_prot + ctx->max_gap) < pos) {
+	if (ctx->num_hits >= ctx->min_hits) {
+	    // fprintf(stderr, "pset from %d cur=%d\n",  __LINE__, ctx->current_fI);
+	    process_set_of_hits(ctx, fh);
+	}
+	else {
+	  ctx->num_hits = 0;
+	}
+      }
+
+      if (ctx->num_hits == 0) {
+	start_set_of_hits(ctx, fI);   /* if this is the first, set the ctx->current_fI */
+      }
+
+      if ((! ctx->order_constraint) || (ctx->num_hits == 0) ||
+	  ((fI == ctx->hits[ctx->num_hits-1].fI) &&
+	   (abs((pos - ctx->hits[ctx->num_hits-1].from0_in_prot) - 
+                (ctx->hits[ctx->num_hits-1].avg_off_from_end - avg_off_end)
+		) <= 20))) {
+          /* we have a new hit, so we add it to the global set of hits */
+	hit_t hit;
+	hit.oI = oI;
+	hit.fI = fI;
+	hit.from0_in_prot = pos;
+	hit.avg_off_from_end = avg_off_end;
+	hit.function_wt = f_wt;
+	add_hit(ctx, &hit);
+	if (ctx->debug > 1) {
+	    fprintf(fh, "after-hit: ");
+	    display_hits(ctx, fh);
+	}
+	if ((ctx->num_hits > 1) && (ctx->current_fI != fI) &&           /* if we have a pair of new fIs, it is time to */
+	    (ctx->hits[ctx->num_hits-2].fI == ctx->hits[ctx->num_hits-1].fI)) {   /* process one set and initialize the next */
+	    // fprintf(stderr, "pset from %d cur=%d\n",  __LINE__, ctx->current_fI);
+	    process_set_of_hits(ctx, fh);
+	}
+      }
+}
+
+/*
+ * Each lookup is a dependent random access into a table far larger than
+ * any cache, so rather than resolving one kmer at a time we encode a batch
+ * of upcoming kmers, prefetch their home slots, and then resolve the batch
+ * in order.  The hits are handed to record_hit in exactly the order the
+ * one-at-a-time loop produced them.
+ */
+#define LOOKUP_BATCH 16
+
+/*
+ * Scan the kmers starting at offsets [from, to) of a protein (or translated
+ * frame).  pIseq holds the residues from offset from on -- at least
+ * to - from + K - 1 of them.  The set of hits is carried over from one
+ * call to the next, so a long sequence can be scanned a window at a time;
+ * finish_hits() closes the sequence.
+ */
+static inline __attribute__((always_inline))
+void gather_hits_k(kmer_scan_ctx_t *ctx, unsigned char *pIseq, int *amb, long from, long to, FILE *fh,
+		   const int k) {
+
+  const unsigned long long core = pow20[k-1];
+  long p = 0;
+  long bound = to - from;
+  long run_end = 0;       /* the kmers before run_end hold no ambiguous residue */
+  unsigned long long encodedK=0;
+
+  unsigned long long batch_kmer[LOOKUP_BATCH];
+  long batch_pos[LOOKUP_BATCH];
+  unsigned long long batch_hash[LOOKUP_BATCH];
+  const unsigned long long *batch_block[LOOKUP_BATCH];
+  kmer_handle_t *kmersH = ctx->kmersH;
+  while (p < bound) {
+    int n = 0;
+    while ((p < bound) && (n < LOOKUP_BATCH)) {
+      if (p < run_end) {
+	encodedK = ((encodedK % core) * 20L) + pIseq[p+k-1];
+      }
+      else {
+	long skipped_from = p;
+	advance_past_ambig(&p,&amb,k);
+	ctx->stats.ambig_skips += ((p < bound) ? p : bound) - skipped_from;
+	if (p >= bound)
+	  break;
+	run_end = (*amb - k + 1 < bound) ? *amb - k + 1 : bound;
+	encodedK = encoded_kmer(pIseq + p,k);
+      }
+      batch_kmer[n] = encodedK;
+      batch_pos[n]  = from + p;
+      if (kmersH->filter) {
+	batch_hash[n]  = filter_hash(encodedK);
+	batch_block[n] = filter_block(kmersH,batch_hash[n]);
+	__builtin_prefetch(batch_block[n]);
+      }
+      else
+	prefetch_hash_entry(kmersH,encodedK);
+      n++;
+      p++;
+    }
+
+    int i;
+    if (kmersH->filter) {
+      /* keep the kmers that pass the filter, and only then go to the table */
+      int m = 0;
+      for (i=0; (i < n); i++) {
+	if (filter_test(batch_block[i],batch_hash[i],kmersH->filter_hashes) ||
+	    (kmersH->delta && (lookup_hash_entry(0,kmersH->delta,batch_kmer[i]) >= 0))) {
+	  batch_kmer[m] = batch_kmer[i];
+	  batch_pos[m]  = batch_pos[i];
+	  prefetch_hash_entry(kmersH,batch_kmer[i]);
+	  m++;
+	}
+      }
+      ctx->stats.filtered += n - m;
+      n = m;
+    }
+    if (kmersH->hash_scheme == HASH_MPH)
+      for (i=0; (i < n); i++)
+	prefetch_mph_slot(kmersH,batch_kmer[i]);
+    for (i=0; (i < n); i++) {
+      sig_kmer_t kmers_hash_entry;
+      if (find_sig_kmer(ctx,ctx->kmersH,batch_kmer[i],&kmers_hash_entry)) {
+	ctx->stats.hits++;
+	if (ctx->classify)
+	  add_read_hit(ctx,batch_pos[i],&kmers_hash_entry);
+	else
+	  record_hit(ctx,batch_pos[i],batch_kmer[i],&kmers_hash_entry,fh);
       }
+    }
+  }
+}
+
+void finish_hits(kmer_scan_ctx_t *ctx, FILE *fh) {
+  if (ctx->num_hits >= ctx->min_hits) {
+      // fprintf(stderr, "pset from %d cur=%d\n",  __LINE__, ctx->current_fI);
+      process_set_of_hits(ctx, fh);
+  }
+  ctx->num_hits = 0;
+}
+
+/* one copy of the scan loop for each supported K, with K a constant */
+#define GATHER_HITS_FOR(k)						\
+void gather_hits_##k(kmer_scan_ctx_t *ctx, unsigned char *pIseq, int *amb, \
+		     long from, long to, FILE *fh) {			\
+  gather_hits_k(ctx,pIseq,amb,from,to,fh,k);				\
+}
+GATHER_HITS_FOR(5)
+GATHER_HITS_FOR(6)
+GATHER_HITS_FOR(7)
+GATHER_HITS_FOR(8)
+
+void gather_hits(kmer_scan_ctx_t *ctx, unsigned char *pIseq, int *amb, long from, long to, FILE *fh) {
+  switch (ctx->kmersH->k) {
+    case 5: gather_hits_5(ctx,pIseq,amb,from,to,fh); break;
+    case 6: gather_hits_6(ctx,pIseq,amb,from,to,fh); break;
+    case 7: gather_hits_7(ctx,pIseq,amb,from,to,fh); break;
+    case 8: gather_hits_8(ctx,pIseq,amb,from,to,fh); break;
+  }
+}
+
+/* make sure the window buffers can hold scan_window residues plus the K-1 overlap */
+int alloc_window(kmer_scan_ctx_t *ctx) {
+  long need = ctx->scan_window + MAX_K;
+  if (ctx->window_size < need) {
+    free(ctx->pseq);
+    free(ctx->pIseq);
+    free(ctx->ambig);
+    free(ctx->codons);
+    ctx->pseq   = malloc(need);
+    ctx->pIseq  = malloc(need);
+    ctx->ambig  = malloc((need + 1) * sizeof(int));
+    ctx->codons = malloc(3 * need);
+    ctx->codon_lo = ctx->codon_hi = 0;
+    if ((ctx->pseq == 0) || (ctx->pIseq == 0) || (ctx->ambig == 0) || (ctx->codons == 0)) {
+      ctx->window_size = ctx->codons_size = 0;
+      scan_alloc_failed(ctx, "could not allocate a %ld residue scan window\n", need);
+      return -1;
+    }
+    ctx->window_size = need;
+    ctx->codons_size = 3 * need;
+  }
+  return 0;
+}
+
+/* residues first..first+n-1 of a protein, or of one frame of a contig */
+void fill_window(kmer_scan_ctx_t *ctx,char *seq,long ln,char strand,int off,long first,long n,int letters) {
+  if (ctx->aa) {
+    long i;
+    int na = 0;
+    pthread_once(&dna_tables_once, init_dna_tables);
+    for (i=0; (i < n); i++) {
+      unsigned char r = aa_code[(unsigned char) seq[first+i]];
+      ctx->pIseq[i] = r;
+      ctx->ambig[na] = i;
+      na += (r == 20);
+    }
+    ctx->ambig[na] = INT_MAX;
+    if (letters)
+      memcpy(ctx->pseq,seq+first,n);
+  }
+  else
+    translate_window(ctx,seq,ln,strand,off,first,n,letters);
+}
+
+/*
+ * Scan one frame of a contig (or a whole protein) in windows of
+ * scan_window residues.  Consecutive windows overlap by K-1 residues so
+ * that every kmer lies wholly inside one of them, and the hit state is
+ * carried across windows, so the calls are exactly those of scanning the
+ * frame in one piece; memory is bounded by the window, not the contig.
+ */
+static inline long frame_residues(kmer_scan_ctx_t *ctx, long ln, int off) {
+  return ctx->aa ? ln : ((ln - off >= 3) ? (ln - off) / 3 : 0);
+}
+
+/* the -d 3 listing of a frame's residues */
+void print_translation(kmer_scan_ctx_t *ctx, char *seq, long ln, char strand, int off, FILE *fh) {
+  long n_res = frame_residues(ctx, ln, off);
+  long from, n;
+
+  if (alloc_window(ctx) < 0)
+    return;
+  fprintf(fh, "translated: %c\t%d\t",strand,off);
+  for (from = 0; (from < n_res); from += n) {
+    n = (n_res - from < ctx->scan_window) ? (n_res - from) : ctx->scan_window;
+    fill_window(ctx,seq,ln,strand,off,from,n,1);
+    fwrite(ctx->pseq,1,n,fh);
+  }
+  fprintf(fh, "\n");
+}
+
+void scan_frame(kmer_scan_ctx_t *ctx, char *seq, long ln, char strand, int off, FILE *fh) {
+  long n_res = frame_residues(ctx, ln, off);
+  int  k     = ctx->kmersH->k;
+  long last  = n_res - k;      /* as ever, kmers are scanned at offsets < n_res - K */
+  long from, n;
+
+  if (alloc_window(ctx) < 0)
+    return;
+  if (ctx->debug >= 3)
+    print_translation(ctx,seq,ln,strand,off,fh);
+
+  for (from = 0; (from < last); from += n) {
+    n = (last - from < ctx->scan_window) ? (last - from) : ctx->scan_window;
+    double t0 = now_seconds();
+    fill_window(ctx,seq,ln,strand,off,from,n + k - 1,0);
+    double t1 = now_seconds();
+    double out0 = ctx->stats.output_time;
+    gather_hits(ctx,ctx->pIseq,ctx->ambig,from,from + n,fh);
+    ctx->stats.translate_time += t1 - t0;
+    ctx->stats.scan_time      += (now_seconds() - t1) - (ctx->stats.output_time - out0);
+  }
+  finish_hits(ctx,fh);
+}
+
+void tabulate_otu_data_for_contig(kmer_scan_ctx_t *ctx, FILE *fh) {
+  int i;
+  emit_otu_counts(ctx, fh, rank_otus(ctx));
+  for (i=0; (i < ctx->num_otu_seen); i++)
+    ctx->otu_counts[ctx->otu_seen[i]] = 0;
+  ctx->num_otu_seen = 0;
+}
+
+void process_aa_seq(kmer_scan_ctx_t *ctx, char *id,char *pseq,size_t ln, FILE *fh) {
+
+  snprintf(ctx->current_id,sizeof(ctx->current_id),"%s",id);
+  ctx->stats.sequences++;
+  emit_sequence(ctx, fh, id, ln);
+
+  ctx->current_length_contig = ln;
+  ctx->current_strand        = '+';
+  ctx->current_prot_off      = 0;
+  scan_frame(ctx,pseq,ln,'+',0,fh);
+  tabulate_otu_data_for_contig(ctx, fh);
+}
+
+/*
+ * Parallel frame scanning.  Each of the six frames of a large contig is
+ * translated and scanned on its own thread with its own frame context;
+ * the frame's output is captured in memory and written out in the same
+ * order (and with the same TRANSLATION lines) as the serial path.
+ */
+typedef struct frame_job {
+  kmer_scan_ctx_t *fctx;
+  char *seq;
+  long  ln;
+  char  strand;
+  int   off;
+  pthread_t thread;
+} frame_job_t;
+
+kmer_scan_ctx_t *get_frame_ctx(kmer_scan_ctx_t *ctx, int frame) {
+  kmer_scan_ctx_t *fctx = ctx->frame_ctx[frame];
+  if (fctx == 0) {
+    fctx = malloc(sizeof(kmer_scan_ctx_t));
+    if (fctx == 0) {
+      fprintf(stderr,"could not allocate a frame context\n");
+      exit(1);
+    }
+    init_scan_ctx(fctx, ctx->kmersH);
+    fctx->log_otu_votes = 1;
+    ctx->frame_ctx[frame] = fctx;
+  }
+  fctx->aa                = ctx->aa;
+  fctx->hits_only         = ctx->hits_only;
+  fctx->debug             = ctx->debug;
+  fctx->min_hits          = ctx->min_hits;
+  fctx->min_weighted_hits = ctx->min_weighted_hits;
+  fctx->order_constraint  = ctx->order_constraint;
+  fctx->max_gap           = ctx->max_gap;
+  fctx->scan_window       = ctx->scan_window;
+  fctx->binary_output     = ctx->binary_output;
+  strcpy(fctx->current_id,ctx->current_id);
+  fctx->current_length_contig = ctx->current_length_contig;
+
+  fctx->num_otu_votes = 0;
+  fctx->codon_lo = fctx->codon_hi = 0;
+  fctx->out = open_memstream(&fctx->out_buf, &fctx->out_len);
+  if (fctx->out == 0) {
+    fprintf(stderr,"could not open frame output buffer: %s\n",strerror(errno));
+    exit(1);
+  }
+  return fctx;
+}
+
+void *scan_frame_main(void *arg) {
+  frame_job_t *job = (frame_job_t *) arg;
+  kmer_scan_ctx_t *fctx = job->fctx;
+
+  fctx->current_strand   = job->strand;
+  fctx->current_prot_off = job->off;
+  scan_frame(fctx,job->seq,job->ln,job->strand,job->off,fctx->out);
+  fflush(fctx->out);
+  return 0;
+}
+
+void add_stats(scan_stats_t *to, const scan_stats_t *from) {
+  int i;
+  to->sequences      += from->sequences;
+  to->lookups        += from->lookups;
+  to->hits           += from->hits;
+  to->filtered       += from->filtered;
+  to->retries        += from->retries;
+  for (i=0; (i < PROBE_HIST); i++)
+    to->probe_hist[i] += from->probe_hist[i];
+  to->ambig_skips    += from->ambig_skips;
+  to->calls          += from->calls;
+  to->bytes_in       += from->bytes_in;
+  to->bytes_out      += from->bytes_out;
+  to->parse_time     += from->parse_time;
+  to->translate_time += from->translate_time;
+  to->scan_time      += from->scan_time;
+  to->output_time    += from->output_time;
+}
+
+/* one "STAT name value" line per counter */
+void print_stats(FILE *fh, const scan_stats_t *st) {
+  int i;
+  fprintf(fh, "STAT\tsequences\t%llu\n", st->sequences);
+  fprintf(fh, "STAT\tlookups\t%llu\n", st->lookups);
+  fprintf(fh, "STAT\thits\t%llu\n", st->hits);
+  fprintf(fh, "STAT\tfiltered\t%llu\n", st->filtered);
+  fprintf(fh, "STAT\tretries\t%llu\n", st->retries);
+  for (i=0; (i < PROBE_HIST); i++)
+    fprintf(fh, "STAT\tprobes_%d%s\t%llu\n", i, (i == PROBE_HIST - 1) ? "+" : "", st->probe_hist[i]);
+  fprintf(fh, "STAT\tambig_skips\t%llu\n", st->ambig_skips);
+  fprintf(fh, "STAT\tcalls\t%llu\n", st->calls);
+  fprintf(fh, "STAT\tbytes_in\t%llu\n", st->bytes_in);
+  fprintf(fh, "STAT\tbytes_out\t%llu\n", st->bytes_out);
+  fprintf(fh, "STAT\tparse_time\t%.6f\n", st->parse_time);
+  fprintf(fh, "STAT\ttranslate_time\t%.6f\n", st->translate_time);
+  fprintf(fh, "STAT\tscan_time\t%.6f\n", st->scan_time);
+  fprintf(fh, "STAT\toutput_time\t%.6f\n", st->output_time);
+}
+
+void scan_frames_in_parallel(kmer_scan_ctx_t *ctx, char *data, long ln, FILE *fh) {
+  frame_job_t jobs[6];
+  int i;
+  for (i=0; (i < 6); i++) {
+    jobs[i].fctx   = get_frame_ctx(ctx,i);
+    jobs[i].seq    = data;
+    jobs[i].ln     = ln;
+    jobs[i].strand = (i < 3) ? '+' : '-';
+    jobs[i].off    = i % 3;
+    int rc = pthread_create(&jobs[i].thread, NULL, scan_frame_main, &jobs[i]);
+    if (rc != 0) {
+      fprintf(stderr,"could not create frame thread: %s\n",strerror(rc));
+      exit(1);
+    }
+  }
+
+  for (i=0; (i < 6); i++) {
+    pthread_join(jobs[i].thread, NULL);
+    kmer_scan_ctx_t *fctx = jobs[i].fctx;
+
+    emit_translation(ctx, fh, jobs[i].strand, jobs[i].off);
+    fclose(fctx->out);
+    fwrite(fctx->out_buf, 1, fctx->out_len, fh);
+    free(fctx->out_buf);
+    fctx->out = 0;
+    fctx->out_buf = 0;
+
+    int j;
+    for (j=0; (j < fctx->num_otu_votes); j++)
+      count_otu(ctx, fctx->otu_votes[j]);
+
+    add_stats(&ctx->stats, &fctx->stats);
+    memset(&fctx->stats, 0, sizeof(fctx->stats));
+  }
+}
+
+void process_seq(kmer_scan_ctx_t *ctx, char *id,char *data,size_t len, FILE *fh) {
+
+  snprintf(ctx->current_id,sizeof(ctx->current_id),"%s",id);
+  long ln = len;
+  ctx->current_length_contig = ln;
+  ctx->codon_lo = ctx->codon_hi = 0;
+  ctx->stats.sequences++;
+  emit_sequence(ctx, fh, id, ln);
+
+  /* callbacks are made from the scanning thread, in order, so library
+     scans keep to one thread */
+  if ((ctx->parallel_frames_min > 0) && (ln >= ctx->parallel_frames_min) && !ctx->callbacks) {
+    scan_frames_in_parallel(ctx,data,ln,fh);
+    tabulate_otu_data_for_contig(ctx, fh);
+    return;
+  }
+
+  int i;
+  for (i=0; (i < 6); i++) {
+    ctx->current_strand   = (i < 3) ? '+' : '-';
+    ctx->current_prot_off = i % 3;
+    emit_translation(ctx, fh, ctx->current_strand, ctx->current_prot_off);
+    scan_frame(ctx,data,ln,ctx->current_strand,ctx->current_prot_off,fh);
+  }
+  tabulate_otu_data_for_contig(ctx, fh);
+}
+
+/*
+ * Read classification (-R).  Short reads are too short for the CALL
+ * logic to say much, and per-read CALL output (a processing line, six
+ * TRANSLATION lines and an OTU-COUNTS line) costs more than their scan.
+ * With -R each read gets only the function with the most kmer hits over
+ * all its frames (ties to the greater summed weight, then the lower
+ * index), if it has at least -m hits of summed weight -M, and the OTU
+ * with the most votes among that function's hits (ties to the lower
+ * index).  -R 1 writes one READ line per read; -R 2 writes nothing per
+ * read but counts the reads assigned to each function and OTU, and writes
+ * the tables at each >FLUSH (and at the end of the input).
+ *
+ * A read takes a few microseconds, so reads are not timed one by one:
+ * run_from_reader reads the clock every READ_TIMING reads (and at a
+ * >FLUSH), and the time of parsing, scanning and writing the reads in
+ * between all goes to scan_time.
+ */
+#define READ_TIMING 1024
+
+void classify_read(kmer_scan_ctx_t *ctx, char *id, char *seq, size_t len, FILE *fh) {
+  read_tally_t *rf = &ctx->read_functions, *ro = &ctx->read_otus;
+  int nframes = ctx->aa ? 1 : 6;
+  int k = ctx->kmersH->k;
+  int f, i;
+
+  ctx->stats.sequences++;
+  ctx->codon_lo = ctx->codon_hi = 0;
+  ctx->num_hits = 0;
+  if (alloc_window(ctx) < 0)
+    return;
+  for (f=0; (f < nframes); f++) {
+    char strand = (f < 3) ? '+' : '-';
+    long last = frame_residues(ctx, len, f % 3) - k;
+    long from, n;
+    for (from = 0; (from < last); from += n) {
+      n = (last - from < ctx->scan_window) ? (last - from) : ctx->scan_window;
+      fill_window(ctx,seq,len,strand,f % 3,from,n + k - 1,0);
+      gather_hits(ctx,ctx->pIseq,ctx->ambig,from,from + n,fh);
+    }
+  }
+
+  int fI = -1, oI = -1, votes = 0;
+  for (i=0; (i < ctx->num_hits); i++)
+    tally_add(rf, ctx->hits[i].fI, 1, ctx->hits[i].function_wt);
+  for (i=0; (i < rf->num_seen); i++) {
+    int c = rf->seen[i];
+    if ((fI < 0) || (rf->counts[c] > rf->counts[fI]) ||
+	((rf->counts[c] == rf->counts[fI]) &&
+	 ((rf->weights[c] > rf->weights[fI]) || ((rf->weights[c] == rf->weights[fI]) && (c < fI)))))
+      fI = c;
+  }
+  int   hits = (fI >= 0) ? rf->counts[fI] : 0;
+  float weighted_hits = (fI >= 0) ? rf->weights[fI] : 0;
+  tally_clear(rf);
+  if ((fI < 0) || (hits < ctx->min_hits) || (weighted_hits < ctx->min_weighted_hits)) {
+    fI = -1;
+    hits = 0;
+    weighted_hits = 0;
+  }
+  else {
+    for (i=0; (i < ctx->num_hits); i++)
+      if ((int) ctx->hits[i].fI == fI)
+	tally_add(ro, ctx->hits[i].oI, 1, 0);
+    for (i=0; (i < ro->num_seen); i++) {
+      int c = ro->seen[i];
+      if ((oI < 0) || (ro->counts[c] > ro->counts[oI]) || ((ro->counts[c] == ro->counts[oI]) && (c < oI)))
+	oI = c;
+    }
+    votes = ro->counts[oI];
+    tally_clear(ro);
+    ctx->stats.calls++;
+  }
+  ctx->num_hits = 0;
 
-      if ((num_hits > 0) && (hits[num_hits-1].from0_in_prot + max_gap) < (p-pIseq)) {
-	if (num_hits >= min_hits) {
-	    // fprintf(stderr, "pset from %d cur=%d\n",  __LINE__, current_fI);
-	    process_set_of_hits(kmersH, fh);
-	}
-	else {
-	  num_hits = 0;
-	}
-      }
+  if (ctx->classify == 1)
+    emit_read(ctx, fh, id, fI, hits, weighted_hits, oI, votes);
+  else {
+    ctx->batch_reads++;
+    if (fI >= 0) {
+      ctx->batch_assigned++;
+      tally_add(&ctx->batch_functions, fI, 1, 0);
+      tally_add(&ctx->batch_otus, oI, 1, 0);
+    }
+  }
+}
 
-      if (num_hits == 0) {
-	current_fI = fI;   /* if this is the first, set the current_fI */
-      }
+/* -R: charge the time since *t0 to scan_time, and restart the clock */
+static inline void time_reads(kmer_scan_ctx_t *ctx, double *t0) {
+  double t = now_seconds();
+  ctx->stats.scan_time += t - *t0;
+  *t0 = t;
+}
 
-      if ((! order_constraint) || (num_hits == 0) ||
-	  ((fI == hits[num_hits-1].fI) &&
-	   (abs(((p-pIseq) - hits[num_hits-1].from0_in_prot) - 
-                (hits[num_hits-1].avg_off_from_end - avg_off_end)
-		) <= 20))) {
-          /* we have a new hit, so we add it to the global set of hits */
-	hits[num_hits].oI = oI;
-	hits[num_hits].fI = fI;
-	hits[num_hits].from0_in_prot = p-pIseq;
-	hits[num_hits].avg_off_from_end = avg_off_end;
-	hits[num_hits].function_wt = f_wt;
-        if (num_hits < MAX_HITS_PER_SEQ - 2) 
-	  num_hits++;
-	if (debug > 1) {
-	    fprintf(fh, "after-hit: ");
-	    display_hits(fh);
-	}
-	if ((num_hits > 1) && (current_fI != fI) &&           /* if we have a pair of new fIs, it is time to */
-	    (hits[num_hits-2].fI == hits[num_hits-1].fI)) {   /* process one set and initialize the next */
-	    // fprintf(stderr, "pset from %d cur=%d\n",  __LINE__, current_fI);
-	    process_set_of_hits(kmersH, fh);
-	}
+/*
+ * Sort-merge scanning (-j).  A lookup is a random access into the table,
+ * which is fast only while the table is in memory, and a large job makes
+ * billions of them.  With -j the sequences are taken a batch at a time
+ * instead: every kmer of every frame of the batch is extracted, with its
+ * place in the batch, and the kmers are radix-sorted and merged against
+ * kmer.sorted, a copy of the table's kmers in kmer order that is read
+ * from start to finish.  The hits are then sorted back into sequence,
+ * frame and offset order and handed to record_hit, so the output is that
+ * of the lookups.  The table itself is only read to make kmer.sorted
+ * (with the delta applied), the first time it is needed and whenever the
+ * table or delta changes; so a node that cannot hold the table in memory
+ * can still run the scan, reading only kmer.sorted and the batch.
+ *
+ * An occurrence of a kmer is one u64, the kmer above its index in the
+ * batch (JOIN_INDEX_BITS bits), so a batch holds at most JOIN_MAX_KMERS
+ * of them; a sequence with more than that is looked up as usual.
+ */
+#define JOIN_INDEX_BITS 29
+#define JOIN_INDEX_MASK ((1ULL << JOIN_INDEX_BITS) - 1)
+#define JOIN_MAX_KMERS  (1ULL << JOIN_INDEX_BITS)
+#define JOIN_MAX_MB     256        /* -j: with DNA, two kmers a base fill a batch */
+#define JOIN_READ       65536      /* records of kmer.sorted read at a time */
+#define RADIX_BITS      11
+
+#define SORTED_VERSION 1
+
+typedef struct kmer_sorted_header {
+  unsigned long long version;      /* SORTED_VERSION */
+  unsigned long long fingerprint;  /* of the table, and delta, it was made from */
+  unsigned long long kmer_size;
+  unsigned long long num_kmers;    /* the sig_kmer_v2_t records that follow, in kmer order */
+  unsigned long long reserved[4];
+} kmer_sorted_header_t;
+
+/* kmer.sorted, opened by open_sorted_kmers; read with pread by every context */
+static int sorted_kmers_fd = -1;
+static unsigned long long sorted_kmers_count;
+
+typedef struct join_seq {
+  size_t id;                       /* offsets in text of the id and the residues */
+  size_t seq;
+  size_t len;
+} join_seq_t;
+
+typedef struct join_batch {
+  char  *text;                     /* the ids and residues of the batch */
+  size_t text_len;
+  size_t text_size;
+  join_seq_t *seqs;
+  int    num_seqs;
+  int    seqs_size;
+  long   residues;
+  unsigned long long max_kmers;    /* the kmers the batch can hold, at most */
+  unsigned long long kmers_size;
+  unsigned long long *kmers;       /* (encodedK << JOIN_INDEX_BITS) | occurrence */
+  unsigned long long *sort_tmp;
+  unsigned int *pos;               /* the offset in its frame of each occurrence */
+  unsigned long long *frame_start; /* the first occurrence of each frame, 6 per sequence */
+  int    frame_start_size;
+  sig_kmer_v2_t *found;            /* the entries of the hits, in kmer order */
+  unsigned long long found_size;
+  sig_kmer_v2_t *block;            /* JOIN_READ records of kmer.sorted */
+} join_batch_t;
+
+void free_join_batch(join_batch_t *j) {
+  if (j == 0)
+    return;
+  free(j->text);
+  free(j->seqs);
+  free(j->kmers);
+  free(j->sort_tmp);
+  free(j->pos);
+  free(j->frame_start);
+  free(j->found);
+  free(j->block);
+  free(j);
+}
+
+/* realloc, or end the program */
+static void *join_realloc(void *p, size_t n) {
+  p = realloc(p, n ? n : 1);
+  if (p == 0) {
+    fprintf(stderr,"could not allocate %lld bytes for a -j batch\n",(long long) n);
+    exit(1);
+  }
+  return p;
+}
+
+/* sort the n records of a, each words u64 long, by bits [lo, hi) of their
+   first word, with an LSD radix sort through tmp; returns whichever of a
+   and tmp holds the result */
+static inline __attribute__((always_inline))
+unsigned long long *radix_sort(unsigned long long *a, unsigned long long *tmp, unsigned long long n,
+			       const int words, int lo, int hi) {
+  unsigned long long count[1 << RADIX_BITS];
+  int shift;
+  for (shift = lo; (shift < hi); shift += RADIX_BITS) {
+    unsigned long long mask = (1ULL << ((hi - shift < RADIX_BITS) ? hi - shift : RADIX_BITS)) - 1;
+    unsigned long long i, sum = 0, *t;
+    memset(count, 0, sizeof(count));
+    for (i=0; (i < n); i++)
+      count[(a[i * words] >> shift) & mask]++;
+    for (i=0; (i <= mask); i++) {
+      unsigned long long c = count[i];
+      count[i] = sum;
+      sum += c;
+    }
+    for (i=0; (i < n); i++) {
+      unsigned long long *to = tmp + words * count[(a[i * words] >> shift) & mask]++;
+      to[0] = a[i * words];
+      if (words == 2)
+	to[1] = a[i * words + 1];
+    }
+    t = a;
+    a = tmp;
+    tmp = t;
+  }
+  return a;
+}
+
+/* the bits a kmer of kmersH needs */
+static int kmer_bits(kmer_handle_t *kmersH) {
+  int bits = 1;
+  while ((1ULL << bits) < kmersH->max_encoded)
+    bits++;
+  return bits;
+}
+
+/* what kmer.sorted must have been made from: the table and its delta */
+unsigned long long sorted_fingerprint(kmer_handle_t *kmersH) {
+  return kmersH->delta ? filter_hash(kmersH->fingerprint ^ kmersH->delta->fingerprint) : kmersH->fingerprint;
+}
+
+/* read n bytes of fd at offset at; returns 0, or -1 with errno set (0 if
+   the file is short) */
+static int read_fully(int fd, void *buf, size_t n, unsigned long long at) {
+  while (n > 0) {
+    ssize_t r = pread(fd, buf, n, at);
+    if ((r < 0) && (errno == EINTR))
+      continue;
+    if (r <= 0) {
+      if (r == 0)
+	errno = 0;
+      return -1;
+    }
+    buf = (char *) buf + r;
+    at += r;
+    n  -= r;
+  }
+  return 0;
+}
+
+/* write n bytes to fd at offset at; returns 0, or -1 with errno set */
+static int write_fully(int fd, const void *buf, size_t n, unsigned long long at) {
+  while (n > 0) {
+    ssize_t w = pwrite(fd, buf, n, at);
+    if ((w < 0) && (errno == EINTR))
+      continue;
+    if (w < 0)
+      return -1;
+    buf = (const char *) buf + w;
+    at += w;
+    n  -= w;
+  }
+  return 0;
+}
+
+/* the entry kmer.sorted takes from slot i of the table, or for i past the
+   table from slot i - num_sigs of its delta; returns its kmer, or -1 if
+   the slot is empty, deleted or replaced by the delta */
+static long long sorted_entry(kmer_handle_t *kmersH, unsigned long long i, sig_kmer_v2_t *out,
+			      char *fileS) {
+  kmer_handle_t *delta = kmersH->delta;
+  unsigned long long which;
+  if (i >= kmersH->num_sigs) {
+    sig_kmer_t entry;
+    i -= kmersH->num_sigs;
+    if ((which = slot_kmer(delta,i)) > delta->max_encoded)
+      return -1;
+    unpack_sig_kmer(&delta->packed_table[i], &entry);
+    if (entry.function_index == DELTA_DELETED)
+      return -1;
+    *out = delta->packed_table[i];
+    return which;
+  }
+  which = slot_kmer(kmersH,i);
+  if ((which > kmersH->max_encoded) || (delta && (lookup_hash_entry(0,delta,which) >= 0)))
+    return -1;
+  if (kmersH->version == 1) {
+    sig_kmer_t *e = &kmersH->kmer_table[i];
+    if ((e->function_index < 0) || (e->function_index >= (int) DELTA_DELETED) ||
+	(e->otu_index < 0) || (e->otu_index > (int) V2_MAX_OI)) {
+      fprintf(stderr,"the table has indexes too large for %s; rebuild it with -V 3\n",fileS);
+      exit(1);
+    }
+    pack_sig_kmer(e, out);
+  }
+  else
+    *out = kmersH->packed_table[i];
+  return which;
+}
+
+#define SORT_FINE_BITS    16
+#define SORT_FINE_BUCKETS (1 << SORT_FINE_BITS)
+#define SORT_BUCKET       (1 << 22)  /* records sorted at a time, 64 MB */
+#define SORT_SPILL        256        /* records buffered per bucket in the second pass */
+
+/* append the records held for bucket b to its part of kmer.sorted */
+static int spill_bucket(int fd, sig_kmer_v2_t *spill, int *held, unsigned long long *written,
+			unsigned long long *start, int b) {
+  unsigned long long at = sizeof(kmer_sorted_header_t) + (start[b] + written[b]) * sizeof(sig_kmer_v2_t);
+  if (write_fully(fd, spill + (size_t) b * SORT_SPILL, held[b] * sizeof(sig_kmer_v2_t), at) < 0)
+    return -1;
+  written[b] += held[b];
+  held[b] = 0;
+  return 0;
+}
+
+/*
+ * Write fileS, kmer.sorted for kmersH: the table's kmers, less those its
+ * delta deletes or replaces, and the delta's own, in kmer order.  It is
+ * a bucket sort through the file itself, so that memory holds two
+ * buckets of records however large the table: one pass over the
+ * table counts the kmers in each of SORT_FINE_BUCKETS ranges of kmers,
+ * which are grouped into buckets of at most SORT_BUCKET records (or one
+ * range, if it is larger); a second pass writes each record into its
+ * bucket's part of the file; then each bucket is read, sorted and
+ * written back.
+ */
+void make_sorted_kmers(kmer_handle_t *kmersH, char *fileS) {
+  double t0 = now_seconds();
+  unsigned long long slots = kmersH->num_sigs + (kmersH->delta ? kmersH->delta->num_sigs : 0);
+  int bits = kmer_bits(kmersH);
+  int fine_shift = (bits > SORT_FINE_BITS) ? bits - SORT_FINE_BITS : 0;
+  unsigned long long *fine = join_realloc(0, SORT_FINE_BUCKETS * sizeof(unsigned long long));
+  int *bucket_of = join_realloc(0, SORT_FINE_BUCKETS * sizeof(int));
+  unsigned long long i, n = 0, largest = 0;
+  sig_kmer_v2_t e;
+  long long which;
+  int f, b, nb = 0;
+
+  if (!kmersH->image_copied)
+    madvise(kmersH->image, kmersH->image_size, MADV_SEQUENTIAL);
+  memset(fine, 0, SORT_FINE_BUCKETS * sizeof(unsigned long long));
+  for (i=0; (i < slots); i++)
+    if ((which = sorted_entry(kmersH, i, &e, fileS)) >= 0)
+      fine[which >> fine_shift]++;
+
+  /* start[b] is the first record of bucket b, so start[nb] is n */
+  unsigned long long *start = join_realloc(0, (SORT_FINE_BUCKETS + 1) * sizeof(unsigned long long));
+  start[0] = 0;
+  for (f=0; (f < SORT_FINE_BUCKETS); f++) {
+    if ((n > start[nb]) && (n - start[nb] + fine[f] > SORT_BUCKET))
+      start[++nb] = n;
+    bucket_of[f] = nb;
+    n += fine[f];
+  }
+  start[++nb] = n;
+  free(fine);
+  for (b=0; (b < nb); b++)
+    if (start[b+1] - start[b] > largest)
+      largest = start[b+1] - start[b];
+
+  kmer_sorted_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.version     = SORTED_VERSION;
+  hdr.fingerprint = sorted_fingerprint(kmersH);
+  hdr.kmer_size   = kmersH->k;
+  hdr.num_kmers   = n;
+
+  char fileTmp[PATH_MAX + 32];
+  snprintf(fileTmp, sizeof(fileTmp), "%s.%d.tmp", fileS, (int) getpid());
+  int fd = open(fileTmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr,"could not open %s for writing: %s\n",fileTmp,strerror(errno));
+    exit(1);
+  }
+  if (ftruncate(fd, sizeof(hdr) + n * sizeof(sig_kmer_v2_t)) < 0)
+    goto write_failed;
+
+  /* the records, into their buckets */
+  sig_kmer_v2_t *spill = join_realloc(0, (size_t) nb * SORT_SPILL * sizeof(sig_kmer_v2_t));
+  unsigned long long *written = join_realloc(0, nb * sizeof(unsigned long long));
+  int *held = join_realloc(0, nb * sizeof(int));
+  memset(written, 0, nb * sizeof(unsigned long long));
+  memset(held, 0, nb * sizeof(int));
+  for (i=0; (i < slots); i++) {
+    if ((which = sorted_entry(kmersH, i, &e, fileS)) < 0)
+      continue;
+    b = bucket_of[which >> fine_shift];
+    spill[(size_t) b * SORT_SPILL + held[b]++] = e;
+    if ((held[b] == SORT_SPILL) && (spill_bucket(fd, spill, held, written, start, b) < 0))
+      goto write_failed;
+  }
+  for (b=0; (b < nb); b++)
+    if (spill_bucket(fd, spill, held, written, start, b) < 0)
+      goto write_failed;
+  free(spill);
+  free(written);
+  free(held);
+  free(bucket_of);
+
+  /* then each bucket in turn, sorted in place */
+  sig_kmer_v2_t *a   = join_realloc(0, largest * sizeof(sig_kmer_v2_t));
+  sig_kmer_v2_t *tmp = join_realloc(0, largest * sizeof(sig_kmer_v2_t));
+  for (b=0; (b < nb); b++) {
+    unsigned long long m = start[b+1] - start[b];
+    unsigned long long at = sizeof(hdr) + start[b] * sizeof(sig_kmer_v2_t);
+    if (m == 0)
+      continue;
+    if (read_fully(fd, a, m * sizeof(sig_kmer_v2_t), at) < 0)
+      goto write_failed;
+    sig_kmer_v2_t *sorted = (sig_kmer_v2_t *) radix_sort((unsigned long long *) a, (unsigned long long *) tmp,
+							 m, 2, 0, bits);
+    if (write_fully(fd, sorted, m * sizeof(sig_kmer_v2_t), at) < 0)
+      goto write_failed;
+  }
+  free(a);
+  free(tmp);
+  free(start);
+
+  if ((write_fully(fd, &hdr, sizeof(hdr), 0) < 0) || (close(fd) != 0))
+    goto write_failed;
+  if (rename(fileTmp, fileS) != 0) {
+    fprintf(stderr,"could not rename %s to %s: %s\n",fileTmp,fileS,strerror(errno));
+    unlink(fileTmp);
+    exit(1);
+  }
+  fprintf(stderr,"wrote %s: %lld kmers in kmer order, %d buckets, %.2fs\n",fileS,n,nb,now_seconds() - t0);
+  return;
+
+ write_failed:
+  fprintf(stderr,"error writing %s: %s\n",fileTmp,errno ? strerror(errno) : "short read");
+  unlink(fileTmp);
+  exit(1);
+}
+
+/* open dataD/kmer.sorted for -j, making it first if it is missing or was
+   made from another table or delta */
+void open_sorted_kmers(kmer_handle_t *kmersH, char *dataD) {
+  char fileS[PATH_MAX];
+  kmer_sorted_header_t hdr;
+  struct stat sbuf;
+  int tries;
+
+  snprintf(fileS, sizeof(fileS), "%s/kmer.sorted", dataD);
+  for (tries = 0; (tries < 2); tries++) {
+    int fd = open(fileS, O_RDONLY);
+    if (fd >= 0) {
+      if ((fstat(fd, &sbuf) == 0) && (read_fully(fd, &hdr, sizeof(hdr), 0) == 0) &&
+	  (hdr.version == SORTED_VERSION) && (hdr.fingerprint == sorted_fingerprint(kmersH)) &&
+	  (hdr.kmer_size == (unsigned long long) kmersH->k) &&
+	  ((unsigned long long) sbuf.st_size == sizeof(hdr) + hdr.num_kmers * sizeof(sig_kmer_v2_t))) {
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	sorted_kmers_fd    = fd;
+	sorted_kmers_count = hdr.num_kmers;
+	return;
       }
+      close(fd);
+    }
+    if (tries == 0)
+      make_sorted_kmers(kmersH, fileS);
+  }
+  fprintf(stderr,"%s does not match %s/kmer.table.mem_map\n",fileS,dataD);
+  exit(1);
+}
+
+/* the occurrences of the kmers at offsets [from, to) of a frame, much as
+   gather_hits_k finds them, appended to the batch from index next on;
+   returns the new count */
+static inline __attribute__((always_inline))
+unsigned long long join_collect_k(kmer_scan_ctx_t *ctx, unsigned char *pIseq, int *amb, long from, long to,
+				  unsigned long long next, const int k) {
+  const unsigned long long core = pow20[k-1];
+  join_batch_t *j = ctx->join;
+  long p = 0;
+  long bound = to - from;
+  long run_end = 0;
+  unsigned long long encodedK = 0;
+
+  while (p < bound) {
+    if (p < run_end) {
+      encodedK = ((encodedK % core) * 20L) + pIseq[p+k-1];
+    }
+    else {
+      long skipped_from = p;
+      advance_past_ambig(&p,&amb,k);
+      ctx->stats.ambig_skips += ((p < bound) ? p : bound) - skipped_from;
+      if (p >= bound)
+	break;
+      run_end = (*amb - k + 1 < bound) ? *amb - k + 1 : bound;
+      encodedK = encoded_kmer(pIseq + p,k);
     }
+    j->kmers[next] = (encodedK << JOIN_INDEX_BITS) | next;
+    j->pos[next]   = from + p;
+    next++;
     p++;
-    if (p < bound) {
-      if (*(p+K-1) < 20) {
-	encodedK = ((encodedK % CORE) * 20L) + *(p+K-1);
-      }
-      else {
-	p += K;
-	advance_past_ambig(&p,bound);
-	if (p < bound) {
-	  encodedK = encoded_kmer(p);
-	}
-      }
-    }    
   }
-  if (num_hits >= min_hits) {
-      // fprintf(stderr, "pset from %d cur=%d\n",  __LINE__, current_fI);
-      process_set_of_hits(kmersH, fh);
+  return next;
+}
+
+#define JOIN_COLLECT_FOR(k)						\
+unsigned long long join_collect_##k(kmer_scan_ctx_t *ctx, unsigned char *pIseq, int *amb, \
+				    long from, long to, unsigned long long next) { \
+  return join_collect_k(ctx,pIseq,amb,from,to,next,k);			\
+}
+JOIN_COLLECT_FOR(5)
+JOIN_COLLECT_FOR(6)
+JOIN_COLLECT_FOR(7)
+JOIN_COLLECT_FOR(8)
+
+unsigned long long join_collect(kmer_scan_ctx_t *ctx, unsigned char *pIseq, int *amb, long from, long to,
+				unsigned long long next) {
+  switch (ctx->kmersH->k) {
+    case 5: return join_collect_5(ctx,pIseq,amb,from,to,next);
+    case 6: return join_collect_6(ctx,pIseq,amb,from,to,next);
+    case 7: return join_collect_7(ctx,pIseq,amb,from,to,next);
+    default: return join_collect_8(ctx,pIseq,amb,from,to,next);
   }
-  num_hits = 0;
 }
 
-void tabulate_otu_data_for_contig(FILE *fh) {
-  int i;
-  if (!hits_only)
-  {
-      fprintf(fh, "OTU-COUNTS\t%s[%d]",current_id,current_length_contig);
-      for (i=0; (i < num_oI); i++) {
-	  fprintf(fh, "\t%d-%d",oI_counts[i].count,oI_counts[i].oI);
-      }
-      fprintf(fh, "\n");
+/* the occurrences of one frame, a window at a time as scan_frame reads it */
+unsigned long long join_collect_frame(kmer_scan_ctx_t *ctx, char *seq, long ln, char strand, int off,
+				      unsigned long long next) {
+  long n_res = frame_residues(ctx, ln, off);
+  int  k     = ctx->kmersH->k;
+  long last  = n_res - k;
+  long from, n;
+
+  for (from = 0; (from < last); from += n) {
+    n = (last - from < ctx->scan_window) ? (last - from) : ctx->scan_window;
+    double t0 = now_seconds();
+    fill_window(ctx,seq,ln,strand,off,from,n + k - 1,0);
+    double t1 = now_seconds();
+    next = join_collect(ctx,ctx->pIseq,ctx->ambig,from,from + n,next);
+    ctx->stats.translate_time += t1 - t0;
+    ctx->stats.scan_time      += now_seconds() - t1;
   }
-  num_oI = 0;
+  return next;
 }
 
-void process_aa_seq(char *id,char *pseq,size_t ln,kmer_handle_t *kmersH, FILE *fh) {
-  static unsigned char *pIseq = 0;
-  if (pIseq == 0)
-  {
-    pIseq = malloc(MAX_SEQ_LEN / 3);
+/* scan the batch gathered by join_sequence and empty it */
+void run_join_batch(kmer_scan_ctx_t *ctx, FILE *fh) {
+  join_batch_t *j = ctx->join;
+  int nframes = ctx->aa ? 1 : 6;
+  int s, f;
+
+  if ((j == 0) || (j->num_seqs == 0))
+    return;
+  if (j->kmers_size < j->max_kmers) {
+    j->kmers_size = j->max_kmers;
+    free(j->kmers);
+    free(j->sort_tmp);
+    free(j->pos);
+    j->kmers    = join_realloc(0, j->kmers_size * sizeof(unsigned long long));
+    j->sort_tmp = join_realloc(0, j->kmers_size * sizeof(unsigned long long));
+    j->pos      = join_realloc(0, j->kmers_size * sizeof(unsigned int));
+  }
+  if (j->frame_start_size < 6 * j->num_seqs + 1) {
+    j->frame_start_size = 6 * j->num_seqs + 1;
+    j->frame_start = join_realloc(j->frame_start, j->frame_start_size * sizeof(unsigned long long));
+  }
+  if (j->block == 0)
+    j->block = join_realloc(0, JOIN_READ * sizeof(sig_kmer_v2_t));
+
+  /* every kmer of every frame, numbered in the order the lookups would take them */
+  unsigned long long n = 0;
+  alloc_window(ctx);
+  for (s=0; (s < j->num_seqs); s++) {
+    ctx->codon_lo = ctx->codon_hi = 0;
+    for (f=0; (f < nframes); f++) {
+      j->frame_start[s * nframes + f] = n;
+      n = join_collect_frame(ctx, j->text + j->seqs[s].seq, j->seqs[s].len, (f < 3) ? '+' : '-', f % 3, n);
+    }
+  }
+  j->frame_start[j->num_seqs * nframes] = n;
+  ctx->stats.lookups += n;
+
+  /* sort them by kmer and merge them with kmer.sorted */
+  double t0 = now_seconds();
+  unsigned long long *sorted = radix_sort(j->kmers, j->sort_tmp, n, 1, JOIN_INDEX_BITS,
+					  JOIN_INDEX_BITS + kmer_bits(ctx->kmersH));
+  unsigned long long *hits = (sorted == j->kmers) ? j->sort_tmp : j->kmers;
+  unsigned long long i = 0, num_found = 0, at = 0, b = 0, nb = 0;
+  while (i < n) {
+    if (b == nb) {
+      if (at == sorted_kmers_count)
+	break;
+      nb = (sorted_kmers_count - at < JOIN_READ) ? sorted_kmers_count - at : JOIN_READ;
+      if (read_fully(sorted_kmers_fd, j->block, nb * sizeof(sig_kmer_v2_t),
+		     sizeof(kmer_sorted_header_t) + at * sizeof(sig_kmer_v2_t)) < 0) {
+	fprintf(stderr,"could not read kmer.sorted: %s\n",errno ? strerror(errno) : "file is short");
+	exit(1);
+      }
+      at += nb;
+      b = 0;
+    }
+    unsigned long long want = sorted[i] >> JOIN_INDEX_BITS;
+    unsigned long long have = j->block[b].lo & V2_KMER_MASK;
+    if (have < want)
+      b++;
+    else if (have > want)
+      i++;
+    else {
+      if (num_found == j->found_size) {
+	j->found_size = j->found_size ? 2 * j->found_size : 65536;
+	j->found = join_realloc(j->found, j->found_size * sizeof(sig_kmer_v2_t));
+      }
+      j->found[num_found] = j->block[b];
+      hits[num_found] = ((sorted[i] & JOIN_INDEX_MASK) << JOIN_INDEX_BITS) | num_found;
+      num_found++;
+      i++;
+    }
   }
-  //static unsigned char pIseq[MAX_SEQ_LEN / 3];
 
-  strcpy(current_id,id);
-  if (!hits_only)
-      fprintf(fh, "PROTEIN-ID\t%s\t%d\n",id,ln);
+  /* and the hits back into occurrence order */
+  hits = radix_sort(hits, sorted, num_found, 1, JOIN_INDEX_BITS, 2 * JOIN_INDEX_BITS);
+  ctx->stats.scan_time += now_seconds() - t0;
+
+  unsigned long long h = 0;
+  for (s=0; (s < j->num_seqs); s++) {
+    char *id  = j->text + j->seqs[s].id;
+    char *seq = j->text + j->seqs[s].seq;
+    long  ln  = j->seqs[s].len;
+
+    snprintf(ctx->current_id,sizeof(ctx->current_id),"%s",id);
+    ctx->current_length_contig = ln;
+    ctx->codon_lo = ctx->codon_hi = 0;
+    ctx->stats.sequences++;
+    emit_sequence(ctx, fh, id, ln);
+    for (f=0; (f < nframes); f++) {
+      ctx->current_strand   = (f < 3) ? '+' : '-';
+      ctx->current_prot_off = f % 3;
+      if (!ctx->aa)
+	emit_translation(ctx, fh, ctx->current_strand, ctx->current_prot_off);
+      if (ctx->debug >= 3)
+	print_translation(ctx, seq, ln, ctx->current_strand, ctx->current_prot_off, fh);
+      unsigned long long end = j->frame_start[s * nframes + f + 1];
+      for (; (h < num_found) && ((hits[h] >> JOIN_INDEX_BITS) < end); h++) {
+	sig_kmer_t entry;
+	unpack_sig_kmer(&j->found[hits[h] & JOIN_INDEX_MASK], &entry);
+	ctx->stats.hits++;
+	record_hit(ctx, j->pos[hits[h] >> JOIN_INDEX_BITS], entry.which_kmer, &entry, fh);
+      }
+      finish_hits(ctx, fh);
+    }
+    tabulate_otu_data_for_contig(ctx, fh);
+  }
 
-  current_length_contig = ln;
-  current_strand        = '+';
-  current_prot_off      = 0;
-  int i;
-  for (i=0; (i < ln); i++)
-    pIseq[i] = to_amino_acid_off(*(pseq+i));
-  gather_hits(ln,'+',0,pseq,pIseq,kmersH,fh);  
-  tabulate_otu_data_for_contig(fh);
+  j->text_len  = 0;
+  j->num_seqs  = 0;
+  j->residues  = 0;
+  j->max_kmers = 0;
 }
 
-void process_seq(char *id,char *data,kmer_handle_t *kmersH, FILE *fh) {
+/* add a sequence to the -j batch, scanning the batch once it is full.  A
+   sequence too long for any batch is looked up as usual, in its turn. */
+void join_sequence(kmer_scan_ctx_t *ctx, char *id, char *data, size_t len, FILE *fh) {
+  unsigned long long max_kmers = ctx->aa ? len : 2 * (unsigned long long) len;
+  size_t id_len = strlen(id);
 
-  static char *cdata = 0;
-  static char *pseq = 0;
-  static unsigned char *pIseq = 0;
+  if (ctx->join == 0) {
+    ctx->join = join_realloc(0, sizeof(join_batch_t));
+    memset(ctx->join, 0, sizeof(join_batch_t));
+  }
+  join_batch_t *j = ctx->join;
+  if (j->max_kmers + max_kmers > JOIN_MAX_KMERS)
+    run_join_batch(ctx, fh);
+  if (max_kmers > JOIN_MAX_KMERS) {
+    if (ctx->aa)
+      process_aa_seq(ctx,id,data,len,fh);
+    else
+      process_seq(ctx,id,data,len,fh);
+    return;
+  }
 
-  if (cdata == 0)
-  {
-    cdata = malloc(MAX_SEQ_LEN);
-    pseq = malloc(MAX_SEQ_LEN / 3);
-    pIseq = malloc(MAX_SEQ_LEN / 3);
-  }
-     
-//  static char cdata[MAX_SEQ_LEN];
-//  static char pseq[MAX_SEQ_LEN / 3];
-//  static unsigned char pIseq[MAX_SEQ_LEN / 3];
-
-  strcpy(current_id,id);
-  int ln = strlen(data);
-  current_length_contig = ln;
-  fprintf(fh, "processing %s[%d]\n",id,ln);
-  int i;
-  for (i=0; (i < 3); i++) {
-    
-    translate(data,i,pseq,pIseq);
-    current_strand   = '+';
-    current_prot_off = i;
-    if (!hits_only)
-	fprintf(fh, "TRANSLATION\t%s\t%d\t%c\t%d\n",current_id,
-		current_length_contig,
-		current_strand,
-		current_prot_off);
-    gather_hits(ln,'+',i,pseq,pIseq,kmersH, fh);
-  }
-  rev_comp(data,cdata);
-  for (i=0; (i < 3); i++) {
-    translate(cdata,i,pseq,pIseq);
-
-    current_strand   = '-';
-    current_prot_off = i;
-    if (!hits_only)
-	fprintf(fh, "TRANSLATION\t%s\t%d\t%c\t%d\n",current_id,
-		current_length_contig,
-		current_strand,
-		current_prot_off);
-    gather_hits(ln,'-',i,pseq,pIseq,kmersH, fh);
-  }
-  tabulate_otu_data_for_contig(fh);
+  if (j->text_len + id_len + len + 2 > j->text_size) {
+    j->text_size = 2 * (j->text_len + id_len + len + 2);
+    j->text = join_realloc(j->text, j->text_size);
+  }
+  if (j->num_seqs == j->seqs_size) {
+    j->seqs_size = j->seqs_size ? 2 * j->seqs_size : 1024;
+    j->seqs = join_realloc(j->seqs, j->seqs_size * sizeof(join_seq_t));
+  }
+  join_seq_t *js = &j->seqs[j->num_seqs++];
+  js->id  = j->text_len;
+  memcpy(j->text + j->text_len, id, id_len + 1);
+  j->text_len += id_len + 1;
+  js->seq = j->text_len;
+  js->len = len;
+  memcpy(j->text + j->text_len, data, len);
+  j->text[j->text_len + len] = '\0';
+  j->text_len += len + 1;
+  j->residues  += len;
+  j->max_kmers += max_kmers;
+
+  if (j->residues >= ctx->join_residues)
+    run_join_batch(ctx, fh);
 }
 
+#ifndef KMER_GUTS_LIBRARY
 int main(int argc,char *argv[]) {
   int c;
   char *past;
   char file[300];
   int is_server = 0;
+  int show_stats = 0;
+  char *batch_list = 0;
+  char *batch_dir  = 0;
   in_port_t port;
   char port_file[1024];
   pid_t parent = -1;
@@ -1075,7 +5020,7 @@ int main(int argc,char *argv[]) {
   port_file[0] = 0;
   file[0] = 0;
 
-  while ((c = getopt (argc, argv, "ad:s:wD:m:g:OM:l:L:P:H")) != -1) {
+  while ((c = getopt (argc, argv, "ad:s:wucD:m:g:OM:l:L:P:HT:F:V:I:W:K:B:SG:YN:AE:o:b:r:j:R:")) != -1) {
     switch (c) {
     case 'a':
       aa = 1;
@@ -1121,93 +5066,929 @@ int main(int argc,char *argv[]) {
     case 'w':
       write_mem_map = 1;
       break;
+    case 'u':
+      write_delta = 1;
+      break;
+    case 'c':
+      compact_table = 1;
+      break;
+    case 'T':
+      num_threads = strtol(optarg,&past,0);
+      if (num_threads < 1)
+	num_threads = 1;
+      break;
+    case 'F':
+      parallel_frames_min = strtol(optarg,&past,0);
+      break;
+    case 'B':
+      binary_output = strtol(optarg,&past,0);
+      if ((binary_output < 0) || (binary_output > 2)) {
+	fprintf(stderr,"-B must be 0, 1 or 2\n");
+	exit(1);
+      }
+      break;
+    case 'S':
+      show_stats = 1;
+      break;
+    case 'b':
+      batch_list = optarg;
+      break;
+    case 'r':
+      batch_dir = optarg;
+      break;
+    case 'j':
+      join_residues = strtol(optarg,&past,0);
+      if ((join_residues < 1) || (join_residues > JOIN_MAX_MB)) {
+	fprintf(stderr,"-j must be between 1 and %d (megabytes of sequence per batch)\n",JOIN_MAX_MB);
+	exit(1);
+      }
+      join_residues <<= 20;
+      page_in_table = 0;
+      break;
+    case 'R':
+      classify = strtol(optarg,&past,0);
+      if ((classify < 0) || (classify > 2)) {
+	fprintf(stderr,"-R must be 0, 1 or 2\n");
+	exit(1);
+      }
+      break;
+    case 'o':
+      otu_report = strtol(optarg,&past,0);
+      if (otu_report < 0) {
+	fprintf(stderr,"-o must be a number of OTUs, or 0 for all of them\n");
+	exit(1);
+      }
+      break;
+    case 'G':
+      if (strcmp(optarg,"mapped") == 0)
+	table_pages = PAGES_MAPPED;
+      else if (strcmp(optarg,"thp") == 0)
+	table_pages = PAGES_THP;
+      else if (strcmp(optarg,"hugetlb") == 0)
+	table_pages = PAGES_HUGETLB;
+      else {
+	fprintf(stderr,"-G must be mapped, thp or hugetlb\n");
+	exit(1);
+      }
+      break;
+    case 'Y':
+      lock_table = 1;
+      break;
+    case 'N':
+      if (strcmp(optarg,"interleave") == 0)
+	numa_policy = NUMA_INTERLEAVE;
+      else if (strcmp(optarg,"local") == 0)
+	numa_policy = NUMA_LOCAL;
+      else {
+	fprintf(stderr,"-N must be interleave or local\n");
+	exit(1);
+      }
+      break;
+    case 'A':
+      warm_in_background = 1;
+      break;
+    case 'E':
+      filter_rate = strtod(optarg,&past);
+      if ((filter_rate < 0) || (filter_rate >= 1)) {
+	fprintf(stderr,"-E must be a false-positive rate below 1, or 0 for no prefilter\n");
+	exit(1);
+      }
+      break;
+    case 'K':
+      kmer_size = strtol(optarg,&past,0);
+      if ((kmer_size < MIN_K) || (kmer_size > MAX_K)) {
+	fprintf(stderr,"-K must be between %d and %d\n",MIN_K,MAX_K);
+	exit(1);
+      }
+      break;
+    case 'I':
+      if (strcmp(optarg,"robinhood") == 0)
+	write_hash_scheme = HASH_ROBIN_HOOD;
+      else if (strcmp(optarg,"mph") == 0)
+	write_hash_scheme = HASH_MPH;
+      else if (strcmp(optarg,"modulo") == 0)
+	write_hash_scheme = HASH_MODULO;
+      else {
+	fprintf(stderr,"-I must be modulo, robinhood or mph\n");
+	exit(1);
+      }
+      break;
+    case 'W':
+      scan_window = strtol(optarg,&past,0);
+      if ((scan_window < 1) || (scan_window > MAX_SCAN_WINDOW)) {
+	fprintf(stderr,"-W must be between 1 and %d\n",MAX_SCAN_WINDOW);
+	exit(1);
+      }
+      break;
+    case 'V':
+      write_version = strtol(optarg,&past,0);
+      version_given = 1;
+      if ((write_version < OLDEST_VERSION) || (write_version > VERSION)) {
+	fprintf(stderr,"-V must be between %d and %d\n",OLDEST_VERSION,VERSION);
+	exit(1);
+      }
+      break;
     default:
       fprintf(stderr,"arguments: [-a] [-d level] [-s hash-size] [-w] [-m min_hits] -D DataDir \n");
       abort ();
     }
   }
 
-  kmer_handle_t *kmersH = init_kmers(file);
+  if (write_mem_map + write_delta + compact_table > 1) {
+    fprintf(stderr,"only one of -w, -u and -c may be given\n");
+    exit(1);
+  }
+  if (batch_list && is_server) {
+    fprintf(stderr,"-b and -l cannot be used together\n");
+    exit(1);
+  }
+  if (join_residues && is_server) {
+    fprintf(stderr,"-j and -l cannot be used together\n");
+    exit(1);
+  }
+  if (join_residues && classify) {
+    fprintf(stderr,"-j and -R cannot be used together\n");
+    exit(1);
+  }
+  if (join_residues && (table_pages != PAGES_MAPPED)) {
+    fprintf(stderr,"-j reads the table only to make kmer.sorted; it cannot be used with -G thp or hugetlb\n");
+    exit(1);
+  }
+
+  struct batch *batch = batch_list ? load_batch(batch_list, batch_dir) : 0;
+  kmer_handle_t *kmersH = init_kmers(file);
+  if (join_residues) {
+    wait_for_table(kmersH);
+    open_sorted_kmers(kmersH, file);
+  }
+
+  if (is_server)
+  {
+      run_accept_loop(kmersH, port, port_file, parent);
+  }
+  else if (batch_list)
+  {
+      wait_for_table(kmersH);
+      return run_batch(kmersH, batch, show_stats);
+  }
+  else
+  {
+      kmer_scan_ctx_t ctx;
+      fasta_reader_t reader;
+      if (!warm_in_background || kmersH->image_copied)
+	wait_for_table(kmersH);
+      init_scan_ctx(&ctx, kmersH);
+      init_reader(&reader, 0);
+      setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFSZ);
+      run_from_reader(&ctx, &reader, stdout);
+      fflush(stdout);
+      if (show_stats)
+	print_stats(stderr, &ctx.stats);
+      free_reader(&reader);
+  }
+  return 0;
+}
+#endif /* KMER_GUTS_LIBRARY */
+
+void init_scan_ctx(kmer_scan_ctx_t *ctx, kmer_handle_t *kmersH)
+{
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->kmersH = kmersH;
+  ctx->hits_size = HITS_BUFSZ;
+  ctx->hits   = malloc(ctx->hits_size * sizeof(hit_t));
+  reset_scan_options(ctx);
+}
+
+/* release what a context (and its frame contexts) allocated */
+void free_scan_ctx(kmer_scan_ctx_t *ctx)
+{
+  int i;
+  for (i=0; (i < 6); i++)
+    if (ctx->frame_ctx[i]) {
+      free_scan_ctx(ctx->frame_ctx[i]);
+      free(ctx->frame_ctx[i]);
+    }
+  free(ctx->hits);
+  free(ctx->otu_counts);
+  free(ctx->otu_seen);
+  free(ctx->otu_top);
+  free(ctx->otu_votes);
+  free(ctx->pseq);
+  free(ctx->pIseq);
+  free(ctx->ambig);
+  free(ctx->codons);
+  free(ctx->input);
+  free_join_batch(ctx->join);
+  free_tally(&ctx->read_functions);
+  free_tally(&ctx->read_otus);
+  free_tally(&ctx->batch_functions);
+  free_tally(&ctx->batch_otus);
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+/* restore the tunables to the values given on the command line */
+void reset_scan_options(kmer_scan_ctx_t *ctx)
+{
+  ctx->aa                = aa;
+  ctx->hits_only         = hits_only;
+  ctx->debug             = debug;
+  ctx->min_hits          = min_hits;
+  ctx->min_weighted_hits = min_weighted_hits;
+  ctx->order_constraint  = order_constraint;
+  ctx->max_gap           = max_gap;
+  ctx->parallel_frames_min = parallel_frames_min;
+  ctx->scan_window       = scan_window;
+  ctx->binary_output     = binary_output;
+  ctx->otu_report        = otu_report;
+  ctx->join_residues     = join_residues;
+  ctx->classify          = classify;
+}
+
+static unsigned char residue_upper[256];
+static unsigned char residue_keep[256];
+static pthread_once_t residue_tables_once = PTHREAD_ONCE_INIT;
+
+void init_residue_tables() {
+  int c;
+  for (c=0; (c < 256); c++) {
+    residue_upper[c] = toupper(c);
+    residue_keep[c]  = !isspace(c);
+  }
+}
+
+void init_reader(fasta_reader_t *r, int fd) {
+  pthread_once(&residue_tables_once, init_residue_tables);
+  memset(r, 0, sizeof(*r));
+  r->fd   = fd;
+  r->size = READER_BLOCK;
+  r->buf  = malloc(r->size);
+  if (r->buf == 0) {
+    fprintf(stderr,"could not allocate input buffer\n");
+    exit(1);
+  }
+}
+
+/* start reading a new input with an existing reader (keeping its buffer) */
+void reader_attach(fasta_reader_t *r, int fd) {
+  r->fd     = fd;
+  r->start  = 0;
+  r->end    = 0;
+  r->eof    = 0;
+  r->got_gt = 0;
+  r->requests = 0;
+  r->error  = 0;
+}
+
+void free_reader(fasta_reader_t *r) {
+  free(r->buf);
+  r->buf = 0;
+}
+
+/*
+ * Read another block.  Everything from keep_from on is kept, moved to the
+ * front of the buffer (which is doubled if that leaves less than a block
+ * free); returns how far the kept bytes moved, or -1 at end of input if
+ * they did not move.
+ * One byte is always left free past end, so records can be terminated.
+ */
+long reader_fill(fasta_reader_t *r, size_t keep_from) {
+  if (r->eof)
+    return -1;
+
+  size_t shift = keep_from;
+  if (shift > 0) {
+    memmove(r->buf, r->buf + shift, r->end - shift);
+    r->end   -= shift;
+    r->start  = (r->start > shift) ? (r->start - shift) : 0;
+  }
+  if (r->size - r->end < READER_BLOCK) {
+    r->size *= 2;
+    r->buf = realloc(r->buf, r->size);
+    if (r->buf == 0) {
+      fprintf(stderr,"could not grow input buffer to %lld bytes\n",(long long) r->size);
+      exit(1);
+    }
+  }
+
+  ssize_t n;
+  do {
+    n = read(r->fd, r->buf + r->end, r->size - r->end - 1);
+  } while ((n < 0) && (errno == EINTR));
+  if (n <= 0) {
+    if (n < 0) {
+      fprintf(stderr,"read failed: %s\n",strerror(errno));
+      r->error = errno;
+    }
+    r->eof = 1;
+    return (shift > 0) ? (long) shift : -1;
+  }
+  r->end += n;
+  r->bytes_read += n;
+  return (long) shift;
+}
+
+/* the next byte of input without consuming it, or -1 at end of input */
+int reader_peek(fasta_reader_t *r) {
+  while (r->start == r->end)
+    if (reader_fill(r, r->start) < 0)
+      return -1;
+  return (unsigned char) r->buf[r->start];
+}
+
+/*
+ * The next line of input, without its newline and NUL-terminated in the
+ * buffer (valid until the next read); 0 at end of input.
+ */
+char *reader_getline(fasta_reader_t *r, size_t *len) {
+  size_t scan = r->start;
+  char *nl;
+  while ((nl = memchr(r->buf + scan, '\n', r->end - scan)) == 0) {
+    scan = r->end;
+    long shift = reader_fill(r, r->start);
+    if (shift < 0)
+      break;
+    scan -= shift;
+  }
+  if ((nl == 0) && (r->start == r->end))
+    return 0;
+
+  char *line = r->buf + r->start;
+  size_t stop = nl ? (size_t) (nl - r->buf) : r->end;
+  r->buf[stop] = '\0';
+  *len = stop - r->start;
+  r->start = nl ? (stop + 1) : stop;
+  return line;
+}
+
+/* copy src to dst dropping whitespace and uppercasing; dst may be src */
+static inline size_t compact_residues(char *dst, const char *src, size_t n) {
+  size_t i, j = 0;
+  for (i=0; (i < n); i++) {
+    unsigned char c = src[i];
+    dst[j] = residue_upper[c];
+    j += residue_keep[c];
+  }
+  return j;
+}
+
+/*
+ * In request mode, the offset in [scan,stop) of a "//" that starts a line
+ * (bol says whether scan does), or stop.  *more is set if a '/' ends the
+ * data read so far, so that we cannot tell yet.
+ */
+static size_t find_request_end(fasta_reader_t *r, size_t scan, size_t stop, int bol, int *more) {
+  size_t q = scan;
+  char *sl;
+  *more = 0;
+  while ((sl = memchr(r->buf + q, '/', stop - q)) != 0) {
+    q = sl - r->buf;
+    if ((q == scan) ? bol : (r->buf[q-1] == '\n')) {
+      if ((q + 1 == r->end) && !r->eof) {
+	*more = 1;
+	return q;
+      }
+      if ((q + 1 < r->end) && (r->buf[q+1] == '/'))
+	return q;
+    }
+    q++;
+  }
+  return stop;
+}
+
+/*
+ * Read the next record.  Returns FASTA_FLUSH for a >FLUSH line, FASTA_SEQ
+ * with *id, *seq and *len set for a sequence (both NUL-terminated and valid
+ * until the next call), FASTA_END for the "//" line that ends a request
+ * (request mode only), or FASTA_EOF.
+ */
+int read_fasta_record(fasta_reader_t *r, char **id, char **seq, size_t *len) {
+  size_t line_len;
+  char *line;
+
+  if (!r->got_gt) {
+    int c = reader_peek(r);
+    if (r->requests && (c == '/')) {
+      line = reader_getline(r, &line_len);
+      return (strncmp(line, "//", 2) == 0) ? FASTA_END : FASTA_EOF;
+    }
+    if (c != '>')
+      return FASTA_EOF;
+    r->start++;
+  }
+  r->got_gt = 0;
+
+  line = reader_getline(r, &line_len);
+  if (line == 0)
+    return FASTA_EOF;
+  while ((*line == ' ') || (*line == '\t'))
+    line++;
+  size_t n = strcspn(line, " \t\r");
+  if (n >= sizeof(r->id))
+    n = sizeof(r->id) - 1;
+  memcpy(r->id, line, n);
+  r->id[n] = '\0';
+  *id = r->id;
+
+  if (strncmp(r->id, "FLUSH", 5) == 0)
+    return FASTA_FLUSH;
+
+  /* compact the sequence in place, up to the next '>' (or "//" line) */
+  size_t first = r->start;
+  size_t dst   = first;
+  size_t scan  = first;
+  int bol  = 1;                 /* scan is at the start of a line */
+  int more = 0;
+  while (1) {
+    if ((scan == r->end) || more) {
+      long shift = reader_fill(r, first);
+      if (shift < 0) {
+	dst += compact_residues(r->buf + dst, r->buf + scan, r->end - scan);
+	scan = r->end;
+	break;
+      }
+      first -= shift;
+      dst   -= shift;
+      scan  -= shift;
+    }
+    char *gt = memchr(r->buf + scan, '>', r->end - scan);
+    size_t stop = gt ? (size_t) (gt - r->buf) : r->end;
+    int at_end = 0;
+    if (r->requests) {
+      size_t q = find_request_end(r, scan, stop, bol, &more);
+      if (q < stop) {
+	stop   = q;
+	at_end = !more;
+      }
+    }
+    if (stop > scan)
+      bol = (r->buf[stop-1] == '\n');
+    dst += compact_residues(r->buf + dst, r->buf + scan, stop - scan);
+    scan = stop;
+    if (more)
+      continue;
+    if (at_end)
+      break;             /* at the "//"; the next call returns FASTA_END */
+    if (gt) {
+      scan++;
+      r->got_gt = 1;
+      break;
+    }
+  }
+  r->buf[dst] = '\0';
+  r->start = scan;
+
+  *seq = r->buf + first;
+  *len = dst - first;
+  return FASTA_SEQ;
+}
+
+/*
+ * Scan sequences from r until end of input (returning FASTA_EOF) or, on a
+ * persistent connection, the end of the request (returning FASTA_END).
+ */
+int run_from_reader(kmer_scan_ctx_t *ctx, fasta_reader_t *r, FILE *fh_out)
+{
+  char *id, *data;
+  size_t len;
+  int rc, reads = 0;
+  double reads_t0 = now_seconds();  /* -R: when the reads being timed began */
+
+  if (ctx->binary_output)
+    ctx->debug = 0;
+  if ((ctx->binary_output == 2) && !ctx->dictionary_sent) {
+    emit_dictionary(ctx, fh_out);
+    ctx->dictionary_sent = 1;
+  }
+
+  /* fh_out is fully buffered (see OUTPUT_BUFSZ); a request's results go
+     out when the buffer fills or at its >FLUSH */
+  for (;;) {
+    double t0 = 0;
+    if (!ctx->classify)
+      t0 = now_seconds();
+    rc = read_fasta_record(r, &id, &data, &len);
+    if (!ctx->classify)
+      ctx->stats.parse_time += now_seconds() - t0;
+    ctx->stats.bytes_in += r->bytes_read;
+    r->bytes_read = 0;
+    if ((rc == FASTA_EOF) || (rc == FASTA_END))
+      break;
+    if (rc == FASTA_FLUSH) {
+	if (ctx->classify)
+	  time_reads(ctx, &reads_t0);
+	run_join_batch(ctx, fh_out);
+	if (ctx->classify == 2)
+	  emit_read_tables(ctx, fh_out);
+	emit_flush(ctx, fh_out);
+	t0 = now_seconds();
+	fflush(fh_out);
+	ctx->stats.output_time += now_seconds() - t0;
+	reads_t0 = now_seconds();
+	reads = 0;
+    }
+    else if (ctx->classify) {
+      classify_read(ctx,id,data,len,fh_out);
+      if (++reads == READ_TIMING) {
+	time_reads(ctx, &reads_t0);
+	reads = 0;
+      }
+    }
+    else if (ctx->join_residues)
+      join_sequence(ctx,id,data,len,fh_out);
+    else {
+      if (! ctx->aa)
+	  process_seq(ctx,id,data,len,fh_out);
+      else
+	  process_aa_seq(ctx,id,data,len,fh_out);
+    }
+  }
+  if (ctx->classify)
+    time_reads(ctx, &reads_t0);
+  run_join_batch(ctx, fh_out);
+  if ((ctx->classify == 2) && ((rc == FASTA_END) || ctx->batch_reads))
+    emit_read_tables(ctx, fh_out);
+
+  if (ctx->debug >= 2)
+      fprintf(fh_out, "tot_lookups=%llu retry=%llu\n",ctx->stats.lookups,ctx->stats.retries);
+  return rc;
+}
+
+/*
+ * Batch mode (-b).  The inputs are listed in a manifest, one to a line,
+ * or are the files of a directory.  num_threads workers, each with its
+ * own scan context and reader, take them largest first and scan each into
+ * its own output, written as output.tmp and renamed once it is complete,
+ * so that an output that exists is whole.  At the end a line for each
+ * input, in manifest order, goes to stdout:
+ *
+ *     FILE <tab> input <tab> output <tab> seconds <tab> sequences <tab> bytes <tab> calls <tab> status
+ *
+ * followed by a TOTAL line (inputs, failures, wall-clock seconds,
+ * sequences, bytes, calls).  status is OK or the reason the input failed.
+ */
+typedef struct batch_file {
+  char *input;
+  char *output;
+  unsigned long long size;
+  double seconds;
+  scan_stats_t stats;
+  char status[128];                /* OK, or why the input failed */
+} batch_file_t;
+
+typedef struct batch {
+  kmer_handle_t *kmersH;
+  batch_file_t *files;
+  batch_file_t **order;            /* the files, largest first */
+  int num_files;
+  int next;                        /* the next entry of order to scan */
+} batch_t;
+
+/* add input (and its output, or 0 for out_dir/basename) to b */
+void add_batch_file(batch_t *b, int *cap, const char *input, const char *output, const char *out_dir) {
+  if (b->num_files == *cap) {
+    *cap = *cap ? 2 * *cap : 256;
+    b->files = realloc(b->files, *cap * sizeof(batch_file_t));
+    if (b->files == 0) {
+      fprintf(stderr,"could not allocate the batch list\n");
+      exit(1);
+    }
+  }
+  batch_file_t *f = &b->files[b->num_files++];
+  memset(f, 0, sizeof(*f));
+  f->input = strdup(input);
+  if (output)
+    f->output = strdup(output);
+  else {
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    f->output = malloc(strlen(out_dir) + strlen(base) + 2);
+    if (f->output)
+      sprintf(f->output, "%s/%s", out_dir, base);
+  }
+  if ((f->input == 0) || (f->output == 0)) {
+    fprintf(stderr,"could not allocate the batch list\n");
+    exit(1);
+  }
+  struct stat sbuf;
+  if (stat(input, &sbuf) == 0)
+    f->size = sbuf.st_size;
+}
+
+int compare_names(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
 
-  if (is_server)
-  {
-      run_accept_loop(kmersH, port, port_file, parent);
+/* the regular files of dir (not those starting with a dot), in name order */
+void list_batch_dir(batch_t *b, int *cap, const char *dir, const char *out_dir) {
+  DIR *d = opendir(dir);
+  if (d == 0) {
+    fprintf(stderr,"could not open directory %s: %s\n",dir,strerror(errno));
+    exit(1);
   }
-  else
-  {
-      run_from_filehandle(kmersH, stdin, stdout);
+  char **names = 0;
+  int n = 0, names_cap = 0, i;
+  struct dirent *e;
+  while ((e = readdir(d)) != 0) {
+    if (e->d_name[0] == '.')
+      continue;
+    char path[PATH_MAX];
+    struct stat sbuf;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    if ((stat(path, &sbuf) != 0) || !S_ISREG(sbuf.st_mode))
+      continue;
+    if (n == names_cap) {
+      names_cap = names_cap ? 2 * names_cap : 256;
+      names = realloc(names, names_cap * sizeof(char *));
+    }
+    if ((names == 0) || ((names[n++] = strdup(path)) == 0)) {
+      fprintf(stderr,"could not allocate the batch list\n");
+      exit(1);
+    }
   }
-  return 0;
+  closedir(d);
+  qsort(names, n, sizeof(char *), compare_names);
+  for (i=0; (i < n); i++) {
+    add_batch_file(b, cap, names[i], 0, out_dir);
+    free(names[i]);
+  }
+  free(names);
 }
 
-void run_from_filehandle(kmer_handle_t *kmersH, FILE *fh_in, FILE *fh_out)
-{
-  static char *data = 0;
-  if (data == 0)
-  {
-    data = malloc(MAX_SEQ_LEN);
+/* a manifest line is "input", or "input<tab>output"; blank lines and
+   lines starting with # are skipped */
+void read_batch_manifest(batch_t *b, int *cap, const char *list, const char *out_dir) {
+  FILE *fp = fopen(list, "r");
+  if (fp == 0) {
+    fprintf(stderr,"could not open %s: %s\n",list,strerror(errno));
+    exit(1);
   }
-  
-  // static char data[MAX_SEQ_LEN];
-  int got_gt = 0;
-  int i;
-  char *p;
-  char id[2000];
-
-  while (((!got_gt && (fscanf(fh_in,">%s",id) == 1)) ||
-	  (got_gt && (fscanf(fh_in,"%s",id) == 1)))) {
-    while (getc(fh_in) != '\n')
-      ;
-    if ((id[0] == 'F') &&
-	(id[1] == 'L') &&
-	(id[2] == 'U') &&
-	(id[3] == 'S') &&
-	(id[4] == 'H')) {   /* ugly compare, since \n is included in id */
-
-/*      int rc = fflush(fh_in);
-      if (rc != 0) {
-	fprintf(stderr,"fflush did not seem to work\n");
-      }
-*/
-	fprintf(fh_out, "//\n");
-	got_gt = 0;
+  char *line = 0;
+  size_t line_cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &line_cap, fp)) > 0) {
+    while ((len > 0) && isspace((unsigned char) line[len-1]))
+      line[--len] = '\0';
+    if ((len == 0) || (line[0] == '#'))
+      continue;
+    char *tab = strchr(line, '\t');
+    if (tab)
+      *tab++ = '\0';
+    if ((tab == 0) && (out_dir == 0)) {
+      fprintf(stderr,"%s: %s names no output, and there is no -r directory\n",list,line);
+      exit(1);
     }
-    else {
+    add_batch_file(b, cap, line, tab, out_dir);
+  }
+  free(line);
+  fclose(fp);
+}
 
-      for (p=data; ((i = getc(fh_in)) != -1) && (i != '>');) {
-	if ((i != ' ') && (i != '\n'))
-	    *(p++) = toupper(i);
-      }
+int compare_batch_size(const void *a, const void *b) {
+  const batch_file_t *x = *(batch_file_t * const *) a, *y = *(batch_file_t * const *) b;
+  return (x->size < y->size) - (x->size > y->size);
+}
 
-      if (i == '>')
-	got_gt = 1;
-      else
-	got_gt = 0;
+/* scan one input into its output; the outcome is left in f */
+void scan_batch_file(kmer_scan_ctx_t *ctx, fasta_reader_t *r, batch_file_t *f) {
+  double t0 = now_seconds();
+  char tmp[PATH_MAX + 8];
+
+  strcpy(f->status, "OK");
+  snprintf(tmp, sizeof(tmp), "%s.tmp", f->output);
+  int fd = open(f->input, O_RDONLY);
+  if (fd < 0) {
+    snprintf(f->status, sizeof(f->status), "open failed: %s", strerror(errno));
+    return;
+  }
+  FILE *out = fopen(tmp, "w");
+  if (out == 0) {
+    snprintf(f->status, sizeof(f->status), "write failed: %s", strerror(errno));
+    close(fd);
+    return;
+  }
+  setvbuf(out, NULL, _IOFBF, OUTPUT_BUFSZ);
+
+  reader_attach(r, fd);
+  reset_scan_options(ctx);
+  ctx->dictionary_sent = 0;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  run_from_reader(ctx, r, out);
+  close(fd);
+
+  int write_failed = ferror(out);
+  if ((fclose(out) != 0) || write_failed)
+    snprintf(f->status, sizeof(f->status), "write failed: %s", strerror(errno));
+  else if (r->error)
+    snprintf(f->status, sizeof(f->status), "read failed: %s", strerror(r->error));
+  else if (rename(tmp, f->output) != 0)
+    snprintf(f->status, sizeof(f->status), "rename failed: %s", strerror(errno));
+  if (strcmp(f->status, "OK") != 0)
+    unlink(tmp);
+  f->stats   = ctx->stats;
+  f->seconds = now_seconds() - t0;
+}
+
+void *batch_worker_main(void *arg) {
+  batch_t *b = (batch_t *) arg;
+  kmer_scan_ctx_t ctx;
+  fasta_reader_t reader;
+  int i;
+
+  init_scan_ctx(&ctx, b->kmersH);
+  init_reader(&reader, -1);
+  while ((i = __sync_fetch_and_add(&b->next, 1)) < b->num_files)
+    scan_batch_file(&ctx, &reader, b->order[i]);
+  free_reader(&reader);
+  free_scan_ctx(&ctx);
+  return 0;
+}
+
+/* path with its directory (or, if it exists, the whole path) resolved, so
+   that two names for one file compare equal */
+void canonical_path(const char *path, char *buf) {
+  char dir[PATH_MAX];
+  if (realpath(path, buf) != 0)
+    return;
+  const char *slash = strrchr(path, '/');
+  const char *base  = slash ? slash + 1 : path;
+  if (slash == 0)
+    strcpy(dir, ".");
+  else
+    snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+  if ((dir[0] == 0) || (realpath(dir, buf) == 0) || (strlen(buf) + strlen(base) + 2 > PATH_MAX))
+    snprintf(buf, PATH_MAX, "%s", path);
+  else
+    strcat(strcat(buf, "/"), base);
+}
+
+typedef struct batch_name {
+  char path[PATH_MAX];
+  int  file;                       /* index in the batch */
+} batch_name_t;
 
-      *p=0;
-      size_t len = p - data;
-      if ((len) > MAX_SEQ_LEN) {
-	fprintf(stderr,"The contig size exceeds %d; bump MAX_SEQ_LEN\n",MAX_SEQ_LEN);
+int compare_batch_names(const void *a, const void *b) {
+  return strcmp(((const batch_name_t *) a)->path, ((const batch_name_t *) b)->path);
+}
+
+/* exit if an output would overwrite an input (the output itself, or its
+   .tmp) or two inputs would be written to one output */
+void check_batch_outputs(batch_t *b) {
+  batch_name_t *in  = malloc((b->num_files ? b->num_files : 1) * sizeof(batch_name_t));
+  batch_name_t *out = malloc((b->num_files ? b->num_files : 1) * sizeof(batch_name_t));
+  batch_name_t key;
+  int i, j;
+
+  if ((in == 0) || (out == 0)) {
+    fprintf(stderr,"could not allocate the batch list\n");
+    exit(1);
+  }
+  for (i=0; (i < b->num_files); i++) {
+    canonical_path(b->files[i].input, in[i].path);
+    canonical_path(b->files[i].output, out[i].path);
+    in[i].file = out[i].file = i;
+  }
+  qsort(in, b->num_files, sizeof(batch_name_t), compare_batch_names);
+  qsort(out, b->num_files, sizeof(batch_name_t), compare_batch_names);
+  for (i=0; (i < b->num_files); i++) {
+    batch_file_t *f = &b->files[out[i].file];
+    struct stat in_st, out_st;
+    for (j=0; (j < 2); j++) {
+      snprintf(key.path, sizeof(key.path), "%s%s", out[i].path, j ? ".tmp" : "");
+      batch_name_t *hit = bsearch(&key, in, b->num_files, sizeof(batch_name_t), compare_batch_names);
+      if (hit) {
+	fprintf(stderr,"the output for %s, %s, would overwrite the input %s\n",
+		f->input,key.path,b->files[hit->file].input);
 	exit(1);
       }
+    }
+    if ((stat(f->input, &in_st) == 0) && (stat(f->output, &out_st) == 0) &&
+	(in_st.st_dev == out_st.st_dev) && (in_st.st_ino == out_st.st_ino)) {
+      fprintf(stderr,"the output for %s, %s, is the input itself\n",f->input,f->output);
+      exit(1);
+    }
+    if ((i > 0) && (strcmp(out[i].path, out[i-1].path) == 0)) {
+      fprintf(stderr,"%s and %s would both be written to %s\n",
+	      b->files[out[i-1].file].input,f->input,out[i].path);
+      exit(1);
+    }
+  }
+  free(in);
+  free(out);
+}
 
-      /* fprintf(stderr,"%d bytes read\nends with %s\n",(p-data),p-50); */
+/* read the inputs listed in list (a manifest or a directory), before the
+   table is loaded, so that a bad list costs nothing */
+struct batch *load_batch(char *list, char *out_dir) {
+  batch_t *b = calloc(1, sizeof(batch_t));
+  int cap = 0, i;
+  struct stat sbuf;
 
-      if (! aa)
-	  process_seq(id,data,kmersH, fh_out);
-      else
-	  process_aa_seq(id,data, len, kmersH, fh_out);
-      fflush(fh_out);
+  if (b == 0) {
+    fprintf(stderr,"could not allocate the batch list\n");
+    exit(1);
+  }
+  if (stat(list, &sbuf) != 0) {
+    fprintf(stderr,"could not open %s: %s\n",list,strerror(errno));
+    exit(1);
+  }
+  if (S_ISDIR(sbuf.st_mode)) {
+    if (out_dir == 0) {
+      fprintf(stderr,"-b with a directory needs -r OutDir\n");
+      exit(1);
     }
+    list_batch_dir(b, &cap, list, out_dir);
   }
+  else
+    read_batch_manifest(b, &cap, list, out_dir);
+  if (out_dir && (mkdir(out_dir, 0777) != 0) && (errno != EEXIST)) {
+    fprintf(stderr,"could not create %s: %s\n",out_dir,strerror(errno));
+    exit(1);
+  }
+  check_batch_outputs(b);
+
+  /* largest first, so that no worker is left with a big one at the end */
+  b->order = malloc((b->num_files ? b->num_files : 1) * sizeof(batch_file_t *));
+  if (b->order == 0) {
+    fprintf(stderr,"could not allocate the batch list\n");
+    exit(1);
+  }
+  for (i=0; (i < b->num_files); i++)
+    b->order[i] = &b->files[i];
+  qsort(b->order, b->num_files, sizeof(batch_file_t *), compare_batch_size);
+  return b;
+}
 
-  if (debug >= 2)
-      fprintf(fh_out, "tot_lookups=%d retry=%d\n",tot_lookups,retry);
+/* scan the inputs of b; returns the exit status, 1 if any input failed */
+int run_batch(kmer_handle_t *kmersH, struct batch *b, int show_stats) {
+  int i, failed = 0;
+
+  b->kmersH = kmersH;
+  double start = now_seconds();
+  int nthreads = (num_threads < b->num_files) ? num_threads : b->num_files;
+  pthread_t *threads = malloc((nthreads ? nthreads : 1) * sizeof(pthread_t));
+  for (i=0; (i < nthreads); i++) {
+    int rc = pthread_create(&threads[i], NULL, batch_worker_main, b);
+    if (rc != 0) {
+      fprintf(stderr,"could not create batch worker: %s\n",strerror(rc));
+      exit(1);
+    }
+  }
+  for (i=0; (i < nthreads); i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  scan_stats_t total;
+  memset(&total, 0, sizeof(total));
+  for (i=0; (i < b->num_files); i++) {
+    batch_file_t *f = &b->files[i];
+    printf("FILE\t%s\t%s\t%.3f\t%llu\t%llu\t%llu\t%s\n", f->input, f->output, f->seconds,
+	   f->stats.sequences, f->stats.bytes_in, f->stats.calls, f->status);
+    failed += (strcmp(f->status, "OK") != 0);
+    add_stats(&total, &f->stats);
+  }
+  printf("TOTAL\t%d\t%d\t%.3f\t%llu\t%llu\t%llu\n", b->num_files, failed, now_seconds() - start,
+	 total.sequences, total.bytes_in, total.calls);
+  fflush(stdout);
+  if (show_stats)
+    print_stats(stderr, &total);
+
+  for (i=0; (i < b->num_files); i++) {
+    free(b->files[i].input);
+    free(b->files[i].output);
+  }
+  free(b->files);
+  free(b->order);
+  free(b);
+  return failed ? 1 : 0;
 }
 
+/*
+ * Server mode.  The listening socket is shared by num_threads worker
+ * threads; each one accepts connections and scans them with its own
+ * kmer_scan_ctx_t, so all of the workers share the one memory map.
+ */
+typedef struct accept_worker {
+    kmer_scan_ctx_t ctx;
+    fasta_reader_t reader;
+    int listenfd;
+    pid_t parent;
+    pthread_t thread;
+} accept_worker_t;
+
+/* the workers, for -S; set once, before any connection is accepted */
+static accept_worker_t *server_workers;
+static int              server_num_workers;
+static double           server_start;
+
+/* getopt() keeps its state in globals, so option lines are parsed one at a time */
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *accept_worker_main(void *arg);
+void handle_connection(kmer_scan_ctx_t *ctx, fasta_reader_t *r, int connfd);
+
 void run_accept_loop(kmer_handle_t *kmersH, in_port_t port, char *port_file, pid_t parent)
 {
-    int listenfd = 0, connfd = 0;
+    int listenfd = 0;
     struct sockaddr_in serv_addr;
 
     signal(SIGPIPE, SIG_IGN);
@@ -1233,7 +6014,12 @@ void run_accept_loop(kmer_handle_t *kmersH, in_port_t port, char *port_file, pid
 	exit(1);
     }
     in_port_t my_port = ntohs(my_addr.sin_port);
+
+    /* the port is published only once the table is ready to serve */
+    wait_for_table(kmersH);
     printf("Listening on %d\n", my_port);
+    fflush(stdout);
+    fprintf(stderr, "Serving with %d worker thread%s\n", num_threads, num_threads == 1 ? "" : "s");
     if (port_file[0])
     {
 	FILE *fp = fopen(port_file, "w");
@@ -1246,83 +6032,107 @@ void run_accept_loop(kmer_handle_t *kmersH, in_port_t port, char *port_file, pid
 	fclose(fp);
     }
 
-    listen(listenfd, 10);
+    listen(listenfd, 10 + num_threads);
+
+    accept_worker_t *workers = malloc(num_threads * sizeof(accept_worker_t));
+    int i;
+    for (i = 0; i < num_threads; i++)
+    {
+	init_scan_ctx(&workers[i].ctx, kmersH);
+	init_reader(&workers[i].reader, -1);
+	workers[i].listenfd = listenfd;
+	workers[i].parent = parent;
+    }
+    server_workers = workers;
+    server_num_workers = num_threads;
+    server_start = now_seconds();
+    for (i = 1; i < num_threads; i++)
+    {
+	int rc = pthread_create(&workers[i].thread, NULL, accept_worker_main, &workers[i]);
+	if (rc != 0)
+	{
+	    fprintf(stderr, "could not create worker thread %d: %s\n", i, strerror(rc));
+	    exit(1);
+	}
+    }
+
+    /* the main thread is worker 0 */
+    accept_worker_main(&workers[0]);
+}
+
+void *accept_worker_main(void *arg)
+{
+    accept_worker_t *w = (accept_worker_t *) arg;
 
-    int save_aa = aa;
-    int save_hits_only = hits_only;
-    int save_debug = debug;
-    int save_min_hits = min_hits;
-    int save_min_weighted_hits = min_weighted_hits;
-    int save_order_constraint = order_constraint;
-    int save_max_gap = max_gap;
-    
     while(1)
     {
 	/*
 	 * If we have a parent set, and parent doesn't exist, exit.
 	 */
-	if (parent > 0)
+	if (w->parent > 0)
 	{
-	    int rc = kill(parent, 0);
+	    int rc = kill(w->parent, 0);
 	    if (rc < 0)
 	    {
-		fprintf(stderr, "Parent process %d does not exist any more, exiting\n", parent);
+		fprintf(stderr, "Parent process %d does not exist any more, exiting\n", w->parent);
 		exit(0);
 	    }
 	}
-	
-      aa = save_aa;
-      hits_only = save_hits_only;
-      debug = save_debug;
-      min_hits = save_min_hits;
-      min_weighted_hits = save_min_weighted_hits;
-      order_constraint = save_order_constraint;
-      max_gap = save_max_gap;
-      
-      connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
-      struct sockaddr_in peer;
-      socklen_t peer_len = sizeof(peer);
-      memset(&peer, 0, sizeof(peer));
-      
-      getpeername(connfd, (struct sockaddr *) &peer, &peer_len);
 
-      char *who = inet_ntoa(peer.sin_addr);
-      // fprintf(stderr, "connection from %s\n", who);
-	
-      FILE *fh_in = fdopen(connfd, "r");
-      FILE *fh_out = fdopen(connfd, "w");
+	int connfd = accept(w->listenfd, (struct sockaddr*)NULL, NULL);
+	if (connfd < 0)
+	{
+	    if (errno != EINTR)
+		perror("accept failed");
+	    continue;
+	}
 
-      /*
-       * If the first line starts with a '-', then it's
-       * a set of options to be set for this document.
-       */
+	reset_scan_options(&w->ctx);
+	handle_connection(&w->ctx, &w->reader, connfd);
+    }
+    return 0;
+}
 
-      int c = fgetc(fh_in);
-      if (c == '-')
-      {
+/*
+ * -S: the counters of all the workers added up.  The other workers' counters
+ * are read while they may be changing, so the totals are approximate.
+ */
+void print_server_stats(FILE *fh)
+{
+    scan_stats_t total;
+    int i;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < server_num_workers; i++)
+	add_stats(&total, &server_workers[i].ctx.stats);
+    fprintf(fh, "STAT\tworkers\t%d\n", server_num_workers);
+    fprintf(fh, "STAT\tuptime\t%.3f\n", now_seconds() - server_start);
+    print_stats(fh, &total);
+}
+
+/*
+ * Read an option line ("-a -m 3 ...") from r into ctx.  Returns 0, or -1
+ * after writing an ERR line to fh_out.
+ */
+int read_option_line(kmer_scan_ctx_t *ctx, fasta_reader_t *r, FILE *fh_out, char *who)
+{
+	int c;
 	char linebuf[1024];
-	linebuf[0] = c;
-	  
-	if (fgets(linebuf + 1, sizeof(linebuf) - 2, fh_in) == 0)
-	{
-	  fprintf(stderr, "Error reading options line from %s\n", who);
-	  fclose(fh_in);
-	  fclose(fh_out);
-	  continue;
-	}
+	size_t line_len;
+	char *line = reader_getline(r, &line_len);
+	snprintf(linebuf, sizeof(linebuf), "%s", line);
 
-	char *s = strchr(linebuf, '\n');
-	if (s)
-	  *s = 0;
+	char *s;
 	  
 	/* parse into an argv */
 	const int max_args = 20;
 	char *argv[max_args + 2];
 	int n = 0;
+	char *tok_state;
 	// fprintf(stderr, "Parsing option line '%s'\n", linebuf);
 	argv[n++] = "nothing";
 
-	s = strtok(linebuf, " \t");
+	s = strtok_r(linebuf, " \t", &tok_state);
 	while (s)
 	{
 	    // fprintf(stderr, "argv[%d] = '%s'\n", n, s);
@@ -1331,71 +6141,493 @@ void run_accept_loop(kmer_handle_t *kmersH, in_port_t port, char *port_file, pid
 	  {
 	    fprintf(stderr, "too many args in connection from %s\n", who);
 	    fprintf(fh_out, "ERR too many args\n");
-	    fflush(fh_out);
-	    fclose(fh_out);
-	    fclose(fh_in);
-	    s = 0;
-	    break;
+	    return -1;
 	  }
-	  s = strtok(0, " \t");
-	}
-	if (n >= max_args)
-	{
-	  continue;
+	  s = strtok_r(0, " \t", &tok_state);
 	}
 	argv[n] = 0;
 
 	char *past;
 	int arg_error = 0;
+	int want_stats = 0;
 
-	optind = 1;
-	while ((c = getopt(n, argv, "ad:m:M:Og:")) != -1)
+	pthread_mutex_lock(&getopt_lock);
+	optind = 0;                   /* 0, not 1: glibc then also forgets a half-parsed option cluster */
+	while ((c = getopt(n, argv, "ad:m:M:Og:F:W:B:o:R:pS")) != -1)
 	{
 	  switch (c) {
 	  case 'a':
-	    aa = 1;
+	    ctx->aa = 1;
 	    break;
 	  case 'd':
-	    debug = strtol(optarg,&past,0);
+	    ctx->debug = strtol(optarg,&past,0);
 	    break;
 	  case 'm':
-	    min_hits = strtol(optarg,&past,0);
+	    ctx->min_hits = strtol(optarg,&past,0);
 	    break;
 	  case 'M':
-	    min_weighted_hits = strtol(optarg,&past,0);
+	    ctx->min_weighted_hits = strtol(optarg,&past,0);
 	    break;
 	  case 'O':
-	    order_constraint = 1;
+	    ctx->order_constraint = 1;
 	    break;
 	  case 'g':
-	    max_gap = strtol(optarg,&past,0);
+	    ctx->max_gap = strtol(optarg,&past,0);
+	    break;
+	  case 'F':
+	    ctx->parallel_frames_min = strtol(optarg,&past,0);
+	    break;
+	  case 'B':
+	    ctx->binary_output = strtol(optarg,&past,0);
+	    if ((ctx->binary_output < 0) || (ctx->binary_output > 2)) {
+	      fprintf(fh_out, "ERR invalid output mode %s\n", optarg);
+	      arg_error = 1;
+	    }
+	    break;
+	  case 'o':
+	    ctx->otu_report = strtol(optarg,&past,0);
+	    if (ctx->otu_report < 0)
+	      ctx->otu_report = 0;
+	    break;
+	  case 'R':
+	    ctx->classify = strtol(optarg,&past,0);
+	    if ((ctx->classify < 0) || (ctx->classify > 2)) {
+	      fprintf(fh_out, "ERR invalid read mode %s\n", optarg);
+	      arg_error = 1;
+	    }
+	    break;
+	  case 'W':
+	    ctx->scan_window = strtol(optarg,&past,0);
+	    if (ctx->scan_window < 1)
+	      ctx->scan_window = 1;
+	    if (ctx->scan_window > MAX_SCAN_WINDOW)
+	      ctx->scan_window = MAX_SCAN_WINDOW;
+	    break;
+	  case 'p':
+	    ctx->persistent = 1;
+	    break;
+	  case 'S':
+	    want_stats = 1;
 	    break;
 	  default:
 	    fprintf(fh_out, "ERR invalid argument %c\n", c);
-	    fflush(fh_out);
-	    fclose(fh_out);
-	    fclose(fh_in);
 	    arg_error = 1;
 	    break;
 	  }
+	  if (arg_error)
+	    break;
 	}
+	pthread_mutex_unlock(&getopt_lock);
 	if (arg_error)
-	  continue;
-	if (!hits_only)
-	    fprintf(fh_out, "OK aa=%d debug=%d min_hits=%d min_weighted_hits=%d order_constraint=%d max_gap=%d\n",
-		    aa, debug, min_hits, min_weighted_hits, order_constraint, max_gap);
+	  return -1;
+
+	if (!ctx->hits_only) {
+	    fprintf(fh_out, "OK aa=%d debug=%d min_hits=%d min_weighted_hits=%d order_constraint=%d max_gap=%d",
+		    ctx->aa, ctx->debug, ctx->min_hits, ctx->min_weighted_hits, ctx->order_constraint, ctx->max_gap);
+	    if (ctx->binary_output)
+		fprintf(fh_out, " binary=%d", ctx->binary_output);
+	    if (ctx->otu_report != OTU_REPORT)
+		fprintf(fh_out, " otu_report=%d", ctx->otu_report);
+	    if (ctx->classify)
+		fprintf(fh_out, " reads=%d", ctx->classify);
+	    fprintf(fh_out, "\n");
+	}
+	if (want_stats)
+	    print_server_stats(fh_out);
+	return 0;
+}
+
+/*
+ * Persistent connections (-p) are pipelined: results are handed to a
+ * writer thread, which sends them while the worker goes on reading and
+ * scanning the next request.  The connection's output FILE is a cookie
+ * stream whose buffer (OUTPUT_BUFSZ) is queued each time it is flushed;
+ * at most WRITER_MAX_PENDING bytes wait in the queue before the worker
+ * blocks on the client.
+ */
+#define WRITER_MAX_PENDING (16 << 20)
+
+typedef struct out_chunk {
+  struct out_chunk *next;
+  size_t len;
+  char data[];
+} out_chunk_t;
+
+typedef struct conn_writer {
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  out_chunk_t *head;
+  out_chunk_t *tail;
+  size_t pending;
+  int closing;
+  int failed;                      /* the client went away; output is dropped */
+  pthread_t thread;
+} conn_writer_t;
+
+void *conn_writer_main(void *arg)
+{
+  conn_writer_t *w = (conn_writer_t *) arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while ((w->head == 0) && !w->closing)
+      pthread_cond_wait(&w->cond, &w->lock);
+    out_chunk_t *chunk = w->head;
+    if (chunk == 0)
+      break;
+    w->head = chunk->next;
+    if (w->head == 0)
+      w->tail = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    size_t off = 0;
+    while (!w->failed && (off < chunk->len)) {
+      ssize_t n = write(w->fd, chunk->data + off, chunk->len - off);
+      if (n > 0)
+	off += n;
+      else if ((n < 0) && (errno != EINTR))
+	w->failed = 1;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->pending -= chunk->len;
+    free(chunk);
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+ssize_t conn_writer_write(void *cookie, const char *buf, size_t size)
+{
+  conn_writer_t *w = (conn_writer_t *) cookie;
+  out_chunk_t *chunk = malloc(sizeof(out_chunk_t) + size);
+  if (chunk == 0)
+    return -1;
+  chunk->next = 0;
+  chunk->len  = size;
+  memcpy(chunk->data, buf, size);
+
+  pthread_mutex_lock(&w->lock);
+  while ((w->pending > WRITER_MAX_PENDING) && !w->failed)
+    pthread_cond_wait(&w->cond, &w->lock);
+  if (w->tail)
+    w->tail->next = chunk;
+  else
+    w->head = chunk;
+  w->tail = chunk;
+  w->pending += size;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  return size;
+}
+
+/* drain the queue, stop the writer and close its descriptor */
+int conn_writer_close(void *cookie)
+{
+  conn_writer_t *w = (conn_writer_t *) cookie;
+  pthread_mutex_lock(&w->lock);
+  w->closing = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  close(w->fd);
+  free(w);
+  return 0;
+}
+
+/* an output FILE for fd whose writes are done by a writer thread; takes over fd */
+FILE *open_conn_writer(int fd)
+{
+  conn_writer_t *w = malloc(sizeof(conn_writer_t));
+  memset(w, 0, sizeof(*w));
+  w->fd = fd;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (pthread_create(&w->thread, NULL, conn_writer_main, w) != 0) {
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w);
+    return 0;
+  }
+
+  cookie_io_functions_t io = { 0, conn_writer_write, 0, conn_writer_close };
+  FILE *fh = fopencookie(w, "w", io);
+  if (fh == 0) {
+    conn_writer_close(w);
+    return 0;
+  }
+  setvbuf(fh, NULL, _IOFBF, OUTPUT_BUFSZ);
+  return fh;
+}
+
+/*
+ * One connection.  By default it carries a single request: an optional
+ * option line, then sequences up to end of input.  With -p on the first
+ * option line it carries a series of requests, each an optional option
+ * line (applied on top of the server's defaults), its sequences, and a
+ * line "//"; the output of each ends with the // (or flush record) of its
+ * terminator.  The client may send the next request at any time.
+ */
+void handle_connection(kmer_scan_ctx_t *ctx, fasta_reader_t *r, int connfd)
+{
+      struct sockaddr_in peer;
+      socklen_t peer_len = sizeof(peer);
+      memset(&peer, 0, sizeof(peer));
+      
+      getpeername(connfd, (struct sockaddr *) &peer, &peer_len);
+
+      char who[INET_ADDRSTRLEN];
+      if (inet_ntop(AF_INET, &peer.sin_addr, who, sizeof(who)) == 0)
+	strcpy(who, "unknown");
+      // fprintf(stderr, "connection from %s\n", who);
+
+      /*
+       * Input is read straight from connfd by the worker's reader; the
+       * output stream gets its own descriptor, so closing it leaves
+       * connfd for us to close.
+       */
+      reader_attach(r, connfd);
+      ctx->persistent = 0;
+      ctx->dictionary_sent = 0;
+      int out_fd = dup(connfd);
+      FILE *fh_out = (out_fd < 0) ? 0 : fdopen(out_fd, "w");
+      if (fh_out == 0)
+      {
+	fprintf(stderr, "Error opening stream for connection from %s: %s\n", who, strerror(errno));
+	if (out_fd >= 0)
+	  close(out_fd);
+	close(connfd);
+	return;
       }
-      else
+      setvbuf(fh_out, NULL, _IOFBF, OUTPUT_BUFSZ);
+
+      /*
+       * If the first line starts with a '-', then it's
+       * a set of options to be set for this document.
+       */
+
+      if ((reader_peek(r) == '-') && (read_option_line(ctx, r, fh_out, who) < 0))
       {
-	ungetc(c, fh_in);
+	fflush(fh_out);
+	fclose(fh_out);
+	close(connfd);
+	return;
       }
 
-      
-      run_from_filehandle(kmersH, fh_in, fh_out);
+      if (! ctx->persistent)
+      {
+	run_from_reader(ctx, r, fh_out);
+	fflush(fh_out);
+	fclose(fh_out);
+	close(connfd);
+	return;
+      }
 
+      /*
+       * Switch the output over to a writer thread (the OK line so far
+       * goes out first).
+       */
       fflush(fh_out);
-      fclose(fh_in);
+      FILE *fh_pipe = open_conn_writer(dup(connfd));
       fclose(fh_out);
+      if (fh_pipe == 0)
+      {
+	fprintf(stderr, "Error starting writer for connection from %s\n", who);
+	close(connfd);
+	return;
+      }
+      r->requests = 1;
+
+      /* the first request's options have been read already */
+      while (run_from_reader(ctx, r, fh_pipe) != FASTA_EOF)
+      {
+	emit_flush(ctx, fh_pipe);
+	fflush(fh_pipe);
+
+	reset_scan_options(ctx);
+	while ((reader_peek(r) == '-') && (read_option_line(ctx, r, fh_pipe, who) < 0))
+	{
+	  /* skip the rest of the rejected request */
+	  char *id, *data;
+	  size_t len;
+	  int rc;
+	  while (((rc = read_fasta_record(r, &id, &data, &len)) != FASTA_EOF) && (rc != FASTA_END))
+	    ;
+	  emit_flush(ctx, fh_pipe);
+	  fflush(fh_pipe);
+	  reset_scan_options(ctx);
+	}
+      }
+
+      fflush(fh_pipe);
+      fclose(fh_pipe);
+      r->requests = 0;
+      close(connfd);
+}
+
+/*
+ * The library interface (see kmer_guts.h).  A kmer_db_t is a handle from
+ * open_kmers, and a kmer_scan_ctx_t a scan context whose results go to
+ * callbacks rather than to an output stream; the scan itself is the one
+ * the program runs.
+ */
+KMER_GUTS_API kmer_db_t *kmer_db_open(const char *data_dir, char *err, size_t err_len)
+{
+  char buf[1024];
+  kmer_handle_t *handle = open_kmers(data_dir, buf, sizeof(buf));
+  if ((handle == 0) && err && err_len)
+    snprintf(err, err_len, "%s", buf);
+  else if (handle && handle->image_copied)
+    wait_for_table(handle);      /* a copy is only readable once it is complete */
+  return handle;
+}
+
+KMER_GUTS_API void kmer_db_wait(kmer_db_t *db)
+{
+  wait_for_table(db);
+}
+
+KMER_GUTS_API void kmer_db_close(kmer_db_t *db)
+{
+  close_kmers(db);
+}
+
+KMER_GUTS_API int kmer_db_kmer_size(const kmer_db_t *db)
+{
+  return db->k;
+}
+
+KMER_GUTS_API int kmer_db_num_functions(const kmer_db_t *db)
+{
+  return table_count(&db->functions);
+}
+
+KMER_GUTS_API int kmer_db_num_otus(const kmer_db_t *db)
+{
+  return table_count(&db->otus);
+}
 
+KMER_GUTS_API const char *kmer_db_function(const kmer_db_t *db, int function_index)
+{
+  if ((function_index < 0) || ((unsigned long long) function_index >= table_count(&db->functions)))
+    return 0;
+  return table_string(&db->functions, function_index);
+}
+
+KMER_GUTS_API const char *kmer_db_otu(const kmer_db_t *db, int otu_index)
+{
+  if ((otu_index < 0) || ((unsigned long long) otu_index >= table_count(&db->otus)))
+    return 0;
+  return table_string(&db->otus, otu_index);
+}
+
+KMER_GUTS_API kmer_scan_ctx_t *kmer_scan_ctx_new(kmer_db_t *db)
+{
+  kmer_scan_ctx_t *ctx = malloc(sizeof(kmer_scan_ctx_t));
+  if (ctx == 0)
+    return 0;
+  init_scan_ctx(ctx, db);
+  if (ctx->hits == 0) {
+    free(ctx);
+    return 0;
+  }
+  /* the library has no command line: the defaults are the program's */
+  ctx->aa                  = 0;
+  ctx->hits_only           = 0;
+  ctx->debug               = 0;
+  ctx->min_hits            = 5;
+  ctx->min_weighted_hits   = 0;
+  ctx->order_constraint    = 0;
+  ctx->max_gap             = 200;
+  ctx->parallel_frames_min = 0;
+  ctx->binary_output       = 0;
+  ctx->otu_report          = OTU_REPORT;
+  return ctx;
+}
+
+KMER_GUTS_API void kmer_scan_ctx_free(kmer_scan_ctx_t *ctx)
+{
+  if (ctx == 0)
+    return;
+  free_scan_ctx(ctx);
+  free(ctx);
+}
+
+KMER_GUTS_API int kmer_scan_set(kmer_scan_ctx_t *ctx, kmer_scan_option_t option, int value)
+{
+  switch (option) {
+  case KMER_SCAN_MIN_HITS:
+    ctx->min_hits = value;
+    return 0;
+  case KMER_SCAN_MIN_WEIGHTED_HITS:
+    ctx->min_weighted_hits = value;
+    return 0;
+  case KMER_SCAN_MAX_GAP:
+    ctx->max_gap = value;
+    return 0;
+  case KMER_SCAN_ORDER_CONSTRAINT:
+    if ((value != 0) && (value != 1))
+      return -1;
+    ctx->order_constraint = value;
+    return 0;
+  case KMER_SCAN_OTU_REPORT:
+    if (value < 0)
+      return -1;
+    ctx->otu_report = value;
+    return 0;
+  }
+  return -1;
+}
+
+/* compact seq into ctx->input (as the reader would) and scan it */
+static int scan_buffer(kmer_scan_ctx_t *ctx, const char *id, const char *seq, size_t len,
+		       const kmer_callbacks_t *cb, int is_aa)
+{
+  if (len >= INT_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ctx->input_size < len + 1) {
+    char *input = realloc(ctx->input, len + 1);
+    if (input == 0) {
+      errno = ENOMEM;
+      return -1;
     }
+    ctx->input      = input;
+    ctx->input_size = len + 1;
+  }
+  pthread_once(&residue_tables_once, init_residue_tables);
+  size_t n = compact_residues(ctx->input, seq, len);
+  ctx->input[n] = '\0';
+
+  ctx->aa        = is_aa;
+  ctx->callbacks = cb;
+  ctx->stats.bytes_in += len;
+  ctx->alloc_failed = 0;
+  if (is_aa)
+    process_aa_seq(ctx, id ? (char *) id : "", ctx->input, n, 0);
+  else
+    process_seq(ctx, id ? (char *) id : "", ctx->input, n, 0);
+  ctx->callbacks = 0;
+  if (ctx->alloc_failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+KMER_GUTS_API int kmer_scan_dna(kmer_scan_ctx_t *ctx, const char *id, const char *seq, size_t len,
+				const kmer_callbacks_t *cb)
+{
+  return scan_buffer(ctx, id, seq, len, cb, 0);
+}
+
+KMER_GUTS_API int kmer_scan_protein(kmer_scan_ctx_t *ctx, const char *id, const char *seq, size_t len,
+				    const kmer_callbacks_t *cb)
+{
+  return scan_buffer(ctx, id, seq, len, cb, 1);
 }
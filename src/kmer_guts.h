@@ -0,0 +1,131 @@
+/*
+ * libkmerguts: the kmer_guts scanner as a library.
+ *
+ * A kmer_db_t is a memory image (as written by kmer_guts -w) opened for
+ * searching; one may be shared by any number of threads.  Each thread
+ * scans with its own kmer_scan_ctx_t.  Sequences are passed as buffers,
+ * and the results come back through callbacks in the order kmer_guts
+ * prints them: the calls of each frame in turn (the three forward frames,
+ * then the three reverse ones; the one frame of a protein), then the OTU
+ * counts of the sequence.  Nothing is written to stdout; loading the
+ * table logs a few lines to stderr, as kmer_guts does.
+ *
+ * The kmer_guts program is built from the same source and uses the same
+ * scan; build the library with -DKMER_GUTS_LIBRARY (see the Makefile)
+ * and link with -lkmerguts -lpthread -lm.
+ */
+
+#ifndef KMER_GUTS_H
+#define KMER_GUTS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KMER_GUTS_API_VERSION 1
+
+#ifdef KMER_GUTS_LIBRARY
+#define KMER_GUTS_API __attribute__((visibility("default")))
+#else
+#define KMER_GUTS_API
+#endif
+
+typedef struct kmer_handle   kmer_db_t;
+typedef struct kmer_scan_ctx kmer_scan_ctx_t;
+
+/* a region called for a function (a CALL line) */
+typedef struct kmer_call {
+  const char *id;              /* the sequence */
+  char  strand;                /* '+' or '-'; '+' for a protein */
+  int   frame;                 /* the frame's offset, 0 to 2; 0 for a protein */
+  int   start;                 /* first and last residue of the region, */
+  int   end;                   /*   counted in the frame's translation */
+  int   hits;                  /* signature kmers of the function in it */
+  float weighted_hits;         /* the sum of their weights */
+  int   function_index;
+  const char *function;        /* the function's name */
+} kmer_call_t;
+
+/* votes for an OTU (an OTU-COUNTS entry) */
+typedef struct kmer_otu_count {
+  int otu_index;
+  int count;
+} kmer_otu_count_t;
+
+/* Either function may be 0.  The pointers passed are only valid during
+   the call. */
+typedef struct kmer_callbacks {
+  void (*call)(void *arg, const kmer_call_t *call);
+  /* the OTUs with the most votes in the sequence, most first */
+  void (*otu_counts)(void *arg, const char *id, const kmer_otu_count_t *counts, int n);
+  void *arg;
+} kmer_callbacks_t;
+
+/* the scan settings of kmer_scan_set; the defaults are kmer_guts's */
+typedef enum kmer_scan_option {
+  KMER_SCAN_MIN_HITS = 1,      /* -m: hits needed for a call (5) */
+  KMER_SCAN_MIN_WEIGHTED_HITS, /* -M: summed weight needed for a call (0) */
+  KMER_SCAN_MAX_GAP,           /* -g: largest gap between hits of a set (200) */
+  KMER_SCAN_ORDER_CONSTRAINT,  /* -O: 1 to use the order constraint (0) */
+  KMER_SCAN_OTU_REPORT         /* -o: OTUs passed to otu_counts, 0 for all (5) */
+} kmer_scan_option_t;
+
+/*
+ * Open the memory image in data_dir (data_dir/kmer.table.mem_map, with
+ * the delta kmer.delta.mem_map if there is one, and for images older than
+ * version 3 the function.index and otu.index beside it).  Returns 0 if it
+ * cannot be opened or is not an image this code understands, with the
+ * reason in err (if err is not 0).  The table is paged in by a background
+ * thread; scans may start at once.
+ *
+ * A version 1 image does not record K, and the library always takes it
+ * to hold 8-mers (the program's default; kmer_guts -K is the only way to
+ * read a version 1 image of other K).  Rebuild such images with -V 2 or
+ * later to use them here.
+ */
+KMER_GUTS_API kmer_db_t *kmer_db_open(const char *data_dir, char *err, size_t err_len);
+
+/* wait until the whole table is in memory */
+KMER_GUTS_API void kmer_db_wait(kmer_db_t *db);
+
+/* release db; every context made for it must have been freed */
+KMER_GUTS_API void kmer_db_close(kmer_db_t *db);
+
+KMER_GUTS_API int kmer_db_kmer_size(const kmer_db_t *db);
+KMER_GUTS_API int kmer_db_num_functions(const kmer_db_t *db);
+KMER_GUTS_API int kmer_db_num_otus(const kmer_db_t *db);
+
+/* the name of a function or OTU index, or 0 if there is no such index;
+   the string lives as long as db */
+KMER_GUTS_API const char *kmer_db_function(const kmer_db_t *db, int function_index);
+KMER_GUTS_API const char *kmer_db_otu(const kmer_db_t *db, int otu_index);
+
+/* a scan context for one thread at a time; 0 if out of memory */
+KMER_GUTS_API kmer_scan_ctx_t *kmer_scan_ctx_new(kmer_db_t *db);
+KMER_GUTS_API void kmer_scan_ctx_free(kmer_scan_ctx_t *ctx);
+
+/* change a setting of ctx; returns 0, or -1 for an unknown option or a
+   value out of range */
+KMER_GUTS_API int kmer_scan_set(kmer_scan_ctx_t *ctx, kmer_scan_option_t option, int value);
+
+/*
+ * Scan the len bytes of seq, a DNA contig (all six frames) or a protein.
+ * Case does not matter and whitespace is skipped; seq is not modified and
+ * need not be NUL-terminated.  id names the sequence in the results.
+ * Returns 0, or -1 with errno EINVAL if the sequence is too long or
+ * ENOMEM if memory runs out; after ENOMEM some results may have been
+ * dropped.  The scan runs on the calling thread and never exits the
+ * process.
+ */
+KMER_GUTS_API int kmer_scan_dna(kmer_scan_ctx_t *ctx, const char *id, const char *seq, size_t len,
+				const kmer_callbacks_t *cb);
+KMER_GUTS_API int kmer_scan_protein(kmer_scan_ctx_t *ctx, const char *id, const char *seq, size_t len,
+				    const kmer_callbacks_t *cb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KMER_GUTS_H */
@@ -0,0 +1,179 @@
+use strict;
+use warnings;
+
+use Test::More;
+use File::Temp qw(tempdir);
+use File::Copy;
+use FindBin;
+
+#
+# kmer_guts regression tests.  A small synthetic data set is made with
+# src/bench/run_bench.pl --data-only, and every way of building or
+# scanning the table that is meant to give the same calls as a plain scan
+# of a plain (-I modulo) image is checked against that scan.
+#
+# Run from the top of the repository after "make src/kmer_guts", or give
+# the binary in KMER_GUTS; the data set is made in a temporary directory.
+#
+
+my $top   = "$FindBin::Bin/../..";
+my $guts  = $ENV{KMER_GUTS} || "$top/src/kmer_guts";
+my $gen   = "$top/src/bench/run_bench.pl";
+
+plan skip_all => "$guts is not built" unless -x $guts;
+
+my $tmp = tempdir("kmer_guts_t_XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my $log = "$tmp/stderr";
+
+system("perl", $gen, "--dir", "$tmp/gen", "--data-only", "--kmers", 20000, "--functions", 200,
+       "--otus", 50, "--genome-bases", 300000, "--proteins", 300) == 0
+    or BAIL_OUT("could not make the data set with $gen");
+my $dna  = "$tmp/gen/genome.fa";
+my $prot = "$tmp/gen/proteins.fa";
+
+# a Data directory holding the given final.kmers and the index files
+sub data_dir
+{
+    my($name, $kmers) = @_;
+    my $dir = "$tmp/$name";
+    mkdir($dir) or die "Cannot mkdir $dir: $!\n";
+    copy($kmers // "$tmp/gen/final.kmers", "$dir/final.kmers") or die "Cannot copy final.kmers: $!\n";
+    copy("$tmp/gen/$_", "$dir/$_") or die "Cannot copy $_: $!\n" for qw(function.index otu.index);
+    return $dir;
+}
+
+# run kmer_guts; returns its stdout, or undef if it failed
+sub guts
+{
+    my($opts, $input) = @_;
+    my $out = `$guts $opts < $input 2>> $log`;
+    return ($? == 0) ? $out : undef;
+}
+
+sub build
+{
+    my($dir, $opts) = @_;
+    ok(defined guts("-w -D $dir $opts", "/dev/null"), "kmer_guts -w $opts");
+}
+
+#
+# The reference: a plain image and plain scans of the genome and proteins.
+#
+my $plain = data_dir("plain");
+build($plain, "-s 60000");
+my $want_dna  = guts("-D $plain", $dna);
+my $want_prot = guts("-D $plain -a", $prot);
+ok(defined($want_dna) && ($want_dna =~ /^CALL/m), "plain DNA scan makes calls");
+ok(defined($want_prot) && ($want_prot =~ /^CALL/m), "plain protein scan makes calls");
+
+# both scans of Data with extra options must match the plain ones
+sub same_scans
+{
+    my($dir, $opts, $what) = @_;
+    is(guts("-D $dir $opts", $dna), $want_dna, "$what: DNA scan");
+    is(guts("-D $dir $opts -a", $prot), $want_prot, "$what: protein scan");
+}
+
+#
+# Scanning options that must not change the output.
+#
+same_scans($plain, "-F 1000", "-F 1000");
+same_scans($plain, "-W 100", "-W 100");
+same_scans($plain, "-F 1000 -W 100", "-F 1000 -W 100");
+same_scans($plain, "-j 1", "-j 1");
+ok(!defined guts("-D $plain -G thp -j 1", $dna), "-j 1 is refused with -G thp");
+
+#
+# The other table organizations, and the prefilter.
+#
+for my $case (["robinhood", "-s 60000 -I robinhood"],
+	      ["mph",       "-I mph"],
+	      ["filter",    "-s 60000 -E 0.01"],
+	      ["version2",  "-s 60000 -V 2"],
+	      ["version1",  "-s 60000 -V 1"])
+{
+    my($name, $opts) = @$case;
+    my $dir = data_dir($name);
+    build($dir, $opts);
+    same_scans($dir, "", $opts);
+    same_scans($dir, "-j 1", "$opts, then -j 1");
+}
+
+#
+# A rebuild must not leave -j reading the old table's kmer.sorted: make
+# kmer.sorted, rebuild from different kmers, and scan with -j again.
+#
+my @kmers = do { open(my $fh, "<", "$tmp/gen/final.kmers") or die "$!\n"; <$fh> };
+my $half = "$tmp/half.kmers";
+open(my $hfh, ">", $half) or die "Cannot write $half: $!\n";
+print $hfh @kmers[0 .. $#kmers / 2];
+close($hfh);
+
+my $rebuilt = data_dir("rebuilt");
+build($rebuilt, "-s 60000");
+is(guts("-D $rebuilt -j 1", $dna), $want_dna, "-j 1 before the rebuild");
+copy($half, "$rebuilt/final.kmers") or die "Cannot copy $half: $!\n";
+build($rebuilt, "-s 60000");
+ok(!-e "$rebuilt/kmer.sorted", "-w removes kmer.sorted");
+my $half_dna = guts("-D $rebuilt", $dna);
+isnt($half_dna, $want_dna, "the rebuilt table gives other calls");
+is(guts("-D $rebuilt -j 1", $dna), $half_dna, "-j 1 after the rebuild");
+
+#
+# -u then -c: a delta that deletes some kmers and reassigns others must
+# scan as a table built from the changed final.kmers would, both as a
+# delta and once compacted into the map.
+#
+my(@changed, @delta);
+for my $i (0 .. $#kmers)
+{
+    my $line = $kmers[$i];
+    my($kmer, $off, $fI, $wt, $oI) = split(/\t/, $line);
+    if ($i % 10 == 0)
+    {
+	push(@delta, "$kmer\t-\n");
+	next;
+    }
+    if ($i % 10 == 1)
+    {
+	$line = join("\t", $kmer, $off, ($fI + 1) % 200, $wt, $oI);
+	push(@delta, $line);
+    }
+    push(@changed, $line);
+}
+my $changed = "$tmp/changed.kmers";
+open(my $cfh, ">", $changed) or die "Cannot write $changed: $!\n";
+print $cfh @changed;
+close($cfh);
+
+my $expect = data_dir("expect", $changed);
+build($expect, "-s 60000");
+my $expect_dna  = guts("-D $expect", $dna);
+my $expect_prot = guts("-D $expect -a", $prot);
+
+for my $case (["delta", "-s 60000"], ["delta_mph", "-I mph"], ["delta_v2", "-s 60000 -V 2"])
+{
+    my($name, $opts) = @$case;
+    my $dir = data_dir($name);
+    build($dir, $opts);
+    guts("-D $dir -j 1", $dna);                 # a kmer.sorted for -u to make stale
+    open(my $dfh, ">", "$dir/delta.kmers") or die "Cannot write $dir/delta.kmers: $!\n";
+    print $dfh @delta;
+    close($dfh);
+
+    ok(defined guts("-u -D $dir", "/dev/null"), "$opts: -u");
+    is(guts("-D $dir", $dna), $expect_dna, "$opts: DNA scan with the delta");
+    is(guts("-D $dir -a", $prot), $expect_prot, "$opts: protein scan with the delta");
+    is(guts("-D $dir -j 1", $dna), $expect_dna, "$opts: -j 1 with the delta");
+
+    my $before = -s "$dir/kmer.table.mem_map";
+    ok(defined guts("-c -D $dir", "/dev/null"), "$opts: -c");
+    ok(!-e "$dir/kmer.delta.mem_map", "$opts: -c removes the delta");
+    is(-s "$dir/kmer.table.mem_map", $before, "$opts: -c keeps the size and version")
+	unless $opts =~ /mph/;
+    is(guts("-D $dir", $dna), $expect_dna, "$opts: DNA scan after -c");
+    is(guts("-D $dir -a", $prot), $expect_prot, "$opts: protein scan after -c");
+    is(guts("-D $dir -j 1", $dna), $expect_dna, "$opts: -j 1 after -c");
+}
+
+done_testing();